@@ -0,0 +1,52 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#pragma once
+
+#include "circle.h"
+
+#include <algorithm>
+#include <vector>
+
+/// Sweep and prune broadphase for circles. Shapes are sorted by the
+/// left edge of their bounding boxes, and only those whose boxes
+/// overlap are handed on to the narrowphase. Each candidate pair is
+/// reported exactly once, lowest index first. The object keeps its
+/// scratch space between calls, so reuse it from frame to frame.
+class broadphase {
+public:
+  template<typename F>
+  void find_pairs(std::vector<circle> const & shapes, F && fn) {
+    order_.resize(shapes.size());
+    for( unsigned i=0; i<order_.size(); ++i ) {
+      order_[i] = i;
+    }
+    std::sort(order_.begin(), order_.end(), [&](unsigned a, unsigned b) {
+      sim_real const ax = shapes[a].center().x() - shapes[a].radius();
+      sim_real const bx = shapes[b].center().x() - shapes[b].radius();
+      return ax < bx || (ax == bx && a < b);
+    });
+
+    for( unsigned i=0; i<order_.size(); ++i ) {
+      circle const & a = shapes[order_[i]];
+      sim_real const a_max_x = a.center().x() + a.radius();
+      for( unsigned j=i+1; j<order_.size(); ++j ) {
+        circle const & b = shapes[order_[j]];
+        if( b.center().x() - b.radius() > a_max_x ) {
+          break;
+        }
+        using std::abs;
+        sim_real const dy = abs(a.center().y() - b.center().y());
+        if( dy > a.radius() + b.radius() ) {
+          continue;
+        }
+        fn(std::min(order_[i], order_[j]), std::max(order_[i], order_[j]));
+      }
+    }
+  }
+
+private:
+  std::vector<unsigned> order_;
+};
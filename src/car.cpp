@@ -5,34 +5,25 @@
 */
 #include "car.h"
 
-#include "render_helpers.h"
-
-#include <GL/gl.h>
-
 #include <cmath>
 
-car::car(vec2 const & pos, unsigned color, std::shared_ptr<model> model)
-  : pos_(pos),
-    theta_(0),
-    vel_(0),
-    throttle_(0),
-    brake_(0),
-    turn_(0),
+car::car(sim_vec2 const & pos, unsigned color, std::shared_ptr<model> model)
+  : car(pos, color, model, std::make_shared<car_batch>())
+{}
+
+car::car(sim_vec2 const & pos, unsigned color, std::shared_ptr<model> model, std::shared_ptr<car_batch> batch)
+  : batch_(batch),
+    index_(batch->add()),
+    prev_pos_(pos),
+    prev_heading_(sim_vec2::y_axis()),
+    twist_(0),
     segment_(0xF),
-    spin_timer_(0),
-    spin_(0),
     score_(0),
     color_(color),
     model_(model)
-{}
-
-void car::draw() const {
-  glPushMatrix();
-  glTranslated(pos_.x(), pos_.y(), 0);
-  glRotated(theta_ * 180/M_PI, 0, 0, -1);
-  set_color(color_);
-  model_->draw();
-  glPopMatrix();
+{
+  set_pos(pos);
+  set_heading(sim_vec2::y_axis());
 }
 
 template<typename T>
@@ -40,66 +31,112 @@ T clamp(T value, T min, T max) {
   return value < min ? min : value > max ? max : value;
 }
 
-/* returns an angle in [-M_PI, M_PI] */
-static double normalize_angle(double theta) {
-  double const rem = fmod(fmod(theta, 2*M_PI) + 2*M_PI, 2*M_PI);
-  if( rem > M_PI ) {
-    return rem - 2*M_PI;
+void car::apply_twist() {
+  /* Going through theta() rounds the heading, so leave it alone
+     unless there's a twist */
+  if( twist_ != sim_real(0) ) {
+    set_theta(theta() - twist_);
+    twist_ = 0;
   }
-  return rem;
 }
 
-void car::update(double dt) {
-  double const accel_scale = 14.4;
-  double const turn_rate = 270 * (M_PI / 180); // 270 degrees per second
-  double const lateral_friction = 50;
-  double const rolling_friction = 0.24;
-  double const braking_friction = 3.6;
-  double const slip_limit = 20;
+void car::update(double step) {
+  car_batch & b = *batch_;
+  std::size_t const i = index_;
+  sim_real const dt = static_cast<sim_real>(step);
+  sim_vec2 const forward = heading();
+  sim_vec2 const lateral(forward.y(), -forward.x());
+  sim_vec2 const velocity = vel();
+  int spin = static_cast<int>(b.spin_[i]);
 
-  vec2 const forward = vec2(0,1).rotate(theta_);
-  vec2 const lateral = forward.rotated(M_PI/2);
+  sim_real const lateral_v = lateral.dot(velocity);
+  sim_real const forward_v = forward.dot(velocity);
 
-  double const lateral_v = lateral.dot(vel_);
-  double const forward_v = forward.dot(vel_);
+  sim_real const friction = -clamp(lateral_v * lateral_friction, -slip_limit, slip_limit);
+  sim_real const drag =
+    -forward_v * rolling_friction - clamp(forward_v * b.brake_[i] * braking_friction, -slip_limit, slip_limit);
 
-  double const friction = -clamp(lateral_v * lateral_friction, -slip_limit, slip_limit);
-  double const drag =
-    -forward_v * rolling_friction - clamp(forward_v * brake_ * braking_friction, -slip_limit, slip_limit);
+  sim_vec2 const throttle = forward * (b.throttle_[i] * accel_scale);
+  sim_vec2 const resistance = friction * lateral + drag * forward;
 
-  vec2 const throttle = forward * (throttle_ * accel_scale);
-  vec2 const resistance = friction * lateral + drag * forward;
+  sim_vec2 const accel = spin == 0 ? throttle + resistance : sim_vec2::zero();
 
-  vec2 const accel = spin_ == 0 ? throttle + resistance : vec2::zero();
+  set_pos(pos() + (velocity + sim_real(0.5) * accel * dt) * dt);
+  set_vel(velocity + accel * dt);
 
-  pos_ += (vel_ + 0.5 * accel * dt) * dt;
-  vel_ += accel * dt;
-
-  if( spin_ ) {
-    spin_timer_ -= dt;
-    if( spin_timer_ <= 0 ) {
-        spin_timer_ = 0;
-        spin_ = 0;
+  if( spin ) {
+    b.spin_timer_[i] -= dt;
+    if( b.spin_timer_[i] <= 0 ) {
+        b.spin_timer_[i] = 0;
+        spin = 0;
+        b.spin_[i] = 0;
     }
   }
 
-  if( !spin_ ) {
-    theta_ = normalize_angle(theta_ + turn_ * turn_rate * dt);
-  } else {
-    theta_ = normalize_angle(theta_ + spin_ * turn_rate * dt);
+  sim_real const turn = spin ? sim_real(spin) : b.turn_[i];
+  if( turn != 0 ) {
+    /* Rotate the heading by this step's turn, then pull it back
+       towards unit length with one Newton step, so rounding errors
+       can't accumulate */
+    sim_real const angle = turn * turn_rate * dt;
+    using std::cos;
+    using std::sin;
+    sim_real const c = cos(angle);
+    sim_real const s = sin(angle);
+    sim_vec2 heading(forward.x() * c + forward.y() * s,
+                     forward.y() * c - forward.x() * s);
+    heading *= (3 - heading.dot(heading)) * sim_real(0.5);
+    set_heading(heading);
   }
 }
 
+car_state car::state() const {
+  car_batch const & b = *batch_;
+  car_state s;
+  s.pos = pos();
+  s.heading = heading();
+  s.prev_pos = prev_pos_;
+  s.prev_heading = prev_heading_;
+  s.vel = vel();
+  s.throttle = b.throttle_[index_];
+  s.brake = b.brake_[index_];
+  s.turn = b.turn_[index_];
+  s.spin_timer = b.spin_timer_[index_];
+  s.spin = static_cast<int>(b.spin_[index_]);
+  s.segment = segment_;
+  s.score = score_;
+  return s;
+}
+
+void car::set_state(car_state const & s) {
+  car_batch & b = *batch_;
+  set_pos(s.pos);
+  set_heading(s.heading);
+  prev_pos_ = s.prev_pos;
+  prev_heading_ = s.prev_heading;
+  set_vel(s.vel);
+  b.throttle_[index_] = s.throttle;
+  b.brake_[index_] = s.brake;
+  b.turn_[index_] = s.turn;
+  b.spin_timer_[index_] = s.spin_timer;
+  b.spin_[index_] = static_cast<sim_real>(s.spin);
+  segment_ = s.segment;
+  score_ = s.score;
+}
+
 circle car::collision_shape() const {
-  return circle(pos_, model_->radius());
+  return circle(pos(), static_cast<sim_real>(model_->radius()));
 }
 
-void car::set_collided(double speed, double angle) {
-  if( spin_ ) {
+void car::set_collided(sim_real speed, sim_real angle) {
+  using std::abs;
+  using std::sqrt;
+  car_batch & b = *batch_;
+  if( b.spin_[index_] != 0 ) {
     return;
   }
-  if( std::fabs(speed) > 0.5 ) {
-    spin_ = angle < 0 ? 2 : -2;
-    spin_timer_ = 0.1*std::sqrt(std::fabs(speed));
+  if( abs(speed) > sim_real(0.5) ) {
+    b.spin_[index_] = angle < 0 ? 2 : -2;
+    b.spin_timer_[index_] = sim_real(0.1) * sqrt(abs(speed));
   }
 }
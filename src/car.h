@@ -5,57 +5,137 @@
 */
 #pragma once
 
+#include "car_batch.h"
 #include "circle.h"
 #include "model.h"
-#include "vec2.h"
+#include "sim_real.h"
 
 #include <algorithm>
+#include <cmath>
 #include <memory>
+#include <type_traits>
+
+class draw_batch;
+
+/// Everything about a car that changes during a race, as plain data
+/// that can be copied about freely.
+struct car_state {
+  sim_vec2 pos;
+  sim_vec2 heading;
+  sim_vec2 prev_pos;
+  sim_vec2 prev_heading;
+  sim_vec2 vel;
+  sim_real throttle;
+  sim_real brake;
+  sim_real turn;
+  sim_real spin_timer;
+  int spin;
+  unsigned segment;
+  unsigned score;
+};
+
+static_assert(std::is_trivially_copyable_v<car_state>);
 
 /// A car on the track, with position and driving characteristics.
+/// What update() changes is kept in a car_batch, shared with the rest
+/// of the field in a race, so that they can all be stepped together.
 class car {
  public:
-  car(vec2 const & pos, unsigned color, std::shared_ptr<model> model);
+  /* Driving characteristics, shared with car_batch */
+  static constexpr sim_real accel_scale = sim_real(14.4);
+  static constexpr sim_real turn_rate = sim_real(270 * (M_PI / 180)); // 270 degrees per second
+  static constexpr sim_real lateral_friction = 50;
+  static constexpr sim_real rolling_friction = sim_real(0.24);
+  static constexpr sim_real braking_friction = sim_real(3.6);
+  static constexpr sim_real slip_limit = 20;
+
+  /// A car with a batch of its own
+  car(sim_vec2 const & pos, unsigned color, std::shared_ptr<model> model);
+  /// A car added to batch, alongside the others there
+  car(sim_vec2 const & pos, unsigned color, std::shared_ptr<model> model, std::shared_ptr<car_batch> batch);
 
   void set_throttle(double throttle) {
-    throttle_ = std::min(std::max(0.0, throttle), 1.0);
+    batch_->throttle_[index_] = static_cast<sim_real>(std::min(std::max(0.0, throttle), 1.0));
   }
   void set_turn(double rate) {
-    turn_ = std::min(std::max(-1.0, rate), 1.0);
+    batch_->turn_[index_] = static_cast<sim_real>(std::min(std::max(-1.0, rate), 1.0));
   }
   void set_brake(double brake) {
-    brake_ = std::min(std::max(0.0, brake), 1.0);
+    batch_->brake_[index_] = static_cast<sim_real>(std::min(std::max(0.0, brake), 1.0));
   }
+  /// Turn the car on the spot by angle, clockwise, when the next step
+  /// starts. Twists made between steps add up.
+  void add_twist(double angle) {
+    twist_ += static_cast<sim_real>(angle);
+  }
+  void set_twist(double angle) {
+    twist_ = static_cast<sim_real>(angle);
+  }
+  /// Turn the car by the twist it's been given, and clear it. The race
+  /// does this once a step, after the players have had their say.
+  void apply_twist();
   void update(double dt);
-  void draw() const;
+
+  /// Remember the current state, so that draw() can interpolate
+  /// between it and the state after the next update.
+  void store_previous() {
+    prev_pos_ = pos();
+    prev_heading_ = heading();
+  }
+
+  /// Draw a car from a copy of its state(), alpha of the way from the
+  /// previous state to the current one. It only takes a copy so that
+  /// it can be drawn on another thread to the race.
+  static void draw(draw_batch & batch, model const & m, car_state const & s, unsigned color, double alpha);
 
   double throttle() const {
-    return throttle_;
+    return static_cast<double>(batch_->throttle_[index_]);
   }
   double turn() const {
-    return turn_;
+    return static_cast<double>(batch_->turn_[index_]);
+  }
+  double brake() const {
+    return static_cast<double>(batch_->brake_[index_]);
+  }
+  /// The twist still to be applied
+  double twist() const {
+    return static_cast<double>(twist_);
   }
 
   circle collision_shape() const;
 
-  vec2 pos() const {
-    return pos_;
+  sim_vec2 pos() const {
+    return sim_vec2(batch_->pos_x_[index_], batch_->pos_y_[index_]);
+  }
+  sim_vec2 vel() const {
+    return sim_vec2(batch_->vel_x_[index_], batch_->vel_y_[index_]);
   }
-  vec2 vel() const {
-    return vel_;
+  /// A unit vector pointing the way the car faces. This is what the
+  /// physics works with; theta() is derived from it on demand.
+  sim_vec2 heading() const {
+    return sim_vec2(batch_->heading_x_[index_], batch_->heading_y_[index_]);
   }
   // theta increases anticlockwise
-  double theta() const {
-    return theta_;
+  sim_real theta() const {
+    using std::atan2;
+    return atan2(batch_->heading_x_[index_], batch_->heading_y_[index_]);
   }
-  void set_pos(vec2 const &pos) {
-    pos_ = pos;
+  void set_pos(sim_vec2 const &pos) {
+    batch_->pos_x_[index_] = pos.x();
+    batch_->pos_y_[index_] = pos.y();
   }
-  void set_vel(vec2 const &vel) {
-    vel_ = vel;
+  void set_vel(sim_vec2 const &vel) {
+    batch_->vel_x_[index_] = vel.x();
+    batch_->vel_y_[index_] = vel.y();
   }
-  void set_theta(double theta) {
-    theta_ = theta;
+  void set_heading(sim_vec2 const &heading) {
+    batch_->heading_x_[index_] = heading.x();
+    batch_->heading_y_[index_] = heading.y();
+  }
+  void set_theta(sim_real theta) {
+    using std::cos;
+    using std::sin;
+    set_heading(sim_vec2(sin(theta), cos(theta)));
   }
 
   unsigned segment() const {
@@ -65,7 +145,7 @@ class car {
     segment_ = seg;
   }
 
-  void set_collided(double speed, double angle);
+  void set_collided(sim_real speed, sim_real angle);
 
   unsigned score() const {
     return score_;
@@ -73,21 +153,27 @@ class car {
   void add_score(unsigned amount) {
     score_ += amount;
   }
+  void set_score(unsigned score) {
+    score_ = score;
+  }
 
   unsigned color() const {
     return color_;
   }
 
+  car_state state() const;
+  void set_state(car_state const & s);
+
  private:
-  vec2 pos_;
-  double theta_;
-  vec2 vel_;
-  double throttle_;
-  double brake_;
-  double turn_;
+  /* Where the driving state lives: pos, vel, heading, the controls
+     and the spin */
+  std::shared_ptr<car_batch> batch_;
+  std::size_t index_;
+
+  sim_vec2 prev_pos_;
+  sim_vec2 prev_heading_;
+  sim_real twist_;
   unsigned segment_;
-  double spin_timer_;
-  int spin_;
   unsigned score_;
   unsigned color_;
   std::shared_ptr<model> model_;
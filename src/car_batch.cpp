@@ -0,0 +1,308 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#include "car_batch.h"
+
+#include "car.h"
+
+#include <cmath>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+/* Each pack type wraps however many sim_reals the instruction set can
+   work on at once, and provides just the operations the kernel needs.
+   The kernel itself is written once, against this interface. In
+   float32 builds the same registers hold twice as many cars. */
+
+struct scalar_pack {
+  static constexpr std::size_t width = 1;
+  using mask = bool;
+
+  sim_real v;
+
+  static scalar_pack load(sim_real const *p) { return { *p }; }
+  static scalar_pack set(sim_real x) { return { x }; }
+  void store(sim_real *p) const { *p = v; }
+
+  friend scalar_pack operator+(scalar_pack a, scalar_pack b) { return { a.v + b.v }; }
+  friend scalar_pack operator-(scalar_pack a, scalar_pack b) { return { a.v - b.v }; }
+  friend scalar_pack operator*(scalar_pack a, scalar_pack b) { return { a.v * b.v }; }
+  friend scalar_pack operator-(scalar_pack a) { return { -a.v }; }
+  friend scalar_pack min(scalar_pack a, scalar_pack b) { return { a.v < b.v ? a.v : b.v }; }
+  friend scalar_pack max(scalar_pack a, scalar_pack b) { return { a.v > b.v ? a.v : b.v }; }
+  friend mask operator==(scalar_pack a, scalar_pack b) { return a.v == b.v; }
+  friend mask operator<=(scalar_pack a, scalar_pack b) { return a.v <= b.v; }
+  friend mask operator>(scalar_pack a, scalar_pack b) { return a.v > b.v; }
+  friend scalar_pack select(mask m, scalar_pack a, scalar_pack b) { return m ? a : b; }
+};
+
+#if defined(NATIVE_SIM_FIXED)
+
+/* There are no vector instructions for Q32.32 multiplies, so fixed
+   point builds get the batch layout but not the vectorisation */
+using wide_pack = scalar_pack;
+
+#elif defined(__AVX2__) && defined(NATIVE_SIM_FLOAT32)
+
+struct avx2_pack {
+  static constexpr std::size_t width = 8;
+  struct mask { __m256 m; };
+
+  __m256 v;
+
+  static avx2_pack load(float const *p) { return { _mm256_loadu_ps(p) }; }
+  static avx2_pack set(float x) { return { _mm256_set1_ps(x) }; }
+  void store(float *p) const { _mm256_storeu_ps(p, v); }
+
+  friend avx2_pack operator+(avx2_pack a, avx2_pack b) { return { _mm256_add_ps(a.v, b.v) }; }
+  friend avx2_pack operator-(avx2_pack a, avx2_pack b) { return { _mm256_sub_ps(a.v, b.v) }; }
+  friend avx2_pack operator*(avx2_pack a, avx2_pack b) { return { _mm256_mul_ps(a.v, b.v) }; }
+  friend avx2_pack operator-(avx2_pack a) { return { _mm256_xor_ps(a.v, _mm256_set1_ps(-0.0f)) }; }
+  friend avx2_pack min(avx2_pack a, avx2_pack b) { return { _mm256_min_ps(a.v, b.v) }; }
+  friend avx2_pack max(avx2_pack a, avx2_pack b) { return { _mm256_max_ps(a.v, b.v) }; }
+  friend mask operator==(avx2_pack a, avx2_pack b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_EQ_OQ) }; }
+  friend mask operator<=(avx2_pack a, avx2_pack b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ) }; }
+  friend mask operator>(avx2_pack a, avx2_pack b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ) }; }
+  friend avx2_pack select(mask m, avx2_pack a, avx2_pack b) { return { _mm256_blendv_ps(b.v, a.v, m.m) }; }
+};
+
+using wide_pack = avx2_pack;
+
+#elif defined(__AVX2__)
+
+struct avx2_pack {
+  static constexpr std::size_t width = 4;
+  struct mask { __m256d m; };
+
+  __m256d v;
+
+  static avx2_pack load(double const *p) { return { _mm256_loadu_pd(p) }; }
+  static avx2_pack set(double x) { return { _mm256_set1_pd(x) }; }
+  void store(double *p) const { _mm256_storeu_pd(p, v); }
+
+  friend avx2_pack operator+(avx2_pack a, avx2_pack b) { return { _mm256_add_pd(a.v, b.v) }; }
+  friend avx2_pack operator-(avx2_pack a, avx2_pack b) { return { _mm256_sub_pd(a.v, b.v) }; }
+  friend avx2_pack operator*(avx2_pack a, avx2_pack b) { return { _mm256_mul_pd(a.v, b.v) }; }
+  friend avx2_pack operator-(avx2_pack a) { return { _mm256_xor_pd(a.v, _mm256_set1_pd(-0.0)) }; }
+  friend avx2_pack min(avx2_pack a, avx2_pack b) { return { _mm256_min_pd(a.v, b.v) }; }
+  friend avx2_pack max(avx2_pack a, avx2_pack b) { return { _mm256_max_pd(a.v, b.v) }; }
+  friend mask operator==(avx2_pack a, avx2_pack b) { return { _mm256_cmp_pd(a.v, b.v, _CMP_EQ_OQ) }; }
+  friend mask operator<=(avx2_pack a, avx2_pack b) { return { _mm256_cmp_pd(a.v, b.v, _CMP_LE_OQ) }; }
+  friend mask operator>(avx2_pack a, avx2_pack b) { return { _mm256_cmp_pd(a.v, b.v, _CMP_GT_OQ) }; }
+  friend avx2_pack select(mask m, avx2_pack a, avx2_pack b) { return { _mm256_blendv_pd(b.v, a.v, m.m) }; }
+};
+
+using wide_pack = avx2_pack;
+
+#elif defined(__SSE2__) && defined(NATIVE_SIM_FLOAT32)
+
+struct sse2_pack {
+  static constexpr std::size_t width = 4;
+  struct mask { __m128 m; };
+
+  __m128 v;
+
+  static sse2_pack load(float const *p) { return { _mm_loadu_ps(p) }; }
+  static sse2_pack set(float x) { return { _mm_set1_ps(x) }; }
+  void store(float *p) const { _mm_storeu_ps(p, v); }
+
+  friend sse2_pack operator+(sse2_pack a, sse2_pack b) { return { _mm_add_ps(a.v, b.v) }; }
+  friend sse2_pack operator-(sse2_pack a, sse2_pack b) { return { _mm_sub_ps(a.v, b.v) }; }
+  friend sse2_pack operator*(sse2_pack a, sse2_pack b) { return { _mm_mul_ps(a.v, b.v) }; }
+  friend sse2_pack operator-(sse2_pack a) { return { _mm_xor_ps(a.v, _mm_set1_ps(-0.0f)) }; }
+  friend sse2_pack min(sse2_pack a, sse2_pack b) { return { _mm_min_ps(a.v, b.v) }; }
+  friend sse2_pack max(sse2_pack a, sse2_pack b) { return { _mm_max_ps(a.v, b.v) }; }
+  friend mask operator==(sse2_pack a, sse2_pack b) { return { _mm_cmpeq_ps(a.v, b.v) }; }
+  friend mask operator<=(sse2_pack a, sse2_pack b) { return { _mm_cmple_ps(a.v, b.v) }; }
+  friend mask operator>(sse2_pack a, sse2_pack b) { return { _mm_cmpgt_ps(a.v, b.v) }; }
+  friend sse2_pack select(mask m, sse2_pack a, sse2_pack b) {
+    return { _mm_or_ps(_mm_and_ps(m.m, a.v), _mm_andnot_ps(m.m, b.v)) };
+  }
+};
+
+using wide_pack = sse2_pack;
+
+#elif defined(__SSE2__)
+
+struct sse2_pack {
+  static constexpr std::size_t width = 2;
+  struct mask { __m128d m; };
+
+  __m128d v;
+
+  static sse2_pack load(double const *p) { return { _mm_loadu_pd(p) }; }
+  static sse2_pack set(double x) { return { _mm_set1_pd(x) }; }
+  void store(double *p) const { _mm_storeu_pd(p, v); }
+
+  friend sse2_pack operator+(sse2_pack a, sse2_pack b) { return { _mm_add_pd(a.v, b.v) }; }
+  friend sse2_pack operator-(sse2_pack a, sse2_pack b) { return { _mm_sub_pd(a.v, b.v) }; }
+  friend sse2_pack operator*(sse2_pack a, sse2_pack b) { return { _mm_mul_pd(a.v, b.v) }; }
+  friend sse2_pack operator-(sse2_pack a) { return { _mm_xor_pd(a.v, _mm_set1_pd(-0.0)) }; }
+  friend sse2_pack min(sse2_pack a, sse2_pack b) { return { _mm_min_pd(a.v, b.v) }; }
+  friend sse2_pack max(sse2_pack a, sse2_pack b) { return { _mm_max_pd(a.v, b.v) }; }
+  friend mask operator==(sse2_pack a, sse2_pack b) { return { _mm_cmpeq_pd(a.v, b.v) }; }
+  friend mask operator<=(sse2_pack a, sse2_pack b) { return { _mm_cmple_pd(a.v, b.v) }; }
+  friend mask operator>(sse2_pack a, sse2_pack b) { return { _mm_cmpgt_pd(a.v, b.v) }; }
+  friend sse2_pack select(mask m, sse2_pack a, sse2_pack b) {
+    return { _mm_or_pd(_mm_and_pd(m.m, a.v), _mm_andnot_pd(m.m, b.v)) };
+  }
+};
+
+using wide_pack = sse2_pack;
+
+#else
+
+using wide_pack = scalar_pack;
+
+#endif
+
+template<typename P>
+P clamp(P value, P lo, P hi) {
+  return max(lo, min(hi, value));
+}
+
+/* sin and cos for angles in [-pi, pi]. The angle is folded into
+   [-pi/2, pi/2], where Taylor series out to x^13 and x^14 are good to
+   better than 1e-9, which is more than float32 builds can hold. */
+template<typename P>
+void sincos(P x, P & s, P & c) {
+  P const pi = P::set(M_PI);
+  P const half_pi = P::set(M_PI/2);
+  P const folded = select(x > half_pi, pi - x, select(-half_pi > x, -pi - x, x));
+  P const sign = select(folded == x, P::set(1), P::set(-1));
+  P const x2 = folded * folded;
+
+  P sp = P::set(1.0/6227020800);            // 1/13!
+  sp = sp * x2 - P::set(1.0/39916800);      // 1/11!
+  sp = sp * x2 + P::set(1.0/362880);        // 1/9!
+  sp = sp * x2 - P::set(1.0/5040);          // 1/7!
+  sp = sp * x2 + P::set(1.0/120);           // 1/5!
+  sp = sp * x2 - P::set(1.0/6);             // 1/3!
+  s = folded + folded * x2 * sp;
+
+  P cp = P::set(1.0/87178291200);           // 1/14!
+  cp = cp * x2 - P::set(1.0/479001600);     // 1/12!
+  cp = cp * x2 + P::set(1.0/3628800);       // 1/10!
+  cp = cp * x2 - P::set(1.0/40320);         // 1/8!
+  cp = cp * x2 + P::set(1.0/720);           // 1/6!
+  cp = cp * x2 - P::set(1.0/24);            // 1/4!
+  cp = cp * x2 + P::set(1.0/2);             // 1/2!
+  c = sign * (P::set(1) - x2 * cp);
+}
+
+#if defined(NATIVE_SIM_FIXED)
+
+/* Fixed point has its own sin and cos, which car::update uses too */
+void sincos(scalar_pack x, scalar_pack & s, scalar_pack & c) {
+  s.v = sin(x.v);
+  c.v = cos(x.v);
+}
+
+#endif
+
+template<typename P>
+void update_pack(sim_real *pos_x, sim_real *pos_y, sim_real *vel_x, sim_real *vel_y,
+                 sim_real *heading_x, sim_real *heading_y,
+                 sim_real const *throttle, sim_real const *brake,
+                 sim_real const *turn, sim_real *spin, sim_real *spin_timer,
+                 sim_real dt)
+{
+  P const zero = P::set(0);
+  P const step = P::set(dt);
+  P const slip_limit = P::set(car::slip_limit);
+
+  P const vx = P::load(vel_x);
+  P const vy = P::load(vel_y);
+  P const hx = P::load(heading_x);
+  P const hy = P::load(heading_y);
+  P const sp = P::load(spin);
+
+  /* forward is the heading, and lateral is (hy, -hx), as in
+     car::update */
+  P const lateral_v = hy * vx - hx * vy;
+  P const forward_v = hx * vx + hy * vy;
+
+  P const friction = -clamp(lateral_v * P::set(car::lateral_friction), -slip_limit, slip_limit);
+  P const drag =
+    -forward_v * P::set(car::rolling_friction)
+    - clamp(forward_v * P::load(brake) * P::set(car::braking_friction), -slip_limit, slip_limit);
+
+  P const throttle_accel = P::load(throttle) * P::set(car::accel_scale);
+  typename P::mask const gripping = sp == zero;
+  P const ax = select(gripping, hx * throttle_accel + (friction * hy + drag * hx), zero);
+  P const ay = select(gripping, hy * throttle_accel + (-friction * hx + drag * hy), zero);
+
+  P const half = P::set(sim_real(0.5));
+  (P::load(pos_x) + (vx + half * ax * step) * step).store(pos_x);
+  (P::load(pos_y) + (vy + half * ay * step) * step).store(pos_y);
+  (vx + ax * step).store(vel_x);
+  (vy + ay * step).store(vel_y);
+
+  /* A spin wears off once its timer runs out */
+  P const old_timer = P::load(spin_timer);
+  P const timer = old_timer - step;
+  P const new_spin = select(timer <= zero, zero, sp);
+  select(gripping, old_timer, select(timer <= zero, zero, timer)).store(spin_timer);
+  new_spin.store(spin);
+
+  /* Rotate the heading, and renormalise it with a Newton step. Cars
+     that aren't turning are left alone, as in car::update, since the
+     Newton step needn't leave a heading exactly where it was */
+  P const rate = select(new_spin == zero, P::load(turn), new_spin);
+  typename P::mask const straight = rate == zero;
+  P s, c;
+  sincos(rate * P::set(car::turn_rate) * step, s, c);
+  P const nx = hx * c + hy * s;
+  P const ny = hy * c - hx * s;
+  P const scale = (P::set(3) - (nx * nx + ny * ny)) * P::set(sim_real(0.5));
+  select(straight, hx, nx * scale).store(heading_x);
+  select(straight, hy, ny * scale).store(heading_y);
+}
+
+}
+
+std::size_t car_batch::add() {
+  for( auto *v: { &pos_x_, &pos_y_, &vel_x_, &vel_y_, &heading_x_, &heading_y_, &throttle_,
+                  &brake_, &turn_, &spin_, &spin_timer_ } ) {
+    v->push_back(0);
+  }
+  return size() - 1;
+}
+
+void car_batch::update(double step) {
+  sim_real const dt = static_cast<sim_real>(step);
+  std::size_t const n = size();
+  std::size_t i = 0;
+  for( ; i + wide_pack::width <= n; i += wide_pack::width ) {
+    update_pack<wide_pack>(&pos_x_[i], &pos_y_[i], &vel_x_[i], &vel_y_[i], &heading_x_[i], &heading_y_[i],
+                           &throttle_[i], &brake_[i], &turn_[i], &spin_[i], &spin_timer_[i], dt);
+  }
+  for( ; i < n; ++i ) {
+    update_pack<scalar_pack>(&pos_x_[i], &pos_y_[i], &vel_x_[i], &vel_y_[i], &heading_x_[i], &heading_y_[i],
+                             &throttle_[i], &brake_[i], &turn_[i], &spin_[i], &spin_timer_[i], dt);
+  }
+}
+
+char const * car_batch::instruction_set() {
+#if defined(NATIVE_SIM_FIXED)
+  return "scalar, fixed point";
+#elif defined(__AVX2__) && defined(NATIVE_SIM_FLOAT32)
+  return "avx2, float32";
+#elif defined(__AVX2__)
+  return "avx2";
+#elif defined(__SSE2__) && defined(NATIVE_SIM_FLOAT32)
+  return "sse2, float32";
+#elif defined(__SSE2__)
+  return "sse2";
+#elif defined(NATIVE_SIM_FLOAT32)
+  return "scalar, float32";
+#else
+  return "scalar";
+#endif
+}
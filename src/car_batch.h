@@ -0,0 +1,58 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#pragma once
+
+#include "sim_real.h"
+
+#include <cstddef>
+#include <vector>
+
+class car;
+
+/// The driving state of a whole field of cars, kept as one
+/// contiguous array per quantity so that every car can be stepped in
+/// a single vectorised pass. This is where the cars keep that state:
+/// car's accessors read and write these arrays, so there's nothing to
+/// copy in before update() or out after it.
+///
+/// update() matches car::update to within rounding, but uses
+/// polynomial sin/cos instead of libm; it uses AVX2 or SSE2 when the
+/// compiler targets them, and plain scalar code otherwise. float32
+/// builds fit twice as many cars in each register. No car may turn by
+/// more than half a circle in one step, which at the cars' top turn
+/// rate allows steps of up to 1/3s.
+class car_batch {
+public:
+  std::size_t size() const {
+    return pos_x_.size();
+  }
+
+  /// Make room for another car, returning where it is in the arrays.
+  /// Its state is all zero.
+  std::size_t add();
+
+  /// Advance every car in the batch by dt seconds, as car::update
+  /// does
+  void update(double dt);
+
+  /// Which instruction set update() was built for
+  static char const * instruction_set();
+
+private:
+  friend class car;
+
+  std::vector<sim_real> pos_x_;
+  std::vector<sim_real> pos_y_;
+  std::vector<sim_real> vel_x_;
+  std::vector<sim_real> vel_y_;
+  std::vector<sim_real> heading_x_;
+  std::vector<sim_real> heading_y_;
+  std::vector<sim_real> throttle_;
+  std::vector<sim_real> brake_;
+  std::vector<sim_real> turn_;
+  std::vector<sim_real> spin_;
+  std::vector<sim_real> spin_timer_;
+};
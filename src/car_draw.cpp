@@ -0,0 +1,27 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#include "car.h"
+
+#include "draw_batch.h"
+#include "render_helpers.h"
+
+#include <cmath>
+
+void car::draw(draw_batch & batch, model const & m, car_state const & s, unsigned color, double alpha) {
+  /* Interpolate in double whatever the simulation runs in */
+  vec2 const prev_pos(s.prev_pos);
+  vec2 const prev_heading(s.prev_heading);
+  vec2 const pos = prev_pos + (vec2(s.pos) - prev_pos) * alpha;
+  vec2 const heading = prev_heading + (vec2(s.heading) - prev_heading) * alpha;
+  double const theta = std::atan2(heading.x(), heading.y());
+
+  batch.push();
+  batch.translate(pos.x(), pos.y());
+  batch.rotate(-theta);
+  batch.set_color(car_color(color));
+  m.draw(batch);
+  batch.pop();
+}
@@ -0,0 +1,37 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+/// 32 bit FNV-1a hash, for cheaply telling whether two copies of
+/// something have drifted apart. Feed it values one at a time, rather
+/// than whole structs, so that padding doesn't get hashed.
+class checksum {
+public:
+  void add_bytes(void const *data, std::size_t size) {
+    auto const *bytes = static_cast<unsigned char const *>(data);
+    for( std::size_t i=0; i<size; ++i ) {
+      hash_ = (hash_ ^ bytes[i]) * 16777619u;
+    }
+  }
+
+  template<typename T>
+  void add(T const & value) {
+    static_assert(std::is_arithmetic_v<T> || std::has_unique_object_representations_v<T>,
+                  "Add structs member by member");
+    add_bytes(&value, sizeof(value));
+  }
+
+  std::uint32_t value() const {
+    return hash_;
+  }
+
+private:
+  std::uint32_t hash_ = 2166136261u;
+};
@@ -5,33 +5,71 @@
 */
 #pragma once
 
-#include "vec2.h"
+#include "sim_real.h"
+
+#include <optional>
 
 /// A simple bounding circle, used for cheap 2D collision detection.
 class circle {
 public:
-  circle(vec2 const & center, double radius)
+  constexpr circle(sim_vec2 const & center, sim_real radius)
     : center_(center),
       radius_(radius)
   {}
 
   bool intersects(circle const & other) const {
-    double const tol = 1e-5;
-    return intersection_distance(other) >= tol;
+    return intersects(other, sim_real(1e-5));
+  }
+
+  /// Whether the circles overlap by more than tolerance
+  bool intersects(circle const & other, sim_real tolerance) const {
+    return intersection_distance(other) >= tolerance;
   }
 
   // Positive for intersecting
-  double intersection_distance(circle const &other) const {
-    vec2 const delta = center_ - other.center_;
-    double const gap = radius_ + other.radius_ - delta.mag();
+  sim_real intersection_distance(circle const &other) const {
+    sim_vec2 const delta = center_ - other.center_;
+    sim_real const gap = radius_ + other.radius_ - delta.mag();
     return gap;
   }
 
-  vec2 separation_direction(circle const &other) const {
-    return (center_ - other.center_).safe_normalized(vec2::y_axis());
+  sim_vec2 separation_direction(circle const &other) const {
+    return (center_ - other.center_).safe_normalized(sim_vec2::y_axis());
+  }
+
+  /// If this circle moves by motion, the fraction of the way along
+  /// it that it first touches other, which stays still. Nothing if
+  /// they never touch, or if they already intersect.
+  std::optional<sim_real> time_of_impact(sim_vec2 const & motion, circle const & other) const {
+    sim_vec2 const delta = center_ - other.center_;
+    sim_real const reach = radius_ + other.radius_;
+    sim_real const a = motion.dot(motion);
+    sim_real const b = 2 * delta.dot(motion);
+    sim_real const c = delta.dot(delta) - reach * reach;
+    if( c <= 0 || a == 0 ) {
+      return std::nullopt;
+    }
+    sim_real const discriminant = b*b - 4*a*c;
+    if( discriminant < 0 ) {
+      return std::nullopt;
+    }
+    using std::sqrt;
+    sim_real const t = (-b - sqrt(discriminant)) / (2*a);
+    if( t < 0 || t > 1 ) {
+      return std::nullopt;
+    }
+    return t;
+  }
+
+  constexpr sim_vec2 const & center() const {
+    return center_;
+  }
+
+  constexpr sim_real radius() const {
+    return radius_;
   }
 
 private:
-  vec2 center_;
-  double radius_;
+  sim_vec2 center_;
+  sim_real radius_;
 };
@@ -0,0 +1,467 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+/* The shader and buffer calls are only prototyped on request, and
+   that has to be before anything includes GL */
+#define GL_GLEXT_PROTOTYPES
+#include "draw_batch.h"
+
+#include "error.h"
+#include "render_helpers.h"
+
+#include <GL/glext.h>
+
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+
+/* Enough for a track's worth of obstacles before a flush is forced */
+static std::size_t const max_vertices = 1 << 16;
+/* Half the width of a line, in pixels */
+static double const half_line_pixels = 0.75;
+
+static char const vertex_source[] =
+  "uniform mat3 transform;\n"
+  "attribute vec2 position;\n"
+  "attribute vec2 texcoord;\n"
+  "attribute vec4 color;\n"
+  "varying vec2 v_texcoord;\n"
+  "varying vec4 v_color;\n"
+  "void main() {\n"
+  "  v_texcoord = texcoord;\n"
+  "  v_color = color;\n"
+  "  gl_Position = vec4((transform * vec3(position, 1.0)).xy, 0.0, 1.0);\n"
+  "}\n";
+
+static char const fragment_source[] =
+  "#ifdef GL_ES\n"
+  "precision mediump float;\n"
+  "#endif\n"
+  "uniform sampler2D image;\n"
+  "varying vec2 v_texcoord;\n"
+  "varying vec4 v_color;\n"
+  "void main() {\n"
+  "  gl_FragColor = v_color * texture2D(image, v_texcoord);\n"
+  "}\n";
+
+enum attribute: GLuint {
+  position_attribute,
+  texcoord_attribute,
+  color_attribute
+};
+
+static GLuint compile_shader(GLenum type, char const * source) {
+  GLuint const shader = glCreateShader(type);
+  glShaderSource(shader, 1, &source, nullptr);
+  glCompileShader(shader);
+  GLint ok = GL_FALSE;
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+  if( !ok ) {
+    char log[1024];
+    glGetShaderInfoLog(shader, sizeof(log), nullptr, log);
+    std::cerr << "Failed to compile shader: " << log << std::endl;
+    crash();
+  }
+  return shader;
+}
+
+static GLuint link_program() {
+  GLuint const program = glCreateProgram();
+  GLuint const vertex = compile_shader(GL_VERTEX_SHADER, vertex_source);
+  GLuint const fragment = compile_shader(GL_FRAGMENT_SHADER, fragment_source);
+  glAttachShader(program, vertex);
+  glAttachShader(program, fragment);
+  glBindAttribLocation(program, position_attribute, "position");
+  glBindAttribLocation(program, texcoord_attribute, "texcoord");
+  glBindAttribLocation(program, color_attribute, "color");
+  glLinkProgram(program);
+  GLint ok = GL_FALSE;
+  glGetProgramiv(program, GL_LINK_STATUS, &ok);
+  if( !ok ) {
+    char log[1024];
+    glGetProgramInfoLog(program, sizeof(log), nullptr, log);
+    std::cerr << "Failed to link shaders: " << log << std::endl;
+    crash();
+  }
+  glDeleteShader(vertex);
+  glDeleteShader(fragment);
+  return program;
+}
+
+static bool has_framebuffers() {
+  char const * const version = reinterpret_cast<char const *>(glGetString(GL_VERSION));
+  char const * const extensions = reinterpret_cast<char const *>(glGetString(GL_EXTENSIONS));
+  return (version && (std::strncmp(version, "OpenGL ES", 9) == 0 || std::atoi(version) >= 3)) ||
+    (extensions && std::strstr(extensions, "GL_ARB_framebuffer_object"));
+}
+
+batch_target::batch_target(int width, int height)
+  : framebuffer_(0),
+    texture_(0),
+    width_(width),
+    height_(height)
+{
+  glGenTextures(1, &texture_);
+  glBindTexture(GL_TEXTURE_2D, texture_);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+
+  glGenFramebuffers(1, &framebuffer_);
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer_);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture_, 0);
+  if( glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE ) {
+    std::cerr << "Failed to make a " << width << "x" << height << " render target" << std::endl;
+    crash();
+  }
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  check_gl_error();
+}
+
+batch_target::~batch_target() {
+  glDeleteFramebuffers(1, &framebuffer_);
+  glDeleteTextures(1, &texture_);
+}
+
+batch_mesh::batch_mesh()
+  : buffer_(0),
+    count_(0)
+{
+  glGenBuffers(1, &buffer_);
+}
+
+batch_mesh::~batch_mesh() {
+  glDeleteBuffers(1, &buffer_);
+}
+
+draw_batch::affine draw_batch::affine::then(affine const & o) const {
+  return {
+    o.a*a + o.c*b, o.b*a + o.d*b,
+    o.a*c + o.c*d, o.b*c + o.d*d,
+    o.a*tx + o.c*ty + o.tx, o.b*tx + o.d*ty + o.ty
+  };
+}
+
+draw_batch::draw_batch(int width, int height)
+  : width_(width),
+    height_(height),
+    window_width_(width),
+    window_height_(height),
+    framebuffers_(has_framebuffers()),
+    target_(nullptr),
+    program_(link_program()),
+    transform_uniform_(glGetUniformLocation(program_, "transform")),
+    stream_(0),
+    white_(0),
+    texture_(0),
+    next_texture_(0),
+    state_{identity_, identity_},
+    transform_(identity_),
+    half_line_(0),
+    color_{255, 255, 255, 255},
+    out_(&vertices_),
+    recording_(false),
+    record_scale_(0),
+    circle_points_(0)
+{
+  glGenBuffers(1, &stream_);
+
+  /* Untextured drawing samples a single white texel, so that
+     everything can go through the same shader */
+  std::uint8_t const white[4] = { 255, 255, 255, 255 };
+  glGenTextures(1, &white_);
+  glBindTexture(GL_TEXTURE_2D, white_);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, white);
+  texture_ = white_;
+  next_texture_ = white_;
+
+  glUseProgram(program_);
+  glUniform1i(glGetUniformLocation(program_, "image"), 0);
+  vertices_.reserve(max_vertices);
+  update_transform_();
+  check_gl_error();
+}
+
+draw_batch::~draw_batch() {
+  glDeleteTextures(1, &white_);
+  glDeleteBuffers(1, &stream_);
+  glDeleteProgram(program_);
+}
+
+void draw_batch::set_projection(double left, double right, double bottom, double top) {
+  state_.projection = {
+    2 / (right - left), 0,
+    0, 2 / (top - bottom),
+    -(right + left) / (right - left), -(top + bottom) / (top - bottom)
+  };
+  state_.model = identity_;
+  update_transform_();
+}
+
+void draw_batch::push() {
+  saved_.push_back(state_);
+}
+
+void draw_batch::pop() {
+  state_ = saved_.back();
+  saved_.pop_back();
+  update_transform_();
+}
+
+void draw_batch::translate(double x, double y) {
+  state_.model = affine{ 1, 0, 0, 1, x, y }.then(state_.model);
+  update_transform_();
+}
+
+void draw_batch::rotate(double angle) {
+  double const c = std::cos(angle);
+  double const s = std::sin(angle);
+  state_.model = affine{ c, s, -s, c, 0, 0 }.then(state_.model);
+  update_transform_();
+}
+
+void draw_batch::scale(double x, double y) {
+  state_.model = affine{ x, 0, 0, y, 0, 0 }.then(state_.model);
+  update_transform_();
+}
+
+void draw_batch::update_transform_() {
+  transform_ = state_.model.then(state_.projection);
+  /* Lines are kept the same width on screen, however things are
+     scaled, taking the average of the scale along each axis */
+  double const det = std::abs(transform_.a*transform_.d - transform_.b*transform_.c);
+  double const pixels = recording_ ? record_scale_ * std::sqrt(det)
+    : std::sqrt(det * width_ * height_ / 4);
+  half_line_ = pixels > 0 ? half_line_pixels / pixels : 0;
+}
+
+void draw_batch::use_texture_() {
+  if( next_texture_ != texture_ ) {
+    flush();
+    texture_ = next_texture_;
+  }
+}
+
+void draw_batch::vertex_(vec2 const & p, vec2 const & uv) {
+  vec2 const q = transform_.apply(p);
+  out_->push_back({
+      static_cast<float>(q.x()), static_cast<float>(q.y()),
+      static_cast<float>(uv.x()), static_cast<float>(uv.y()),
+      { color_[0], color_[1], color_[2], color_[3] }
+    });
+}
+
+void draw_batch::triangle(vec2 const & a, vec2 const & b, vec2 const & c) {
+  use_texture_();
+  if( !recording_ && vertices_.size() + 3 > max_vertices ) {
+    flush();
+  }
+  vec2 const uv(0.5, 0.5);
+  vertex_(a, uv);
+  vertex_(b, uv);
+  vertex_(c, uv);
+}
+
+void draw_batch::quad(vec2 const & a, vec2 const & b, vec2 const & c, vec2 const & d) {
+  triangle(a, b, c);
+  triangle(a, c, d);
+}
+
+void draw_batch::quad(vec2 const (&corners)[4], vec2 const (&uvs)[4]) {
+  use_texture_();
+  if( !recording_ && vertices_.size() + 6 > max_vertices ) {
+    flush();
+  }
+  for( unsigned k: { 0, 1, 2, 0, 2, 3 } ) {
+    vertex_(corners[k], uvs[k]);
+  }
+}
+
+void draw_batch::polygon(vec2 const * points, std::size_t count) {
+  for( std::size_t k=1; k+1<count; ++k ) {
+    triangle(points[0], points[k], points[k+1]);
+  }
+}
+
+void draw_batch::line(vec2 const & a, vec2 const & b) {
+  vec2 const along = b - a;
+  double const length = along.mag();
+  if( length == 0 ) {
+    return;
+  }
+  /* Run on past the ends by half the width too, so that the corners
+     of line loops are filled in */
+  vec2 const extend = along * (half_line_ / length);
+  vec2 const across(-extend.y(), extend.x());
+  quad(a - extend + across, b + extend + across, b + extend - across, a - extend - across);
+}
+
+void draw_batch::line_loop(vec2 const * points, std::size_t count) {
+  for( std::size_t k=0; k<count; ++k ) {
+    line(points[k], points[(k + 1) % count]);
+  }
+}
+
+vec2 const * draw_batch::unit_circle_(unsigned points) {
+  if( points != circle_points_ ) {
+    double const step = 2 * M_PI / points;
+    circle_.resize(points);
+    for( unsigned k=0; k<points; ++k ) {
+      circle_[k] = vec2(std::cos(k * step), std::sin(k * step));
+    }
+    circle_points_ = points;
+  }
+  return circle_.data();
+}
+
+void draw_batch::circle(vec2 const & centre, double radius, unsigned points) {
+  vec2 const * const unit = unit_circle_(points);
+  for( unsigned k=1; k+1<points; ++k ) {
+    triangle(centre + unit[0] * radius, centre + unit[k] * radius, centre + unit[k+1] * radius);
+  }
+}
+
+void draw_batch::circle_outline(vec2 const & centre, double radius, unsigned points) {
+  vec2 const * const unit = unit_circle_(points);
+  for( unsigned k=0; k<points; ++k ) {
+    line(centre + unit[k] * radius, centre + unit[(k + 1) % points] * radius);
+  }
+}
+
+void draw_batch::begin_record_() {
+  push();
+  double const det = std::abs(transform_.a*transform_.d - transform_.b*transform_.c);
+  record_scale_ = std::sqrt(det * width_ * height_ / 4);
+  recording_ = true;
+  out_ = &recorded_;
+  state_ = { identity_, identity_ };
+  update_transform_();
+}
+
+void draw_batch::end_record_(batch_mesh & mesh) {
+  glBindBuffer(GL_ARRAY_BUFFER, mesh.buffer_);
+  glBufferData(GL_ARRAY_BUFFER, recorded_.size() * sizeof(batch_vertex), recorded_.data(), GL_STATIC_DRAW);
+  mesh.count_ = static_cast<GLsizei>(recorded_.size());
+  recorded_.clear();
+  out_ = &vertices_;
+  recording_ = false;
+  pop();
+}
+
+void draw_batch::bind_vertices_(batch_vertex const * base) {
+  GLsizei const stride = sizeof(batch_vertex);
+  char const * const start = reinterpret_cast<char const *>(base);
+  glEnableVertexAttribArray(position_attribute);
+  glEnableVertexAttribArray(texcoord_attribute);
+  glEnableVertexAttribArray(color_attribute);
+  glVertexAttribPointer(position_attribute, 2, GL_FLOAT, GL_FALSE, stride,
+                        start + offsetof(batch_vertex, x));
+  glVertexAttribPointer(texcoord_attribute, 2, GL_FLOAT, GL_FALSE, stride,
+                        start + offsetof(batch_vertex, u));
+  glVertexAttribPointer(color_attribute, 4, GL_UNSIGNED_BYTE, GL_TRUE, stride,
+                        start + offsetof(batch_vertex, color));
+}
+
+void draw_batch::draw(batch_mesh const & mesh) {
+  if( mesh.empty() ) {
+    return;
+  }
+  flush();
+  GLfloat const matrix[9] = {
+    static_cast<GLfloat>(transform_.a), static_cast<GLfloat>(transform_.b), 0,
+    static_cast<GLfloat>(transform_.c), static_cast<GLfloat>(transform_.d), 0,
+    static_cast<GLfloat>(transform_.tx), static_cast<GLfloat>(transform_.ty), 1
+  };
+  glUseProgram(program_);
+  glUniformMatrix3fv(transform_uniform_, 1, GL_FALSE, matrix);
+  glBindTexture(GL_TEXTURE_2D, white_);
+  glBindBuffer(GL_ARRAY_BUFFER, mesh.buffer_);
+  bind_vertices_(nullptr);
+  glDrawArrays(GL_TRIANGLES, 0, mesh.count_);
+}
+
+void draw_batch::flush() {
+  if( vertices_.empty() ) {
+    return;
+  }
+  /* The vertices are already in clip space */
+  GLfloat const matrix[9] = { 1, 0, 0, 0, 1, 0, 0, 0, 1 };
+  glUseProgram(program_);
+  glUniformMatrix3fv(transform_uniform_, 1, GL_FALSE, matrix);
+  glBindTexture(GL_TEXTURE_2D, texture_);
+  glBindBuffer(GL_ARRAY_BUFFER, stream_);
+  /* Respecifying the whole buffer lets the driver hand us fresh
+     storage rather than waiting for the last frame's draw */
+  glBufferData(GL_ARRAY_BUFFER, vertices_.size() * sizeof(batch_vertex), vertices_.data(), GL_STREAM_DRAW);
+  bind_vertices_(nullptr);
+  glDrawArrays(GL_TRIANGLES, 0, static_cast<GLsizei>(vertices_.size()));
+  vertices_.clear();
+}
+
+void draw_batch::begin_target(batch_target & target) {
+  flush();
+  glBindFramebuffer(GL_FRAMEBUFFER, target.framebuffer_);
+  glViewport(0, 0, target.width_, target.height_);
+  /* Targets are drawn opaque, so keep their alpha at 1 whatever is
+     blended into them */
+  glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_FALSE);
+  target_ = &target;
+  width_ = target.width_;
+  height_ = target.height_;
+  push();
+  state_ = { identity_, identity_ };
+  update_transform_();
+}
+
+void draw_batch::end_target() {
+  flush();
+  glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  glViewport(0, 0, window_width_, window_height_);
+  target_ = nullptr;
+  width_ = window_width_;
+  height_ = window_height_;
+  pop();
+}
+
+vec2 draw_batch::to_pixels(vec2 const & p) const {
+  vec2 const q = transform_.apply(p);
+  return vec2((q.x() + 1) / 2 * width_, (q.y() + 1) / 2 * height_);
+}
+
+void draw_batch::clip(vec2 const & a, vec2 const & b) {
+  flush();
+  vec2 const pa = to_pixels(a);
+  vec2 const pb = to_pixels(b);
+  int const x0 = static_cast<int>(std::floor(std::min(pa.x(), pb.x())));
+  int const y0 = static_cast<int>(std::floor(std::min(pa.y(), pb.y())));
+  int const x1 = static_cast<int>(std::ceil(std::max(pa.x(), pb.x())));
+  int const y1 = static_cast<int>(std::ceil(std::max(pa.y(), pb.y())));
+  glEnable(GL_SCISSOR_TEST);
+  glScissor(x0, y0, x1 - x0, y1 - y0);
+}
+
+void draw_batch::end_clip() {
+  flush();
+  glDisable(GL_SCISSOR_TEST);
+}
+
+void draw_batch::clear() {
+  flush();
+  GLfloat previous[4];
+  glGetFloatv(GL_COLOR_CLEAR_VALUE, previous);
+  glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+  glClearColor(0, 0, 0, 1);
+  glClear(GL_COLOR_BUFFER_BIT);
+  glClearColor(previous[0], previous[1], previous[2], previous[3]);
+  if( target_ ) {
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_FALSE);
+  }
+}
@@ -0,0 +1,238 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#pragma once
+
+#include "vec2.h"
+
+#include <GL/gl.h>
+
+#include <cstdint>
+#include <vector>
+
+/// A colour, with each channel from 0 to 1
+struct rgba {
+  float r;
+  float g;
+  float b;
+  float a;
+};
+
+/// One corner of a triangle, ready for the GPU
+struct batch_vertex {
+  float x;
+  float y;
+  float u;
+  float v;
+  std::uint8_t color[4];
+};
+
+/// Geometry recorded once by draw_batch::record() and kept on the GPU,
+/// to be drawn again under whatever transform is current at the time.
+class batch_mesh {
+public:
+  batch_mesh();
+  ~batch_mesh();
+
+  batch_mesh(batch_mesh const &) = delete;
+  batch_mesh& operator=(batch_mesh const &) = delete;
+
+  bool empty() const {
+    return count_ == 0;
+  }
+
+private:
+  friend class draw_batch;
+
+  GLuint buffer_;
+  GLsizei count_;
+};
+
+/// A texture that a draw_batch can draw into instead of the window,
+/// and then draw onto the window like any other texture
+class batch_target {
+public:
+  /// Only if draw_batch::can_draw_to_texture()
+  batch_target(int width, int height);
+  ~batch_target();
+
+  batch_target(batch_target const &) = delete;
+  batch_target& operator=(batch_target const &) = delete;
+
+  int width() const {
+    return width_;
+  }
+
+  int height() const {
+    return height_;
+  }
+
+  GLuint texture() const {
+    return texture_;
+  }
+
+private:
+  friend class draw_batch;
+
+  GLuint framebuffer_;
+  GLuint texture_;
+  int width_;
+  int height_;
+};
+
+/// Collects coloured, optionally textured triangles into one streaming
+/// vertex buffer, and draws them with a single call when it's flushed,
+/// which only needs to happen once per frame, or when the texture
+/// changes. Everything is transformed as it's added, on the CPU, so
+/// that changing the transform doesn't need a flush either. Lines are
+/// drawn as thin quads, so they can go in the same buffer as
+/// everything else, in the order they were drawn.
+///
+/// It needs nothing beyond OpenGL 2.1 or OpenGL ES 2.0. There's one of
+/// these for the window, belonging to render.
+class draw_batch {
+public:
+  /// The window is width by height pixels
+  draw_batch(int width, int height);
+  ~draw_batch();
+
+  draw_batch(draw_batch const &) = delete;
+  draw_batch& operator=(draw_batch const &) = delete;
+
+  /// Show left to right and top to bottom across the window, and reset
+  /// the transform
+  void set_projection(double left, double right, double bottom, double top);
+
+  /// Save the projection and transform, to be put back by pop()
+  void push();
+  void pop();
+  void translate(double x, double y);
+  /// Rotate by angle radians, turning x towards y
+  void rotate(double angle);
+  void scale(double x, double y);
+
+  void set_color(rgba const & c) {
+    color_[0] = channel_(c.r);
+    color_[1] = channel_(c.g);
+    color_[2] = channel_(c.b);
+    color_[3] = channel_(c.a);
+  }
+
+  /// Draw with texture, or with no texture if it's 0. What's been
+  /// drawn with another texture is flushed before the next triangle,
+  /// so switching away and back again in between costs nothing.
+  void set_texture(GLuint texture) {
+    next_texture_ = texture ? texture : white_;
+  }
+
+  void triangle(vec2 const & a, vec2 const & b, vec2 const & c);
+  void quad(vec2 const & a, vec2 const & b, vec2 const & c, vec2 const & d);
+  /// A quad with texture coordinates for each corner
+  void quad(vec2 const (&corners)[4], vec2 const (&uvs)[4]);
+  /// A convex polygon
+  void polygon(vec2 const * points, std::size_t count);
+  /// A line about a pixel wide
+  void line(vec2 const & a, vec2 const & b);
+  void line_loop(vec2 const * points, std::size_t count);
+  /// A circle as a polygon with the given number of points
+  void circle(vec2 const & centre, double radius, unsigned points);
+  void circle_outline(vec2 const & centre, double radius, unsigned points);
+
+  /// Run fn, keeping what it draws in mesh instead of drawing it. The
+  /// transform starts out as the identity, but lines are as wide as
+  /// they would be if drawn under the current one.
+  template<typename F>
+  void record(batch_mesh & mesh, F && fn) {
+    begin_record_();
+    fn();
+    end_record_(mesh);
+  }
+
+  /// Draw mesh, transformed by the current transform
+  void draw(batch_mesh const & mesh);
+
+  /// Draw everything added so far
+  void flush();
+
+  /// Whether batch_targets can be used, which needs OpenGL 3, OpenGL
+  /// ES 2 or ARB_framebuffer_object
+  bool can_draw_to_texture() const {
+    return framebuffers_;
+  }
+
+  /// Draw into target until end_target(), starting with the identity
+  /// transform. Lines are as wide in its pixels as in the window's.
+  void begin_target(batch_target & target);
+  void end_target();
+
+  /// Only draw on the pixels between corners a and b, under the
+  /// current transform, until end_clip()
+  void clip(vec2 const & a, vec2 const & b);
+  void end_clip();
+
+  /// Clear the window or target, or as much of it as is clipped, to
+  /// opaque black
+  void clear();
+
+  /// Where p is drawn, under the current transform, in pixels from
+  /// the bottom left of the window or target
+  vec2 to_pixels(vec2 const & p) const;
+
+private:
+  /* An affine transform, x' = a*x + c*y + tx, y' = b*x + d*y + ty */
+  struct affine {
+    double a, b, c, d, tx, ty;
+
+    vec2 apply(vec2 const & p) const {
+      return vec2(a*p.x() + c*p.y() + tx, b*p.x() + d*p.y() + ty);
+    }
+    affine then(affine const & o) const;
+  };
+  static constexpr affine identity_ = { 1, 0, 0, 1, 0, 0 };
+
+  struct state {
+    affine projection;
+    affine model;
+  };
+
+  static std::uint8_t channel_(float v) {
+    return static_cast<std::uint8_t>(std::min(std::max(v, 0.0f), 1.0f) * 255 + 0.5f);
+  }
+
+  void use_texture_();
+  void vertex_(vec2 const & p, vec2 const & uv);
+  void update_transform_();
+  void bind_vertices_(batch_vertex const * base);
+  void begin_record_();
+  void end_record_(batch_mesh & mesh);
+  vec2 const * unit_circle_(unsigned points);
+
+  int width_;
+  int height_;
+  int window_width_;
+  int window_height_;
+  bool framebuffers_;
+  /* Or null for the window */
+  batch_target * target_;
+  GLuint program_;
+  GLint transform_uniform_;
+  GLuint stream_;
+  GLuint white_;
+  GLuint texture_;
+  GLuint next_texture_;
+  state state_;
+  std::vector<state> saved_;
+  /* Model to clip space, or while recording, model to mesh space */
+  affine transform_;
+  double half_line_;
+  std::uint8_t color_[4];
+  std::vector<batch_vertex> vertices_;
+  std::vector<batch_vertex> recorded_;
+  std::vector<batch_vertex> * out_;
+  bool recording_;
+  double record_scale_;
+  unsigned circle_points_;
+  std::vector<vec2> circle_;
+};
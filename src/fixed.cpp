@@ -0,0 +1,170 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#include "fixed.h"
+
+namespace {
+
+/* The tables are built by the compiler. Constant folding only uses
+   +, -, * and /, which IEEE double rounds the same way everywhere, so
+   they come out identical whoever builds them. */
+
+constexpr double taylor_sin(double x) {
+  double term = x;
+  double sum = x;
+  for( int n=1; n<12; ++n ) {
+    term *= -x * x / ((2*n) * (2*n + 1));
+    sum += term;
+  }
+  return sum;
+}
+
+constexpr double taylor_atan(double x) {
+  double power = x;
+  double sum = x;
+  for( int n=1; n<40; ++n ) {
+    power *= -x * x;
+    sum += power / (2*n + 1);
+  }
+  return sum;
+}
+
+/* sin over a quarter turn, at quarter_steps + 1 evenly spaced angles */
+constexpr unsigned quarter_bits = 10;
+constexpr unsigned quarter_steps = 1u << quarter_bits;
+constexpr unsigned turn_steps = 4 * quarter_steps;
+
+struct sin_table {
+  std::int64_t values[quarter_steps + 1];
+
+  constexpr sin_table()
+    : values()
+  {
+    for( unsigned i=0; i<=quarter_steps; ++i ) {
+      values[i] = fixed(taylor_sin(i * (M_PI/2) / quarter_steps)).raw();
+    }
+  }
+};
+
+/* atan(2^-i), the angles CORDIC rotates by */
+constexpr unsigned cordic_steps = fixed::fraction_bits;
+
+struct atan_table {
+  std::int64_t values[cordic_steps];
+
+  constexpr atan_table()
+    : values()
+  {
+    values[0] = fixed(M_PI/4).raw();
+    double t = 1;
+    for( unsigned i=1; i<cordic_steps; ++i ) {
+      t /= 2;
+      values[i] = fixed(taylor_atan(t)).raw();
+    }
+  }
+};
+
+constexpr sin_table sines;
+constexpr atan_table arctangents;
+
+constexpr fixed pi(M_PI);
+constexpr fixed steps_per_radian(turn_steps / (2*M_PI));
+
+/* sin of an angle given in fixed point table steps, interpolating
+   linearly between the entries, which is good to around 3e-7 */
+fixed table_sin(std::int64_t steps) {
+  std::uint32_t const fraction = static_cast<std::uint32_t>(steps);
+  unsigned const index = static_cast<unsigned>(steps >> fixed::fraction_bits) & (turn_steps - 1);
+  unsigned const quadrant = index >> quarter_bits;
+  unsigned const offset = index & (quarter_steps - 1);
+
+  /* The second and fourth quadrants run through the table backwards */
+  std::int64_t from, to;
+  if( quadrant & 1 ) {
+    from = sines.values[quarter_steps - offset];
+    to = sines.values[quarter_steps - offset - 1];
+  } else {
+    from = sines.values[offset];
+    to = sines.values[offset + 1];
+  }
+  std::int64_t const value = from + static_cast<std::int64_t>(
+    (static_cast<fixed_wide>(to - from) * fraction) >> fixed::fraction_bits);
+  return fixed::from_raw(quadrant & 2 ? -value : value);
+}
+
+}
+
+fixed sqrt(fixed a) {
+  if( a.raw_ <= 0 ) {
+    return 0;
+  }
+  /* Bit by bit integer square root of the value scaled up by another
+     32 bits, which leaves the result in Q32.32 */
+  fixed_wide_unsigned n = static_cast<fixed_wide_unsigned>(a.raw_) << fixed::fraction_bits;
+  fixed_wide_unsigned res = 0;
+  fixed_wide_unsigned bit = fixed_wide_unsigned(1) << 94;
+  while( bit > n ) {
+    bit >>= 2;
+  }
+  while( bit != 0 ) {
+    if( n >= res + bit ) {
+      n -= res + bit;
+      res = (res >> 1) + bit;
+    } else {
+      res >>= 1;
+    }
+    bit >>= 2;
+  }
+  return fixed::from_raw(static_cast<std::int64_t>(res));
+}
+
+fixed sin(fixed angle) {
+  return table_sin((angle * steps_per_radian).raw_);
+}
+
+fixed cos(fixed angle) {
+  std::int64_t const quarter = std::int64_t(quarter_steps) << fixed::fraction_bits;
+  return table_sin((angle * steps_per_radian).raw_ + quarter);
+}
+
+fixed atan2(fixed y, fixed x) {
+  std::int64_t vx = x.raw_;
+  std::int64_t vy = y.raw_;
+  if( vx == 0 && vy == 0 ) {
+    return 0;
+  }
+
+  /* Keep well clear of overflow while rotating */
+  while( vx > (std::int64_t(1) << 60) || vx < -(std::int64_t(1) << 60) ||
+         vy > (std::int64_t(1) << 60) || vy < -(std::int64_t(1) << 60) ) {
+    vx /= 4;
+    vy /= 4;
+  }
+
+  /* CORDIC only converges within a quarter turn of the x axis, so
+     turn anything pointing left round by half a turn first */
+  fixed angle = 0;
+  if( vx < 0 ) {
+    angle = vy >= 0 ? pi : -pi;
+    vx = -vx;
+    vy = -vy;
+  }
+
+  std::int64_t z = 0;
+  for( unsigned i=0; i<cordic_steps && vy != 0; ++i ) {
+    std::int64_t const dx = vy >> i;
+    std::int64_t const dy = vx >> i;
+    if( vy > 0 ) {
+      vx += dx;
+      vy -= dy;
+      z += arctangents.values[i];
+    } else {
+      vx -= dx;
+      vy += dy;
+      z -= arctangents.values[i];
+    }
+  }
+  return angle + fixed::from_raw(z);
+}
@@ -0,0 +1,125 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <type_traits>
+
+/* The products and square roots need twice the bits of a fixed */
+__extension__ typedef __int128 fixed_wide;
+__extension__ typedef unsigned __int128 fixed_wide_unsigned;
+
+/// A signed Q32.32 fixed point number. Everything it does is integer
+/// arithmetic, including sqrt, sin, cos and atan2, so it gives
+/// exactly the same results whatever the compiler, optimisation flags
+/// or CPU. It's a drop in replacement for double in the simulation,
+/// apart from having to be converted to and from double explicitly.
+/// Overflow wraps, silently; the simulation works in units of track
+/// cells, so nothing comes close.
+class fixed {
+public:
+  static constexpr unsigned fraction_bits = 32;
+
+  fixed() = default;
+
+  constexpr fixed(int value)
+    : raw_(static_cast<std::int64_t>(value) * one_raw)
+  {}
+
+  /// Conversion from floating point rounds to the nearest fixed. It's
+  /// exact as far as the double goes, so is the same everywhere.
+  constexpr explicit fixed(double value)
+    : raw_(static_cast<std::int64_t>(value * one_raw + (value < 0 ? -0.5 : 0.5)))
+  {}
+
+  constexpr explicit fixed(float value)
+    : fixed(static_cast<double>(value))
+  {}
+
+  static constexpr fixed from_raw(std::int64_t raw) {
+    return fixed(raw_tag(), raw);
+  }
+
+  constexpr std::int64_t raw() const {
+    return raw_;
+  }
+
+  /// Conversion to floating point is as exact as the type allows;
+  /// conversion to integers truncates towards zero, as for double.
+  template<typename T, typename = std::enable_if_t<std::is_arithmetic_v<T>>>
+  constexpr explicit operator T() const {
+    if constexpr( std::is_floating_point_v<T> ) {
+      return static_cast<T>(static_cast<double>(raw_) / one_raw);
+    } else {
+      return static_cast<T>(raw_ / one_raw);
+    }
+  }
+
+  constexpr fixed& operator+=(fixed other) {
+    raw_ += other.raw_;
+    return *this;
+  }
+  constexpr fixed& operator-=(fixed other) {
+    raw_ -= other.raw_;
+    return *this;
+  }
+  /// Products round to nearest, with halves going away from zero, so
+  /// that (-a)*b and -(a*b) always agree
+  constexpr fixed& operator*=(fixed other) {
+    fixed_wide const product = static_cast<fixed_wide>(raw_) * other.raw_;
+    fixed_wide const half = fixed_wide(1) << (fraction_bits - 1);
+    raw_ = static_cast<std::int64_t>((product + half - (product < 0)) >> fraction_bits);
+    return *this;
+  }
+  constexpr fixed& operator/=(fixed other) {
+    raw_ = static_cast<std::int64_t>(static_cast<fixed_wide>(raw_) * one_raw / other.raw_);
+    return *this;
+  }
+
+  constexpr fixed operator-() const {
+    return from_raw(-raw_);
+  }
+
+  friend constexpr fixed operator+(fixed a, fixed b) { return a += b; }
+  friend constexpr fixed operator-(fixed a, fixed b) { return a -= b; }
+  friend constexpr fixed operator*(fixed a, fixed b) { return a *= b; }
+  friend constexpr fixed operator/(fixed a, fixed b) { return a /= b; }
+
+  friend constexpr bool operator==(fixed a, fixed b) { return a.raw_ == b.raw_; }
+  friend constexpr bool operator!=(fixed a, fixed b) { return a.raw_ != b.raw_; }
+  friend constexpr bool operator<(fixed a, fixed b) { return a.raw_ < b.raw_; }
+  friend constexpr bool operator<=(fixed a, fixed b) { return a.raw_ <= b.raw_; }
+  friend constexpr bool operator>(fixed a, fixed b) { return a.raw_ > b.raw_; }
+  friend constexpr bool operator>=(fixed a, fixed b) { return a.raw_ >= b.raw_; }
+
+  friend constexpr fixed abs(fixed a) {
+    return a.raw_ < 0 ? -a : a;
+  }
+
+  friend fixed sqrt(fixed a);
+  friend fixed sin(fixed angle);
+  friend fixed cos(fixed angle);
+  friend fixed atan2(fixed y, fixed x);
+
+  friend std::ostream& operator<<(std::ostream& os, fixed a) {
+    return os << static_cast<double>(a);
+  }
+
+private:
+  static constexpr std::int64_t one_raw = std::int64_t(1) << fraction_bits;
+
+  struct raw_tag {};
+  constexpr fixed(raw_tag, std::int64_t raw)
+    : raw_(raw)
+  {}
+
+  std::int64_t raw_;
+};
+
+static_assert(std::is_trivially_copyable_v<fixed>);
+static_assert(sizeof(fixed) == sizeof(std::int64_t));
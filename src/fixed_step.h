@@ -0,0 +1,58 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#pragma once
+
+#include <cmath>
+
+/// Drive a simulation at a fixed rate from variable frame times.
+/// Elapsed time is accumulated and consumed in whole steps; whatever
+/// is left over tells the renderer how far it is between the last two
+/// simulation states. If we fall too far behind, the backlog is
+/// dropped rather than trying to catch up all at once.
+class fixed_step {
+public:
+  fixed_step(double step, unsigned max_steps)
+    : step_(step),
+      max_steps_(max_steps),
+      accumulator_(0),
+      dropped_(0)
+  {}
+
+  /// Add some elapsed wall-clock time, and return how many steps
+  /// should now be simulated.
+  unsigned advance(double elapsed) {
+    accumulator_ += elapsed;
+    unsigned steps = static_cast<unsigned>(std::floor(accumulator_ / step_));
+    if( steps > max_steps_ ) {
+      dropped_ += (steps - max_steps_) * step_;
+      steps = max_steps_;
+    }
+    accumulator_ = std::fmod(accumulator_, step_);
+    return steps;
+  }
+
+  /// The length of one simulation step, in seconds
+  double step() const {
+    return step_;
+  }
+
+  /// How far we are between the previous and current simulation
+  /// states, in [0, 1)
+  double alpha() const {
+    return accumulator_ / step_;
+  }
+
+  /// Total time thrown away because we couldn't keep up
+  double dropped() const {
+    return dropped_;
+  }
+
+private:
+  double step_;
+  unsigned max_steps_;
+  double accumulator_;
+  double dropped_;
+};
@@ -5,21 +5,70 @@
 */
 #include "font.h"
 
+#include "draw_batch.h"
 #include "render_helpers.h"
 
 #include <GL/gl.h>
 #include <SDL_ttf.h>
 
-#include <cassert>
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
 
+/* Glyphs are drawn into one texture as they're first needed, and kept
+   there, so drawing text is just a quad per glyph. Each has a clear
+   pixel around it, so that filtering doesn't pick up its neighbours. */
 class font_guts {
 public:
   font_guts(std::string const &filename, int point_size);
   ~font_guts();
-  void render_text(std::string const &str, void (*fn)(SDL_Surface *))  const;
+  font_guts(font_guts const &) = delete;
+  font_guts& operator=(font_guts const &) = delete;
+
+  /* Find t's glyphs, adding any that aren't in the atlas yet */
+  void lay_out(draw_batch & batch, text & t);
+  /* Draw t with the top of the line at y=0, the height of the line
+     being 1, or the whole string 1 wide if to_width. align is 0 to
+     start the text at x=0, 0.5 to centre it and 1 to end it there. */
+  void draw(draw_batch & batch, text const & t, double align, bool to_width) const;
+  unsigned long generation() const {
+    return generation_;
+  }
 
 private:
+  struct glyph {
+    int advance;
+    /* The bitmap, including its clear border, from the pen position
+       and the top of the line, and where it is in the atlas. It's
+       empty for blank glyphs like spaces. */
+    int left, top, width, height;
+    int atlas_x, atlas_y;
+  };
+
+  glyph const * find_glyph_(Uint16 ch);
+  bool add_glyph_(Uint16 ch);
+  bool place_(int width, int height, int &x, int &y);
+  void grow_(int width, int height);
+  void upload_(int x, int y, int width, int height);
+  void reset_();
+
   TTF_Font * font_;
+  int line_height_;
+  std::unordered_map<Uint16, glyph> glyphs_;
+
+  GLuint texture_;
+  int max_size_;
+  int atlas_width_, atlas_height_;
+  /* A copy of the atlas' alpha, for when it has to grow */
+  std::vector<std::uint8_t> coverage_;
+  /* Glyphs are packed along shelves, the height of the tallest glyph
+     on them */
+  int shelf_x_, shelf_y_, shelf_height_;
+  unsigned long generation_;
+
+  std::vector<Uint16> chars_;
+  std::vector<glyph const *> line_;
 };
 
 void font::init() {
@@ -40,122 +89,350 @@ font::font(std::string const &filename, int point_size)
 font::~font() {
 }
 
-static void render_to_height(SDL_Surface *surf) {
-  glBegin(GL_QUADS);
-  glTexCoord2d(0, 0); glVertex3d(0, 0, 0);
-  glTexCoord2d(1, 0); glVertex3d(surf->w / (double)surf->h, 0, 0);
-  glTexCoord2d(1, 1); glVertex3d(surf->w / (double)surf->h, 1, 0);
-  glTexCoord2d(0, 1); glVertex3d(0, 1, 0);
-  glEnd();
-  check_gl_error();
+/* Text drawn straight from a string is laid out every time */
+void font::render_text_to_height(draw_batch & batch, std::string const &str, vec2 const &pos, double h) const {
+  text t(*this);
+  t.set(str);
+  t.draw_to_height(batch, pos, h);
 }
 
-static void render_centered_to_height(SDL_Surface *surf) {
-  double const x = surf->w/(2.0 * surf->h);
-  glBegin(GL_QUADS);
-  glTexCoord2d(0, 0); glVertex3d(-x, 0, 0);
-  glTexCoord2d(1, 0); glVertex3d( x, 0, 0);
-  glTexCoord2d(1, 1); glVertex3d( x, 1, 0);
-  glTexCoord2d(0, 1); glVertex3d(-x, 1, 0);
-  glEnd();
-  check_gl_error();
+void font::render_text_centered_to_width(draw_batch & batch, std::string const &str, vec2 const &pos, double w) const {
+  text t(*this);
+  t.set(str);
+  t.draw_centered_to_width(batch, pos, w);
 }
 
-static void render_right_to_height(SDL_Surface *surf) {
-  double const x = surf->w/(double)surf->h;
-  glBegin(GL_QUADS);
-  glTexCoord2d(0, 0); glVertex3d(-x, 0, 0);
-  glTexCoord2d(1, 0); glVertex3d( 0, 0, 0);
-  glTexCoord2d(1, 1); glVertex3d( 0, 1, 0);
-  glTexCoord2d(0, 1); glVertex3d(-x, 1, 0);
-  glEnd();
-  check_gl_error();
+void font::render_text_centered_to_height(draw_batch & batch, std::string const &str, vec2 const &pos, double h) const {
+  text t(*this);
+  t.set(str);
+  t.draw_centered_to_height(batch, pos, h);
 }
 
-static void render_centered_to_width(SDL_Surface *surf) {
-  glBegin(GL_QUADS);
-  glTexCoord2d(0, 0); glVertex3d(-0.5, 0, 0);
-  glTexCoord2d(1, 0); glVertex3d( 0.5, 0, 0);
-  glTexCoord2d(1, 1); glVertex3d( 0.5, surf->h / (double)surf->w, 0);
-  glTexCoord2d(0, 1); glVertex3d(-0.5, surf->h / (double)surf->w, 0);
-  glEnd();
-  check_gl_error();
+void font::render_text_right_to_height(draw_batch & batch, std::string const &str, vec2 const &pos, double h) const {
+  text t(*this);
+  t.set(str);
+  t.draw_right_to_height(batch, pos, h);
 }
 
-void font::render_text_to_height(std::string const &str, vec2 const &pos, double h) const {
-  glPushMatrix();
-  glTranslated(pos.x(), pos.y(), 0);
-  glScaled(h, h, 0);
-  guts_->render_text(str, render_to_height);
-  glPopMatrix();
+text::text(font const & f)
+  : guts_(f.guts_.get()),
+    laid_out_(false),
+    atlas_generation_(0),
+    width_(0)
+{}
+
+void text::set(std::string const & str) {
+  if( str != str_ ) {
+    str_ = str;
+    laid_out_ = false;
+  }
 }
 
-void font::render_text_centered_to_width(std::string const &str, vec2 const &pos, double w) const {
-  glPushMatrix();
-  glTranslated(pos.x(), pos.y(), 0);
-  glScaled(w, w, 0);
-  guts_->render_text(str, render_centered_to_width);
-  glPopMatrix();
+void text::draw_to_height(draw_batch & batch, vec2 const &pos, double h) {
+  draw_(batch, pos, h, 0, false);
 }
 
-void font::render_text_centered_to_height(std::string const &str, vec2 const &pos, double h) const {
-  glPushMatrix();
-  glTranslated(pos.x(), pos.y(), 0);
-  glScaled(h, h, 0);
-  guts_->render_text(str, render_centered_to_height);
-  glPopMatrix();
+void text::draw_centered_to_width(draw_batch & batch, vec2 const &pos, double w) {
+  draw_(batch, pos, w, 0.5, true);
 }
 
-void font::render_text_right_to_height(std::string const &str, vec2 const &pos, double h) const {
-  glPushMatrix();
-  glTranslated(pos.x(), pos.y(), 0);
-  glScaled(h, h, 0);
-  guts_->render_text(str, render_right_to_height);
-  glPopMatrix();
+void text::draw_centered_to_height(draw_batch & batch, vec2 const &pos, double h) {
+  draw_(batch, pos, h, 0.5, false);
+}
+
+void text::draw_right_to_height(draw_batch & batch, vec2 const &pos, double h) {
+  draw_(batch, pos, h, 1, false);
+}
+
+void text::draw_(draw_batch & batch, vec2 const &pos, double size, double align, bool to_width) {
+  if( !laid_out_ || atlas_generation_ != guts_->generation() ) {
+    guts_->lay_out(batch, *this);
+  }
+  batch.push();
+  batch.translate(pos.x(), pos.y());
+  batch.scale(size, size);
+  guts_->draw(batch, *this, align, to_width);
+  batch.pop();
 }
 
 font_guts::font_guts(std::string const &filename, int point_size)
-  : font_(nullptr)
+  : font_(nullptr),
+    line_height_(0),
+    texture_(0),
+    max_size_(0),
+    atlas_width_(0),
+    atlas_height_(0),
+    shelf_x_(0),
+    shelf_y_(0),
+    shelf_height_(0),
+    generation_(0)
 {
   font_ = TTF_OpenFont(filename.c_str(), point_size);
   if( !font_ ) {
     std::cerr << "Failed to load font: "<<TTF_GetError() <<std::endl;
     std::exit(1);
   }
+  line_height_ = TTF_FontHeight(font_);
 }
 
 font_guts::~font_guts() {
+  if( texture_ ) {
+    glDeleteTextures(1, &texture_);
+  }
   if( font_ ) {
     TTF_CloseFont(font_);
   }
 }
 
-void font_guts::render_text(std::string const &str, void (*render)(SDL_Surface *surf)) const {
-  SDL_Color color = { 255 , 255, 255, 255 };
-  SDL_Surface *surf = TTF_RenderUTF8_Blended(font_, str.c_str(), color);
+/* SDL_ttf's glyph functions only take the basic multilingual plane, so
+   anything else, or anything that isn't UTF-8, becomes U+FFFD */
+static void decode_utf8(std::string const &str, std::vector<Uint16> &chars) {
+  chars.clear();
+  std::size_t i = 0;
+  while( i < str.size() ) {
+    unsigned char const lead = str[i++];
+    unsigned extra;
+    std::uint32_t ch;
+    if( lead < 0x80 ) {
+      chars.push_back(lead);
+      continue;
+    } else if( (lead & 0xe0) == 0xc0 ) {
+      extra = 1;
+      ch = lead & 0x1f;
+    } else if( (lead & 0xf0) == 0xe0 ) {
+      extra = 2;
+      ch = lead & 0x0f;
+    } else if( (lead & 0xf8) == 0xf0 ) {
+      extra = 3;
+      ch = lead & 0x07;
+    } else {
+      chars.push_back(0xfffd);
+      continue;
+    }
+    for( ; extra > 0 && i < str.size() && (str[i] & 0xc0) == 0x80; --extra ) {
+      ch = (ch << 6) | (str[i++] & 0x3f);
+    }
+    chars.push_back(extra == 0 && ch <= 0xffff ? ch : 0xfffd);
+  }
+}
 
-  GLuint texture;
-  glGenTextures(1, &texture);
-  glBindTexture(GL_TEXTURE_2D, texture);
+void font_guts::lay_out(draw_batch & batch, text & t) {
+  decode_utf8(t.str_, chars_);
 
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, surf->w, surf->h, 0, GL_RGBA, GL_UNSIGNED_BYTE, surf->pixels);
+  /* Growing the atlas would throw out the texture coordinates of
+     text already waiting to be drawn, so that's drawn first if there
+     are glyphs to add. They're all looked up before the quads are
+     worked out; if the atlas fills up, it starts again empty, which
+     can only happen once for one string. */
+  if( std::any_of(chars_.begin(), chars_.end(),
+                  [this](Uint16 ch) { return glyphs_.count(ch) == 0; }) ) {
+    batch.flush();
+  }
+  line_.clear();
+  for( Uint16 ch: chars_ ) {
+    glyph const * g = find_glyph_(ch);
+    if( !g ) {
+      reset_();
+      line_.clear();
+      for( Uint16 again: chars_ ) {
+        if( !(g = find_glyph_(again)) ) {
+          std::cerr << "Text too big for the font's atlas: " << t.str_ << std::endl;
+          std::exit(1);
+        }
+        line_.push_back(g);
+      }
+      break;
+    }
+    line_.push_back(g);
+  }
 
-  glEnable(GL_TEXTURE_2D);
-  glEnable(GL_BLEND);
-  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-  glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
-  glBindTexture(GL_TEXTURE_2D, texture);
+  t.quads_.clear();
+  int pen = 0;
+  for( std::size_t i=0; i<line_.size(); ++i ) {
+    glyph const & g = *line_[i];
+    if( i > 0 ) {
+      pen += TTF_GetFontKerningSizeGlyphs(font_, chars_[i-1], chars_[i]);
+    }
+    if( g.width != 0 ) {
+      t.quads_.push_back({ pen + g.left, g.top, g.width, g.height, g.atlas_x, g.atlas_y });
+    }
+    pen += g.advance;
+  }
+  t.width_ = pen;
+  t.atlas_generation_ = generation_;
+  t.laid_out_ = true;
+}
 
-  render(surf);
+void font_guts::draw(draw_batch & batch, text const & t, double align, bool to_width) const {
+  if( t.width_ <= 0 ) {
+    return;
+  }
+  double const unit = to_width ? t.width_ : line_height_;
+  double const start = -align * t.width_;
+  batch.set_texture(texture_);
+  for( auto const & q: t.quads_ ) {
+    double const x0 = (start + q.left) / unit;
+    double const x1 = x0 + q.width / unit;
+    double const y0 = q.top / unit;
+    double const y1 = y0 + q.height / unit;
+    double const u0 = q.atlas_x / (double)atlas_width_;
+    double const u1 = (q.atlas_x + q.width) / (double)atlas_width_;
+    double const v0 = q.atlas_y / (double)atlas_height_;
+    double const v1 = (q.atlas_y + q.height) / (double)atlas_height_;
+    batch.quad({ vec2(x0, y0), vec2(x1, y0), vec2(x1, y1), vec2(x0, y1) },
+               { vec2(u0, v0), vec2(u1, v0), vec2(u1, v1), vec2(u0, v1) });
+  }
+  batch.set_texture(0);
+}
 
-  glDeleteTextures(1, &texture);
-  glDisable(GL_TEXTURE_2D);
+font_guts::glyph const * font_guts::find_glyph_(Uint16 ch) {
+  auto found = glyphs_.find(ch);
+  if( found == glyphs_.end() ) {
+    if( !add_glyph_(ch) ) {
+      return nullptr;
+    }
+    found = glyphs_.find(ch);
+  }
+  return &found->second;
+}
 
-  check_gl_error();
+bool font_guts::add_glyph_(Uint16 ch) {
+  glyph g = { 0, 0, 0, 0, 0, 0, 0 };
+  int minx, maxx, miny, maxy;
+  if( TTF_GlyphMetrics(font_, ch, &minx, &maxx, &miny, &maxy, &g.advance) == -1 ) {
+    /* Not in the font, so it's left out */
+    glyphs_.emplace(ch, g);
+    return true;
+  }
+
+  SDL_Color const color = { 255, 255, 255, 255 };
+  SDL_Surface * surf = TTF_RenderGlyph_Blended(font_, ch, color);
+  if( !surf ) {
+    glyphs_.emplace(ch, g);
+    return true;
+  }
+
+  /* The surface is the height of the line, starting from the pen
+     position, or from further left if the glyph overhangs it. Only
+     the part that's been drawn on is kept. */
+  auto const alpha = [surf](int x, int y) {
+    Uint32 const pixel = reinterpret_cast<Uint32 const *>(static_cast<std::uint8_t const *>(surf->pixels) + y*surf->pitch)[x];
+    return static_cast<std::uint8_t>((pixel & surf->format->Amask) >> surf->format->Ashift);
+  };
+  int ink_x0 = surf->w, ink_y0 = surf->h, ink_x1 = 0, ink_y1 = 0;
+  for( int y=0; y<surf->h; ++y ) {
+    for( int x=0; x<surf->w; ++x ) {
+      if( alpha(x, y) ) {
+        ink_x0 = std::min(ink_x0, x);
+        ink_y0 = std::min(ink_y0, y);
+        ink_x1 = std::max(ink_x1, x + 1);
+        ink_y1 = std::max(ink_y1, y + 1);
+      }
+    }
+  }
+
+  if( ink_x0 < ink_x1 ) {
+    g.left = std::min(minx, 0) + ink_x0 - 1;
+    g.top = ink_y0 - 1;
+    g.width = ink_x1 - ink_x0 + 2;
+    g.height = ink_y1 - ink_y0 + 2;
+    if( !place_(g.width, g.height, g.atlas_x, g.atlas_y) ) {
+      SDL_FreeSurface(surf);
+      return false;
+    }
+    for( int y=ink_y0; y<ink_y1; ++y ) {
+      std::uint8_t * row = &coverage_[(g.atlas_y + 1 + y - ink_y0) * atlas_width_ + g.atlas_x + 1];
+      for( int x=ink_x0; x<ink_x1; ++x ) {
+        row[x - ink_x0] = alpha(x, y);
+      }
+    }
+    upload_(g.atlas_x, g.atlas_y, g.width, g.height);
+  }
 
   SDL_FreeSurface(surf);
+  glyphs_.emplace(ch, g);
+  return true;
+}
+
+/* Find room for a glyph, growing the atlas if need be, or false if
+   it can't get any bigger */
+bool font_guts::place_(int width, int height, int &x, int &y) {
+  if( !texture_ ) {
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size_);
+    glGenTextures(1, &texture_);
+    glBindTexture(GL_TEXTURE_2D, texture_);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    int const size = std::min(1024, max_size_);
+    grow_(size, size);
+  }
+
+  for( ;; ) {
+    if( shelf_x_ + width > atlas_width_ ) {
+      shelf_y_ += shelf_height_;
+      shelf_x_ = 0;
+      shelf_height_ = 0;
+    }
+    if( width <= atlas_width_ && shelf_y_ + height <= atlas_height_ ) {
+      break;
+    }
+    /* Growing upwards keeps the shelves as they are; growing sideways
+       leaves them short, so only do that when it's tall enough */
+    if( atlas_height_ < atlas_width_ || atlas_height_ < height * 4 ) {
+      if( atlas_height_ * 2 > max_size_ ) {
+        return false;
+      }
+      grow_(atlas_width_, atlas_height_ * 2);
+    } else {
+      if( atlas_width_ * 2 > max_size_ ) {
+        return false;
+      }
+      grow_(atlas_width_ * 2, atlas_height_);
+    }
+  }
+
+  x = shelf_x_;
+  y = shelf_y_;
+  shelf_x_ += width;
+  shelf_height_ = std::max(shelf_height_, height);
+  return true;
+}
+
+void font_guts::grow_(int width, int height) {
+  std::vector<std::uint8_t> grown(static_cast<std::size_t>(width) * height, 0);
+  for( int y=0; y<atlas_height_; ++y ) {
+    std::copy_n(&coverage_[y * atlas_width_], atlas_width_, &grown[y * width]);
+  }
+  coverage_.swap(grown);
+  atlas_width_ = width;
+  atlas_height_ = height;
+  glBindTexture(GL_TEXTURE_2D, texture_);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+  upload_(0, 0, width, height);
+}
+
+/* The atlas is white, with the glyphs in its alpha */
+void font_guts::upload_(int x, int y, int width, int height) {
+  std::vector<std::uint8_t> pixels(static_cast<std::size_t>(width) * height * 4, 255);
+  for( int row=0; row<height; ++row ) {
+    for( int col=0; col<width; ++col ) {
+      pixels[(row * width + col) * 4 + 3] = coverage_[(y + row) * atlas_width_ + x + col];
+    }
+  }
+  glBindTexture(GL_TEXTURE_2D, texture_);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, width, height, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+  check_gl_error();
+}
+
+/* Throws away every glyph, when the atlas is as big as it can get */
+void font_guts::reset_() {
+  ++generation_;
+  glyphs_.clear();
+  std::fill(coverage_.begin(), coverage_.end(), 0);
+  upload_(0, 0, atlas_width_, atlas_height_);
+  shelf_x_ = 0;
+  shelf_y_ = 0;
+  shelf_height_ = 0;
 }
@@ -8,7 +8,10 @@
 #include "vec2.h"
 
 #include <memory>
+#include <string>
+#include <vector>
 
+class draw_batch;
 class font_guts;
 
 /// A font that can be used to render text to the screen.
@@ -18,10 +21,52 @@ public:
   static void quit();
   font(std::string const& filename, int point_size);
   ~font();
-  void render_text_to_height(std::string const &str, vec2 const &pos, double h) const;
-  void render_text_right_to_height(std::string const &str, vec2 const &pos, double h) const;
-  void render_text_centered_to_width(std::string const &str, vec2 const &pos, double w) const;
-  void render_text_centered_to_height(std::string const &str, vec2 const &pos, double h) const;
+  void render_text_to_height(draw_batch & batch, std::string const &str, vec2 const &pos, double h) const;
+  void render_text_right_to_height(draw_batch & batch, std::string const &str, vec2 const &pos, double h) const;
+  void render_text_centered_to_width(draw_batch & batch, std::string const &str, vec2 const &pos, double w) const;
+  void render_text_centered_to_height(draw_batch & batch, std::string const &str, vec2 const &pos, double h) const;
 private:
+  friend class text;
   std::unique_ptr<font_guts> guts_;
 };
+
+/// A string in a font, for text that's drawn every frame but rarely
+/// changes. It's laid out when it's first drawn after being set to
+/// something different, and otherwise drawing it just puts the quads
+/// for its glyphs in the batch. The font has to outlive it.
+class text {
+public:
+  explicit text(font const & f);
+
+  /// Show str from now on. Setting the string it already has costs
+  /// nothing.
+  void set(std::string const & str);
+  std::string const & str() const {
+    return str_;
+  }
+
+  /// These place the text like font's functions of the same names
+  void draw_to_height(draw_batch & batch, vec2 const &pos, double h);
+  void draw_right_to_height(draw_batch & batch, vec2 const &pos, double h);
+  void draw_centered_to_width(draw_batch & batch, vec2 const &pos, double w);
+  void draw_centered_to_height(draw_batch & batch, vec2 const &pos, double h);
+
+private:
+  friend class font_guts;
+
+  /* A glyph's place in the line and in the font's atlas, in pixels */
+  struct glyph_quad {
+    int left, top, width, height;
+    int atlas_x, atlas_y;
+  };
+
+  void draw_(draw_batch & batch, vec2 const &pos, double size, double align, bool to_width);
+
+  font_guts * guts_;
+  std::string str_;
+  bool laid_out_;
+  /* The atlas the quads are in; it starts again if it fills up */
+  unsigned long atlas_generation_;
+  std::vector<glyph_quad> quads_;
+  int width_;
+};
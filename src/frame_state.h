@@ -0,0 +1,46 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#pragma once
+
+#include "car.h"
+#include "track_editor.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+/// Everything drawn of a race in one frame, copied out of the
+/// simulation, so that it can be drawn while the next steps run.
+struct frame_state {
+  struct car_frame {
+    car_state state;
+    unsigned color;
+  };
+
+  std::vector<car_frame> cars;
+
+  /// How far the cars had got from their previous states towards
+  /// their current ones when this was published, and when that was,
+  /// by SDL_GetPerformanceCounter()
+  double alpha;
+  std::uint64_t published;
+  /// The length of one simulation step, in seconds
+  double step;
+
+  /// What the track editor shows, while it's in use
+  std::optional<track_editor::overlay> editor;
+  /// The cells painted since the frame before, in the order they were
+  /// painted
+  std::vector<cell_edit> edits;
+
+  /// How far the cars have got by now, going on at the same speed
+  /// since this was published, but never past their current states
+  double alpha_at(std::uint64_t now, std::uint64_t ticks_per_second) const {
+    double const since = (now - published) / static_cast<double>(ticks_per_second);
+    return std::min(alpha + since / step, 1.0);
+  }
+};
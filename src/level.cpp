@@ -5,14 +5,118 @@
 */
 #include "level.h"
 
+#include "checksum.h"
 #include "error.h"
-#include "render_helpers.h"
 
+#include <algorithm>
 #include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cmath>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <limits>
+
+/* A binary track starts with this, then has a table with an entry
+   for each chunk, row by row, then the cells of every chunk that
+   isn't all one value, as level keeps them in memory. Everything is
+   in the byte order of the machine that wrote it, which byte_order
+   tells apart. */
+struct track_header {
+  char magic[4];
+  std::uint32_t version;
+  std::uint32_t byte_order;
+  std::uint32_t width;
+  std::uint32_t height;
+  std::uint32_t chunk_size;
+  /* level::checksum() of the track */
+  std::uint32_t checksum;
+  /* Of the fields above */
+  std::uint32_t header_checksum;
+};
+
+struct track_chunk {
+  /* Where the chunk's cells are, from the start of the file, or 0 if
+     they are all fill */
+  std::uint64_t offset;
+  std::uint32_t fill;
+  std::uint32_t reserved;
+};
+
+static char const track_magic[4] = { 'N', 'X', 'T', 'K' };
+static std::uint32_t const track_version = 2;
+static std::uint32_t const track_byte_order = 0x01020304;
+/* Large enough for any real track, small enough that cell indices
+   can't overflow */
+static unsigned const max_track_side = 1 << 15;
+static std::size_t const chunk_bytes = level::chunk_size * level::chunk_size * sizeof(unsigned short);
+
+static std::uint32_t header_checksum(track_header const & header) {
+  ::checksum sum;
+  sum.add_bytes(header.magic, sizeof(header.magic));
+  sum.add(header.version);
+  sum.add(header.byte_order);
+  sum.add(header.width);
+  sum.add(header.height);
+  sum.add(header.chunk_size);
+  sum.add(header.checksum);
+  return sum.value();
+}
+
+level::level(unsigned w, unsigned h)
+  : w_(w),
+    h_(h),
+    chunks_w_((w + chunk_size - 1) / chunk_size),
+    chunks_h_((h + chunk_size - 1) / chunk_size),
+    chunks_(chunks_w_ * chunks_h_),
+    resident_fields_(0),
+    field_clock_(0),
+    last_field_chunk_(~std::size_t(0)),
+    flow_built_(),
+    flow_build_time_(0)
+{}
+
+level::level(std::unique_ptr<unsigned short[]>&& map, unsigned w, unsigned h)
+  : level(w, h)
+{
+  for( unsigned cy=0; cy<chunks_h_; ++cy ) {
+    for( unsigned cx=0; cx<chunks_w_; ++cx ) {
+      chunk & c = chunks_[cy*chunks_w_ + cx];
+      unsigned const x0 = cx*chunk_size;
+      unsigned const y0 = cy*chunk_size;
+      unsigned const x1 = std::min(x0 + chunk_size, w_);
+      unsigned const y1 = std::min(y0 + chunk_size, h_);
+
+      /* Only keep the cells if they aren't all the same */
+      c.fill = map[y0*w_ + x0];
+      bool uniform = true;
+      for( unsigned j=y0; j<y1 && uniform; ++j ) {
+        uniform = std::all_of(&map[j*w_ + x0], &map[j*w_ + x1],
+                              [&](unsigned short v) { return v == c.fill; });
+      }
+      if( uniform ) {
+        continue;
+      }
+      c.owned.reset(new unsigned short[chunk_size*chunk_size]());
+      c.cells = c.owned.get();
+      for( unsigned j=y0; j<y1; ++j ) {
+        std::copy(&map[j*w_ + x0], &map[j*w_ + x1], &c.cells[(j - y0)*chunk_size]);
+      }
+    }
+  }
+}
 
 std::shared_ptr<level> level::load(std::string const &filename) {
+  char magic[sizeof(track_magic)] = {};
+  std::ifstream(filename, std::ios::binary).read(magic, sizeof(magic));
+  if( std::equal(magic, magic + sizeof(magic), track_magic) ) {
+    return load_binary_(filename);
+  }
+  return load_text_(filename);
+}
+
+std::shared_ptr<level> level::load_text_(std::string const &filename) {
   std::ifstream infile(filename);
 
   unsigned w, h;
@@ -93,9 +197,131 @@ std::shared_ptr<level> level::load(std::string const &filename) {
   return std::make_shared<level>(std::move(map), w, h);
 }
 
-void level::save(std::string filename) const {
-  std::ofstream outfile(filename);
+std::shared_ptr<level> level::load_binary_(std::string const &filename) {
+  auto mapping = mapped_file::open(filename);
+  if( !mapping ) {
+    crash();
+  }
+
+  track_header header;
+  if( mapping->size() < sizeof(header) ) {
+    std::cerr << filename << " is too short to be a track" << std::endl;
+    crash();
+  }
+  std::memcpy(&header, mapping->data(), sizeof(header));
+  if( header.version != track_version ) {
+    std::cerr << filename << " is version " << header.version << " of the track format, not "
+              << track_version << "; convert it again" << std::endl;
+    crash();
+  }
+  if( header.byte_order != track_byte_order ) {
+    std::cerr << filename << " was written on a machine of a different byte order; convert it again"
+              << std::endl;
+    crash();
+  }
+  if( header.header_checksum != header_checksum(header) ||
+      header.width == 0 || header.height == 0 ||
+      header.width > max_track_side || header.height > max_track_side ) {
+    std::cerr << filename << " has a corrupt header" << std::endl;
+    crash();
+  }
+  if( header.chunk_size != chunk_size ) {
+    std::cerr << filename << " was written by a different build; convert it again" << std::endl;
+    crash();
+  }
 
+  /* Only the chunk table is read. The chunks' cells are used where
+     they are, so only the parts of the track that are looked at are
+     ever read from the file. */
+  std::shared_ptr<level> lvl(new level(header.width, header.height));
+  std::size_t const table_size = lvl->chunks_.size() * sizeof(track_chunk);
+  if( mapping->size() < sizeof(header) + table_size ) {
+    std::cerr << filename << " is too short for a " << header.width << "x" << header.height
+              << " track" << std::endl;
+    crash();
+  }
+  unsigned char const * const table = mapping->data() + sizeof(header);
+  for( std::size_t k=0; k<lvl->chunks_.size(); ++k ) {
+    track_chunk entry;
+    std::memcpy(&entry, table + k*sizeof(entry), sizeof(entry));
+    chunk & c = lvl->chunks_[k];
+    c.fill = static_cast<unsigned short>(entry.fill);
+    if( entry.offset == 0 ) {
+      continue;
+    }
+    if( entry.offset < sizeof(header) + table_size || entry.offset % alignof(unsigned short) != 0 ||
+        entry.offset > mapping->size() || mapping->size() - entry.offset < chunk_bytes ) {
+      std::cerr << filename << " has a corrupt chunk table" << std::endl;
+      crash();
+    }
+    c.cells = reinterpret_cast<unsigned short *>(mapping->data() + entry.offset);
+  }
+  lvl->mapping_ = std::move(mapping);
+  lvl->checksum_ = header.checksum;
+  return lvl;
+}
+
+std::shared_ptr<level> level::clone() const {
+  std::shared_ptr<level> copy(new level(w_, h_));
+  for( std::size_t k=0; k<chunks_.size(); ++k ) {
+    chunk const & from = chunks_[k];
+    chunk & to = copy->chunks_[k];
+    to.fill = from.fill;
+    to.revision = from.revision;
+    if( from.cells ) {
+      to.owned.reset(new unsigned short[chunk_size*chunk_size]);
+      std::copy(from.cells, from.cells + chunk_size*chunk_size, to.owned.get());
+      to.cells = to.owned.get();
+    }
+    if( from.distances ) {
+      to.distances.reset(new field(*from.distances));
+      to.last_used = from.last_used;
+    }
+    for( unsigned t=0; t<segments; ++t ) {
+      if( from.routes[t] ) {
+        to.routes[t].reset(new flow(*from.routes[t]));
+      }
+    }
+  }
+  std::copy(flow_built_, flow_built_ + segments, copy->flow_built_);
+  copy->flow_build_time_ = flow_build_time_;
+  copy->steering_layer_ = steering_layer_;
+  copy->resident_fields_ = resident_fields_;
+  copy->field_clock_ = field_clock_;
+  copy->checksum_ = checksum_;
+  return copy;
+}
+
+/* A level may be reading its cells from a mapping of the very file
+   it's saving to, so the new one is written alongside and renamed
+   over it; the mapping keeps the old one until it goes */
+template<typename F>
+static bool write_replacing(std::string const & filename, std::ios::openmode mode, F && write) {
+  std::string const temporary = filename + ".tmp";
+  {
+    std::ofstream outfile(temporary, mode);
+    write(outfile);
+    if( !outfile.flush() ) {
+      std::cerr << "Couldn't write " << temporary << std::endl;
+      std::remove(temporary.c_str());
+      return false;
+    }
+  }
+  if( std::rename(temporary.c_str(), filename.c_str()) != 0 ) {
+    std::cerr << "Couldn't replace " << filename << ": " << std::strerror(errno) << std::endl;
+    std::remove(temporary.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool level::save(std::string const & filename) const {
+  return write_replacing(filename, std::ios::out, [this](std::ostream & outfile) {
+    save_text_(outfile);
+  });
+}
+
+void level::save_text_(std::ostream & outfile) const {
   outfile << w_ << " " << h_ << '\n';
 
   for( unsigned k=0; k<4; ++k) {
@@ -110,44 +336,333 @@ void level::save(std::string filename) const {
   }
 }
 
-void level::draw() const {
-  unsigned const points = 50;
+bool level::save_binary(std::string const & filename) const {
+  track_header header;
+  std::copy(track_magic, track_magic + sizeof(track_magic), header.magic);
+  header.version = track_version;
+  header.byte_order = track_byte_order;
+  header.width = w_;
+  header.height = h_;
+  header.chunk_size = chunk_size;
+  header.checksum = checksum();
+  header.header_checksum = header_checksum(header);
 
-  double const radius = obstacle_radius;
+  std::vector<track_chunk> table(chunks_.size());
+  std::uint64_t offset = sizeof(header) + table.size() * sizeof(track_chunk);
+  for( std::size_t k=0; k<chunks_.size(); ++k ) {
+    table[k].offset = chunks_[k].cells ? offset : 0;
+    table[k].fill = chunks_[k].fill;
+    table[k].reserved = 0;
+    offset += chunks_[k].cells ? chunk_bytes : 0;
+  }
 
-  for( unsigned i=0; i<w_; ++i ) {
+  return write_replacing(filename, std::ios::out | std::ios::binary, [&](std::ostream & outfile) {
+    outfile.write(reinterpret_cast<char const *>(&header), sizeof(header));
+    outfile.write(reinterpret_cast<char const *>(table.data()), table.size() * sizeof(track_chunk));
+    for( chunk const & c: chunks_ ) {
+      if( c.cells ) {
+        outfile.write(reinterpret_cast<char const *>(c.cells), chunk_bytes);
+      }
+    }
+  });
+}
+
+std::uint32_t level::checksum() const {
+  /* As if the track were one dense grid, row by row */
+  if( !checksum_ ) {
+    ::checksum sum;
+    sum.add(w_);
+    sum.add(h_);
     for( unsigned j=0; j<h_; ++j ) {
-      if( blocker_at(i, j) ) {
-        double const cell_x = i + 0.5;
-        double const cell_y = j + 0.5;
+      for( unsigned i=0; i<w_; ++i ) {
+        sum.add(readmap_(i, j));
+      }
+    }
+    checksum_ = sum.value();
+  }
+  return *checksum_;
+}
+
+void level::writemap_(unsigned x, unsigned y, unsigned short value) {
+  x = x < w_ ? x : (w_-1);
+  y = y < h_ ? y : (h_-1);
+  chunk & c = chunks_[(y / chunk_size)*chunks_w_ + x / chunk_size];
+  if( !c.cells ) {
+    if( value == c.fill ) {
+      return;
+    }
+    c.owned.reset(new unsigned short[chunk_size*chunk_size]);
+    std::fill(c.owned.get(), c.owned.get() + chunk_size*chunk_size, c.fill);
+    c.cells = c.owned.get();
+  }
+  c.cells[(y % chunk_size)*chunk_size + x % chunk_size] = value;
+  ++c.revision;
+}
+
+std::optional<circle> level::get_intersecting_shape(circle const &target, sim_real tolerance) const {
+  /* The distance field can rule out most queries without looking at
+     any cells; allow for its interpolation error. */
+  double const field_error = 1.5 / field_resolution;
+  if( distance_at(vec2(target.center())) > target.radius() + field_error ) {
+    return std::nullopt;
+  }
 
-        glColor3d(1.0, 1.0, 1.0);
+  /* Only cells whose obstacle could reach the target's bounding box
+     need checking */
+  double const reach = static_cast<double>(target.radius() + obstacle_radius);
+  vec2 const center(target.center());
+  double const min_x = std::max(0.0, std::floor(center.x() - reach));
+  double const min_y = std::max(0.0, std::floor(center.y() - reach));
+  double const max_x = std::min(static_cast<double>(w_), std::ceil(center.x() + reach));
+  double const max_y = std::min(static_cast<double>(h_), std::ceil(center.y() + reach));
 
-        glBegin(GL_POLYGON);
-        circle_vertices(cell_x, cell_y, radius, points);
-        glEnd();
+  for( unsigned i=static_cast<unsigned>(min_x); i<max_x; ++i ) {
+    for( unsigned j=static_cast<unsigned>(min_y); j<max_y; ++j ) {
+      if( blocker_at(i, j) ) {
+        sim_real const cell_x = i + sim_real(0.5);
+        sim_real const cell_y = j + sim_real(0.5);
 
-        glBegin(GL_LINE_LOOP);
-        circle_vertices(cell_x, cell_y, radius, points);
-        glEnd();
+        circle const obstacle(sim_vec2(cell_x, cell_y), obstacle_radius);
+        if( target.intersects(obstacle, tolerance) ) {
+          return obstacle;
+        }
       }
     }
   }
+  return std::nullopt;
 }
 
-std::optional<circle> level::get_intersecting_shape(circle const &target) const {
-  for( unsigned i=0; i<w_; ++i ) {
-    for( unsigned j=0; j<h_; ++j ) {
+std::optional<sim_real> level::time_of_impact(circle const &shape, sim_vec2 const &motion) const {
+  /* Only cells whose obstacle could reach the box swept out by the
+     shape need checking */
+  double const reach = static_cast<double>(shape.radius() + obstacle_radius);
+  vec2 const start(shape.center());
+  vec2 const end = start + vec2(motion);
+  double const min_x = std::max(0.0, std::floor(std::min(start.x(), end.x()) - reach));
+  double const min_y = std::max(0.0, std::floor(std::min(start.y(), end.y()) - reach));
+  double const max_x = std::min(static_cast<double>(w_), std::ceil(std::max(start.x(), end.x()) + reach));
+  double const max_y = std::min(static_cast<double>(h_), std::ceil(std::max(start.y(), end.y()) + reach));
+
+  std::optional<sim_real> first;
+  for( unsigned i=static_cast<unsigned>(min_x); i<max_x; ++i ) {
+    for( unsigned j=static_cast<unsigned>(min_y); j<max_y; ++j ) {
       if( blocker_at(i, j) ) {
-        double const cell_x = i + 0.5;
-        double const cell_y = j + 0.5;
+        circle const obstacle(sim_vec2(i + sim_real(0.5), j + sim_real(0.5)), obstacle_radius);
+        auto const t = shape.time_of_impact(motion, obstacle);
+        if( t && (!first || *t < *first) ) {
+          first = t;
+        }
+      }
+    }
+  }
+  return first;
+}
 
-        circle const obstacle(vec2(cell_x, cell_y), obstacle_radius);
-        if( target.intersects(obstacle) ) {
-          return obstacle;
+/* One dimensional squared Euclidean distance transform, after
+   Felzenszwalb and Huttenlocher. f holds n samples of the input,
+   stride apart, and is overwritten by the result; the index of the
+   input sample each result came from is written to nearest, with
+   the same stride. */
+static void distance_transform_1d(float *f, unsigned *nearest, unsigned n, unsigned stride,
+                                  std::vector<double> &values,
+                                  std::vector<unsigned> &hull,
+                                  std::vector<double> &bounds) {
+  double const inf = std::numeric_limits<double>::infinity();
+
+  values.resize(n);
+  hull.resize(n);
+  bounds.resize(n + 1);
+  for( unsigned q=0; q<n; ++q ) {
+    values[q] = f[q*stride];
+  }
+
+  unsigned k = 0;
+  hull[0] = 0;
+  bounds[0] = -inf;
+  bounds[1] = inf;
+  for( unsigned q=1; q<n; ++q ) {
+    if( values[q] == inf ) {
+      continue;
+    }
+    for( ;; ) {
+      unsigned const p = hull[k];
+      double const s = ((values[q] + q*q) - (values[p] + p*p)) / (2.0*q - 2.0*p);
+      if( values[p] == inf || s <= bounds[k] ) {
+        if( k == 0 ) {
+          hull[0] = q;
+          bounds[1] = inf;
+          break;
         }
+        --k;
+        continue;
       }
+      ++k;
+      hull[k] = q;
+      bounds[k] = s;
+      bounds[k+1] = inf;
+      break;
     }
   }
-  return std::nullopt;
+
+  k = 0;
+  for( unsigned q=0; q<n; ++q ) {
+    while( bounds[k+1] < q ) {
+      ++k;
+    }
+    unsigned const p = hull[k];
+    double const d = static_cast<double>(q) - p;
+    f[q*stride] = static_cast<float>(values[p] == inf ? inf : d*d + values[p]);
+    nearest[q*stride] = p;
+  }
+}
+
+level::field const & level::fetch_field_(std::size_t index) const {
+  /* Only fetches count as uses, so a chunk queried over and over in a
+     row counts once, but that's enough to keep it from being the
+     oldest */
+  chunk & c = chunks_[index];
+  c.last_used = ++field_clock_;
+  last_field_chunk_ = index;
+  if( c.distances ) {
+    return *c.distances;
+  }
+
+  /* Make room by dropping whichever field has gone unused longest */
+  if( resident_fields_ >= max_fields ) {
+    chunk * oldest = nullptr;
+    for( chunk & other: chunks_ ) {
+      if( other.distances && (!oldest || other.last_used < oldest->last_used) ) {
+        oldest = &other;
+      }
+    }
+    oldest->distances.reset();
+    --resident_fields_;
+  }
+
+  c.distances.reset(new field);
+  build_field_(static_cast<unsigned>(index % chunks_w_), static_cast<unsigned>(index / chunks_w_), *c.distances);
+  ++resident_fields_;
+  return *c.distances;
+}
+
+void level::drop_fields_near_(unsigned x, unsigned y) {
+  /* Every chunk whose field could have seen an obstacle here */
+  unsigned const min_cx = (x < field_margin ? 0 : x - field_margin) / chunk_size;
+  unsigned const min_cy = (y < field_margin ? 0 : y - field_margin) / chunk_size;
+  unsigned const max_cx = std::min((x + field_margin) / chunk_size, chunks_w_ - 1);
+  unsigned const max_cy = std::min((y + field_margin) / chunk_size, chunks_h_ - 1);
+  for( unsigned cy=min_cy; cy<=max_cy; ++cy ) {
+    for( unsigned cx=min_cx; cx<=max_cx; ++cx ) {
+      chunk & c = chunks_[cy*chunks_w_ + cx];
+      if( c.distances ) {
+        c.distances.reset();
+        --resident_fields_;
+      }
+      if( cy*chunks_w_ + cx == last_field_chunk_ ) {
+        last_field_chunk_ = ~std::size_t(0);
+      }
+    }
+  }
+}
+
+void level::build_field_(unsigned cx, unsigned cy, field & out) const {
+  unsigned const res = field_resolution;
+
+  /* Obstacles are all the same size, so the nearest obstacle edge
+     belongs to the nearest obstacle centre. Centres fall exactly on
+     samples, so an exact distance transform of the centres gives us
+     the whole field. Any centre within field_margin cells of a
+     sample in the chunk lies within field_margin cells of the chunk,
+     so transforming just that much of the track gets every distance
+     up to field_margin exactly. */
+  int const x0 = static_cast<int>(cx*chunk_size) - static_cast<int>(field_margin);
+  int const y0 = static_cast<int>(cy*chunk_size) - static_cast<int>(field_margin);
+  unsigned const cells = chunk_size + 2*field_margin;
+  unsigned const n = cells*res + 1;
+  float const inf = std::numeric_limits<float>::infinity();
+  std::vector<float> sq(n*n, inf);
+  for( unsigned j=0; j<cells; ++j ) {
+    for( unsigned i=0; i<cells; ++i ) {
+      int const x = x0 + static_cast<int>(i);
+      int const y = y0 + static_cast<int>(j);
+      if( x >= 0 && y >= 0 && static_cast<unsigned>(x) < w_ && static_cast<unsigned>(y) < h_ &&
+          blocker_at(static_cast<unsigned>(x), static_cast<unsigned>(y)) ) {
+        sq[(j*res + res/2)*n + i*res + res/2] = 0;
+      }
+    }
+  }
+
+  /* Transform the rows and then the columns, remembering where the
+     nearest centre was found at each stage */
+  std::vector<unsigned> nearest_x(sq.size());
+  std::vector<unsigned> nearest_y(sq.size());
+  std::vector<double> values;
+  std::vector<unsigned> hull;
+  std::vector<double> bounds;
+  for( unsigned j=0; j<n; ++j ) {
+    distance_transform_1d(&sq[j*n], &nearest_x[j*n], n, 1, values, hull, bounds);
+  }
+  for( unsigned i=0; i<n; ++i ) {
+    distance_transform_1d(&sq[i], &nearest_y[i], n, n, values, hull, bounds);
+  }
+
+  /* Keep the chunk's own samples. Anything further than the margin
+     might be nearer something outside it, so is only known to be at
+     least that far; the gradient points straight away from the
+     nearest centre, where that's known. */
+  double const reach = static_cast<double>(field_margin);
+  unsigned const border = field_margin*res;
+  for( unsigned j=0; j<field_side; ++j ) {
+    for( unsigned i=0; i<field_side; ++i ) {
+      std::size_t const k = (j + border)*n + i + border;
+      double const d = sq[k] == inf ? reach : std::min(static_cast<double>(std::sqrt(sq[k]) / res), reach);
+      vec2 g = vec2::zero();
+      if( d < reach ) {
+        unsigned const ny = nearest_y[k];
+        unsigned const nx = nearest_x[ny*n + i + border];
+        g = vec2(static_cast<double>(i + border) - nx, static_cast<double>(j + border) - ny)
+          .safe_normalized(vec2::zero());
+      }
+      std::size_t const out_k = j*field_side + i;
+      out.distance[out_k] = static_cast<float>(d - static_cast<double>(obstacle_radius));
+      out.gradient_x[out_k] = static_cast<float>(g.x());
+      out.gradient_y[out_k] = static_cast<float>(g.y());
+    }
+  }
+}
+
+/* Find the chunk whose field holds the four samples around pos, and
+   their indices in it and bilinear weights */
+template<typename F>
+void level::sample_field_(vec2 const & pos, F && fn) const {
+  double const fx = std::min(std::max(pos.x() * field_resolution, 0.0), static_cast<double>(w_*field_resolution));
+  double const fy = std::min(std::max(pos.y() * field_resolution, 0.0), static_cast<double>(h_*field_resolution));
+  unsigned const x0 = std::min(static_cast<unsigned>(fx), w_*field_resolution - 1);
+  unsigned const y0 = std::min(static_cast<unsigned>(fy), h_*field_resolution - 1);
+  double const tx = fx - x0;
+  double const ty = fy - y0;
+  unsigned const span = chunk_size*field_resolution;
+  field const & f = field_for_(x0 / span, y0 / span);
+  std::size_t const k = (y0 % span)*field_side + x0 % span;
+  fn(f, k, k + 1, k + field_side, k + field_side + 1,
+     (1-tx)*(1-ty), tx*(1-ty), (1-tx)*ty, tx*ty);
+}
+
+double level::distance_at(vec2 const & pos) const {
+  double res = 0;
+  sample_field_(pos, [&](field const & f, std::size_t a, std::size_t b, std::size_t c, std::size_t d,
+                         double wa, double wb, double wc, double wd) {
+    res = f.distance[a]*wa + f.distance[b]*wb + f.distance[c]*wc + f.distance[d]*wd;
+  });
+  return res;
+}
+
+vec2 level::distance_gradient_at(vec2 const & pos) const {
+  vec2 res = vec2::zero();
+  sample_field_(pos, [&](field const & f, std::size_t a, std::size_t b, std::size_t c, std::size_t d,
+                         double wa, double wb, double wc, double wd) {
+    res = vec2(f.gradient_x[a]*wa + f.gradient_x[b]*wb + f.gradient_x[c]*wc + f.gradient_x[d]*wd,
+               f.gradient_y[a]*wa + f.gradient_y[b]*wb + f.gradient_y[c]*wc + f.gradient_y[d]*wd);
+  });
+  return res;
 }
@@ -6,19 +6,73 @@
 #pragma once
 
 #include "circle.h"
+#include "mapped_file.h"
 
 #include <cmath>
+#include <cstdint>
 #include <iostream>
 #include <optional>
 #include <memory>
+#include <vector>
+
+class draw_batch;
 
 /// A track or level. It's here to demonstrate loading resources
 /// yourself from the unpacked bundle, and because a racing game needs
 /// a track!
+///
+/// The track is kept in square chunks of chunk_size cells. A chunk
+/// whose cells are all the same, like the open ground or solid wall
+/// that makes up most of a long circuit, is kept as just that value.
+/// The distance field that speeds up collisions is only built for a
+/// chunk once something comes near it, and the least recently used
+/// are dropped again once there are more than max_fields of them, so
+/// tracks can be far bigger than a dense grid would allow.
+///
+/// Tracks are written as text, four layers of hex digits, but can be
+/// converted to a binary format (see save_binary()) holding the
+/// chunks as they are kept in memory, so that it can be mapped and
+/// used where it is. Loading that takes next to no time whatever the
+/// size of the track, and only the chunks the race visits are ever
+/// read from it.
+///
+/// The AI can find its way round a track from the segment layer
+/// alone, following flow fields that point every cell along the
+/// quickest way to the next segment, so the steering layer only needs
+/// painting by hand where it's wanted. It takes its speed from the
+/// speed layer wherever that's painted, so that can still be tuned.
+/// There's a field for each segment, covering the cells of the
+/// segment before it and any cells that aren't part of the lap at
+/// all, built the first time it's asked for.
+///
+/// Even the const members may build distance or flow fields, so a
+/// level must only be used from one thread at a time; clone() it for
+/// others.
 class level {
 public:
+  static constexpr unsigned chunk_size = 32;
+  static constexpr std::size_t max_fields = 256;
+  /// Obstacles are circles this big in the middle of their cells
+  static constexpr sim_real obstacle_radius = sim_real(0.75/2);
+  /// Segments count up from 0 to segments - 1 and back round to 0
+  static constexpr unsigned segments = 0xE;
+
+  /// The segment that scores after s
+  static unsigned next_segment(unsigned s) {
+    return (s + 1) % segments;
+  }
+
+  /// Load a track in either format, telling them apart by the first
+  /// few bytes. Crashes if it can't.
   static std::shared_ptr<level> load(std::string const & filename);
 
+  level(level const &) = delete;
+  level& operator=(level const &) = delete;
+
+  /// A completely independent copy of this level, which can be
+  /// modified or used from another thread without affecting this one.
+  std::shared_ptr<level> clone() const;
+
   unsigned width() const {
     return w_;
   }
@@ -35,18 +89,18 @@ public:
     return get_raw(3, x, y) == 2;
   }
 
-  float steer_angle_at(unsigned x, unsigned  y) {
+  float steer_angle_at(unsigned x, unsigned  y) const {
     unsigned const steps = get_raw(0, x, y);
     int const s = static_cast<int>((steps & 0x7) - (steps & 0x8));
     return s * M_PI / 8;
   }
 
-  unsigned speed_at(unsigned x, unsigned y) {
+  unsigned speed_at(unsigned x, unsigned y) const {
     unsigned const value = get_raw(1, x, y);
     return value;
   }
 
-  unsigned segment_at(unsigned x, unsigned y) {
+  unsigned segment_at(unsigned x, unsigned y) const {
     return static_cast<unsigned char>(get_raw(2, x, y));
   }
 
@@ -60,35 +114,198 @@ public:
     unsigned short const replace = (value & 0xF) << (4*layer);
     unsigned short const newv = masked | replace;
 
+    if( newv == old ) {
+      return;
+    }
     writemap_(x, y, newv);
+    checksum_.reset();
+    if( layer == 3 ) {
+      drop_fields_near_(x, y);
+    }
+    if( layer == 2 || layer == 3 ) {
+      drop_flow_near_(x, y, old);
+    }
+    if( layer == 0 ) {
+      steering_layer_.reset();
+    }
   }
 
-  level(std::unique_ptr<unsigned short[]>&& map, unsigned w, unsigned h)
-    : map_(std::move(map)), w_(w), h_(h)
-  {}
+  level(std::unique_ptr<unsigned short[]>&& map, unsigned w, unsigned h);
+
+  /// Save as text. Returns false, after saying why, if it can't be
+  /// written. Saving over the file the level was loaded from is fine.
+  bool save(std::string const & filename) const;
+
+  /// Save in the binary format, in the same way
+  bool save_binary(std::string const & filename) const;
 
-  void save(std::string filename) const;
+  /// A hash of the whole track, to check that two copies match. A
+  /// binary track carries its own, which is trusted rather than
+  /// worked out again on loading.
+  std::uint32_t checksum() const;
 
-  void draw() const;
+  void draw(draw_batch & batch) const;
 
-  std::optional<circle> get_intersecting_shape(circle const &target) const;
+  /// Draw just the cells of chunk cx, cy
+  void draw_chunk(draw_batch & batch, unsigned cx, unsigned cy) const;
+
+  unsigned chunks_wide() const {
+    return chunks_w_;
+  }
+
+  unsigned chunks_high() const {
+    return chunks_h_;
+  }
+
+  /// Goes up whenever a cell of chunk cx, cy changes, so that
+  /// anything made from its cells can tell when to make it again
+  unsigned long chunk_revision(unsigned cx, unsigned cy) const {
+    return chunks_[cy*chunks_w_ + cx].revision;
+  }
+
+  /// An obstacle that target overlaps by more than tolerance, if there
+  /// is one.
+  std::optional<circle> get_intersecting_shape(circle const &target, sim_real tolerance) const;
+
+  /// If shape moves by motion, the fraction of the way along it that
+  /// it first touches an obstacle, or nothing if it gets all the way.
+  /// Obstacles that shape already overlaps are ignored.
+  std::optional<sim_real> time_of_impact(circle const &shape, sim_vec2 const &motion) const;
+
+  /// The signed distance from pos to the edge of the nearest
+  /// obstacle, negative inside one. This is interpolated from a field
+  /// sampled on demand, so it's cheap but only accurate to around a
+  /// tenth of a cell. It only looks a few cells out: anything further
+  /// away than that is reported as being just that far.
+  double distance_at(vec2 const & pos) const;
+
+  /// The direction in which distance_at increases fastest, ie away
+  /// from the nearest obstacle. Its length is around 1, but may be
+  /// shorter deep inside an obstacle or midway between two, and it's
+  /// zero where nothing is near enough for distance_at to see.
+  vec2 distance_gradient_at(vec2 const & pos) const;
+
+  /// How many chunks have their distance field built, for reporting
+  std::size_t resident_fields() const {
+    return resident_fields_;
+  }
+
+  /// Whether the steering layer has been painted at all. The speed
+  /// layer doesn't count, since the flow fields use it too.
+  bool has_steering_layer() const;
+
+  /// The direction to drive from pos to reach segment target soonest,
+  /// interpolated from the cells around it, or zero if target can't be
+  /// reached from there. It's not normalised.
+  sim_vec2 flow_direction_at(sim_vec2 const & pos, unsigned target) const;
+
+  /// How far pos is from segment target, in cells, the long way round
+  /// any obstacles, or nothing if it can't be reached
+  std::optional<sim_real> flow_distance_at(sim_vec2 const & pos, unsigned target) const;
+
+  /// How long the flow fields built so far took, in seconds
+  double flow_build_time() const {
+    return flow_build_time_;
+  }
 
 private:
-  static constexpr double obstacle_radius = 0.75/2;
+  static constexpr unsigned field_resolution = 4; // samples per cell
+  /// How far, in cells, past its edges a chunk's field looks for
+  /// obstacles
+  static constexpr unsigned field_margin = 8;
+  static constexpr unsigned field_side = chunk_size*field_resolution + 1;
+
+  /// A chunk's distance field and its gradient, sampled on a grid
+  /// field_resolution times finer than the map, including both edges
+  struct field {
+    float distance[field_side*field_side];
+    float gradient_x[field_side*field_side];
+    float gradient_y[field_side*field_side];
+  };
+
+  /// Per cell, the direction to the neighbour on the quickest way to
+  /// the next segment, and the distance to go, or -1 if there's no way.
+  /// While building, also the extra cost of driving into each cell.
+  struct flow {
+    float direction_x[chunk_size*chunk_size];
+    float direction_y[chunk_size*chunk_size];
+    float distance[chunk_size*chunk_size];
+    unsigned char wall_cost[chunk_size*chunk_size];
+  };
+
+  struct chunk {
+    /// chunk_size rows of chunk_size cells, or null if every cell is
+    /// fill. Either owned, or in mapping_.
+    unsigned short * cells = nullptr;
+    std::unique_ptr<unsigned short[]> owned;
+    unsigned short fill = 0;
+    unsigned long revision = 0;
+    /// Built when first needed
+    std::unique_ptr<field> distances;
+    unsigned long last_used = 0;
+    /// Towards each segment, for the chunks that field reaches
+    std::unique_ptr<flow> routes[segments];
+  };
+
+  level(unsigned w, unsigned h);
+
+  static std::shared_ptr<level> load_text_(std::string const & filename);
+  static std::shared_ptr<level> load_binary_(std::string const & filename);
+
+  chunk const & chunk_at_(unsigned x, unsigned y) const {
+    return chunks_[(y / chunk_size)*chunks_w_ + x / chunk_size];
+  }
 
   unsigned short readmap_(unsigned x, unsigned y) const {
     x = x < w_ ? x : (w_-1);
     y = y < h_ ? y : (h_-1);
-    return map_[y*w_ + x];
+    chunk const & c = chunk_at_(x, y);
+    return c.cells ? c.cells[(y % chunk_size)*chunk_size + x % chunk_size] : c.fill;
   }
 
-  void writemap_(unsigned x, unsigned y, unsigned short value) const {
-    x = x < w_ ? x : (w_-1);
-    y = y < h_ ? y : (h_-1);
-    map_[y*w_ + x] = value;
+  void writemap_(unsigned x, unsigned y, unsigned short value);
+  void save_text_(std::ostream & outfile) const;
+
+  /// The field of chunk cx, cy, building it if need be
+  field const & field_for_(unsigned cx, unsigned cy) const {
+    std::size_t const index = cy*chunks_w_ + cx;
+    if( index != last_field_chunk_ ) {
+      return fetch_field_(index);
+    }
+    return *chunks_[index].distances;
   }
+  field const & fetch_field_(std::size_t index) const;
+  void build_field_(unsigned cx, unsigned cy, field & out) const;
+  void drop_fields_near_(unsigned x, unsigned y);
+
+  template<typename F>
+  void sample_field_(vec2 const & pos, F && fn) const;
+
+  void build_flow_(unsigned target) const;
+  void drop_flow_(unsigned target);
+  /// Drop the flow fields that could be changed by the cell at x, y,
+  /// which was old before it last changed
+  void drop_flow_near_(unsigned x, unsigned y, unsigned short old);
+  /// Call fn(flow, index, weight) for the cells around pos that the
+  /// flow field towards target reaches
+  template<typename F>
+  void sample_flow_(sim_vec2 const & pos, unsigned target, F && fn) const;
 
-  std::unique_ptr<unsigned short[]> map_;
   unsigned w_;
   unsigned h_;
+  unsigned chunks_w_;
+  unsigned chunks_h_;
+  /* Built fields live in the chunks, which the const queries fill in
+     as they go */
+  mutable std::vector<chunk> chunks_;
+  mutable std::size_t resident_fields_;
+  mutable unsigned long field_clock_;
+  /* Cars mostly stay in one chunk from one query to the next, so the
+     last field fetched is remembered. Any other index means none. */
+  mutable std::size_t last_field_chunk_;
+  mutable bool flow_built_[segments];
+  mutable double flow_build_time_;
+  mutable std::optional<bool> steering_layer_;
+  std::unique_ptr<mapped_file> mapping_;
+  mutable std::optional<std::uint32_t> checksum_;
 };
@@ -0,0 +1,43 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#include "level.h"
+
+#include "draw_batch.h"
+
+#include <algorithm>
+
+void level::draw(draw_batch & batch) const {
+  for( unsigned cy=0; cy<chunks_h_; ++cy ) {
+    for( unsigned cx=0; cx<chunks_w_; ++cx ) {
+      draw_chunk(batch, cx, cy);
+    }
+  }
+}
+
+void level::draw_chunk(draw_batch & batch, unsigned cx, unsigned cy) const {
+  unsigned const points = 50;
+
+  double const radius = static_cast<double>(obstacle_radius);
+
+  chunk const & c = chunks_[cy*chunks_w_ + cx];
+  if( !c.cells && (c.fill >> 12) != 1 ) {
+    return;
+  }
+
+  unsigned const x1 = std::min(w_, (cx + 1)*chunk_size);
+  unsigned const y1 = std::min(h_, (cy + 1)*chunk_size);
+  for( unsigned i=cx*chunk_size; i<x1; ++i ) {
+    for( unsigned j=cy*chunk_size; j<y1; ++j ) {
+      if( blocker_at(i, j) ) {
+        vec2 const cell(i + 0.5, j + 0.5);
+
+        batch.set_color({ 1.0f, 1.0f, 1.0f, 1.0f });
+        batch.circle(cell, radius, points);
+        batch.circle_outline(cell, radius, points);
+      }
+    }
+  }
+}
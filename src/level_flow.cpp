@@ -0,0 +1,351 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#include "level.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+/* Moves cost 5 straight and 7 diagonally, close enough to 1 and the
+   square root of 2 to find the same ways round, but whole numbers, so
+   that the search can keep its queue in buckets rather than a heap
+   and run in time proportional to the size of the track. Cells next
+   to an obstacle cost extra to enter, to keep the cars off the walls
+   where there's room. */
+static unsigned const straight_cost = 5;
+static unsigned const diagonal_cost = 7;
+static unsigned const wall_cost = 5;
+static unsigned const max_move_cost = diagonal_cost + wall_cost;
+
+/* The eight neighbours of a cell, straight ones first, each followed
+   by its opposite so that k ^ 1 is the way back */
+static int const neighbour_x[8] = { 1, -1, 0, 0, 1, -1, 1, -1 };
+static int const neighbour_y[8] = { 0, 0, 1, -1, 1, -1, -1, 1 };
+
+bool level::has_steering_layer() const {
+  if( !steering_layer_ ) {
+    steering_layer_ = false;
+    for( chunk const & c: chunks_ ) {
+      unsigned short const painted = 0x000F;
+      if( c.cells ? std::any_of(c.cells, c.cells + chunk_size*chunk_size,
+                                [&](unsigned short v) { return (v & painted) != 0; })
+                  : (c.fill & painted) != 0 ) {
+        steering_layer_ = true;
+        break;
+      }
+    }
+  }
+  return *steering_layer_;
+}
+
+void level::drop_flow_(unsigned target) {
+  if( !flow_built_[target] ) {
+    return;
+  }
+  for( chunk & c: chunks_ ) {
+    c.routes[target].reset();
+  }
+  flow_built_[target] = false;
+}
+
+void level::drop_flow_near_(unsigned x, unsigned y, unsigned short old) {
+  /* A cell only matters to the fields that cover it or its
+     neighbours, whose wall costs and corners it decides, and to those
+     heading into its segment or theirs. Cells off the lap are covered
+     by every field. */
+  bool drop[segments] = {};
+  auto const note = [&](unsigned segment) {
+    if( segment >= segments ) {
+      std::fill(drop, drop + segments, true);
+    } else {
+      drop[segment] = true;
+      drop[next_segment(segment)] = true;
+    }
+  };
+  note((old >> 8) & 0xF);
+  for( unsigned j=(y > 0 ? y - 1 : 0); j<=std::min(y + 1, h_ - 1); ++j ) {
+    for( unsigned i=(x > 0 ? x - 1 : 0); i<=std::min(x + 1, w_ - 1); ++i ) {
+      note(segment_at(i, j));
+    }
+  }
+  for( unsigned t=0; t<segments; ++t ) {
+    if( drop[t] ) {
+      drop_flow_(t);
+    }
+  }
+}
+
+void level::build_flow_(unsigned target) const {
+  auto const start = std::chrono::steady_clock::now();
+  flow_built_[target] = true;
+
+  auto const cell = [](unsigned x, unsigned y) {
+    return (y % chunk_size)*chunk_size + x % chunk_size;
+  };
+  auto const open = [&](int x, int y) {
+    return x >= 0 && y >= 0 && static_cast<unsigned>(x) < w_ && static_cast<unsigned>(y) < h_ &&
+      !blocker_at(static_cast<unsigned>(x), static_cast<unsigned>(y));
+  };
+  /* The field covers the segment before target, and the cells that
+     aren't part of the lap, which may be on the way in to any segment */
+  auto const covers = [&](unsigned x, unsigned y) {
+    unsigned const segment = segment_at(x, y);
+    return segment >= segments || next_segment(segment) == target;
+  };
+  /* Chunks only get a route once the search reaches them, and that's
+     when their cells' wall costs are worked out */
+  auto const route = [&](unsigned x, unsigned y) -> flow & {
+    chunk & c = chunks_[(y / chunk_size)*chunks_w_ + x / chunk_size];
+    std::unique_ptr<flow> & r = c.routes[target];
+    if( !r ) {
+      r.reset(new flow);
+      flow & f = *r;
+      std::fill(f.distance, f.distance + chunk_size*chunk_size, -1.0f);
+      std::fill(f.direction_x, f.direction_x + chunk_size*chunk_size, 0.0f);
+      std::fill(f.direction_y, f.direction_y + chunk_size*chunk_size, 0.0f);
+      unsigned const x0 = x / chunk_size * chunk_size;
+      unsigned const y0 = y / chunk_size * chunk_size;
+      for( unsigned j=0; j<chunk_size; ++j ) {
+        for( unsigned i=0; i<chunk_size; ++i ) {
+          int const cx = static_cast<int>(x0 + i);
+          int const cy = static_cast<int>(y0 + j);
+          bool near = false;
+          for( unsigned n=0; n<8 && !near; ++n ) {
+            int const wx = cx + neighbour_x[n];
+            int const wy = cy + neighbour_y[n];
+            near = wx >= 0 && wy >= 0 && static_cast<unsigned>(wx) < w_ && static_cast<unsigned>(wy) < h_ &&
+              blocker_at(static_cast<unsigned>(wx), static_cast<unsigned>(wy));
+          }
+          f.wall_cost[j*chunk_size + i] = near ? wall_cost : 0;
+        }
+      }
+    }
+    return *r;
+  };
+  /* The cost of moving from x, y in direction k, or 0 if it can't:
+     diagonal moves mustn't cut the corner of an obstacle */
+  auto const move_cost = [&](unsigned x, unsigned y, unsigned k) -> unsigned {
+    int const nx = static_cast<int>(x) + neighbour_x[k];
+    int const ny = static_cast<int>(y) + neighbour_y[k];
+    if( !open(nx, ny) ) {
+      return 0;
+    }
+    unsigned cost = straight_cost;
+    if( k >= 4 ) {
+      if( !open(nx, static_cast<int>(y)) || !open(static_cast<int>(x), ny) ) {
+        return 0;
+      }
+      cost = diagonal_cost;
+    }
+    unsigned const ux = static_cast<unsigned>(nx);
+    unsigned const uy = static_cast<unsigned>(ny);
+    return cost + route(ux, uy).wall_cost[cell(ux, uy)];
+  };
+
+  /* Costs are kept in the distance plane while searching, which holds
+     them exactly as they're small whole numbers. Every open cell the
+     field covers that's next to target starts the search, at the cost
+     of stepping over, and it spreads out from there through the cells
+     the field covers. */
+  unsigned const buckets = max_move_cost + 1;
+  std::vector<std::vector<std::uint64_t>> queue(buckets);
+  std::size_t queued = 0;
+  auto const push = [&](unsigned x, unsigned y, unsigned cost) {
+    flow & f = route(x, y);
+    float & d = f.distance[cell(x, y)];
+    if( d < 0 || cost < d ) {
+      d = static_cast<float>(cost);
+      queue[cost % buckets].push_back(std::uint64_t(y) << 32 | x);
+      ++queued;
+    }
+  };
+
+  for( unsigned y=0; y<h_; ++y ) {
+    for( unsigned x=0; x<w_; ++x ) {
+      /* Every cell in a chunk that's all one value is the same
+         segment, so only those on its edges can be next to another */
+      chunk const & c = chunks_[(y / chunk_size)*chunks_w_ + x / chunk_size];
+      unsigned const last_x = std::min(w_, (x / chunk_size + 1)*chunk_size) - 1;
+      if( !c.cells && ((c.fill >> 12) == 1 || !covers(x, y)) ) {
+        x = last_x;
+        continue;
+      }
+      if( !c.cells && x % chunk_size != 0 && x != last_x &&
+          y % chunk_size != 0 && y % chunk_size != chunk_size - 1 && y != h_ - 1 ) {
+        x = last_x - 1;
+        continue;
+      }
+      if( blocker_at(x, y) || !covers(x, y) ) {
+        continue;
+      }
+      unsigned best = 0;
+      for( unsigned k=0; k<8; ++k ) {
+        int const nx = static_cast<int>(x) + neighbour_x[k];
+        int const ny = static_cast<int>(y) + neighbour_y[k];
+        if( nx < 0 || ny < 0 || static_cast<unsigned>(nx) >= w_ || static_cast<unsigned>(ny) >= h_ ||
+            segment_at(static_cast<unsigned>(nx), static_cast<unsigned>(ny)) != target ) {
+          continue;
+        }
+        unsigned const cost = move_cost(x, y, k);
+        if( cost != 0 && (best == 0 || cost < best) ) {
+          best = cost;
+        }
+      }
+      if( best != 0 ) {
+        push(x, y, best);
+      }
+    }
+  }
+
+  for( unsigned cost=0; queued > 0; ++cost ) {
+    std::vector<std::uint64_t> & bucket = queue[cost % buckets];
+    /* Entries can be added to this bucket while it's being worked
+       through, but only for later costs, so only go through those
+       that were there to start with */
+    std::vector<std::uint64_t> current;
+    current.swap(bucket);
+    for( std::uint64_t const entry: current ) {
+      --queued;
+      unsigned const x = static_cast<unsigned>(entry & 0xFFFFFFFF);
+      unsigned const y = static_cast<unsigned>(entry >> 32);
+      if( route(x, y).distance[cell(x, y)] != cost ) {
+        continue;
+      }
+      for( unsigned k=0; k<8; ++k ) {
+        /* Moves are the same cost either way, apart from the wall
+           cost of the cell moved into */
+        unsigned const nx = x + neighbour_x[k];
+        unsigned const ny = y + neighbour_y[k];
+        if( move_cost(x, y, k) == 0 || !covers(nx, ny) ) {
+          continue;
+        }
+        unsigned const back = k ^ 1;
+        push(nx, ny, cost + move_cost(nx, ny, back));
+      }
+    }
+    /* Leave the bucket's storage to be reused */
+    if( bucket.empty() ) {
+      current.clear();
+      bucket.swap(current);
+    }
+  }
+
+  /* Point every reached cell at the neighbour it was reached from, or
+     into target, and turn costs into cells */
+  for( unsigned cy=0; cy<chunks_h_; ++cy ) {
+    for( unsigned cx=0; cx<chunks_w_; ++cx ) {
+      flow * const f = chunks_[cy*chunks_w_ + cx].routes[target].get();
+      if( !f ) {
+        continue;
+      }
+      unsigned const x1 = std::min(w_, (cx + 1)*chunk_size);
+      unsigned const y1 = std::min(h_, (cy + 1)*chunk_size);
+      for( unsigned y=cy*chunk_size; y<y1; ++y ) {
+        for( unsigned x=cx*chunk_size; x<x1; ++x ) {
+          if( f->distance[cell(x, y)] < 0 ) {
+            continue;
+          }
+          float best = 0;
+          int best_k = -1;
+          for( unsigned k=0; k<8; ++k ) {
+            unsigned const cost = move_cost(x, y, k);
+            if( cost == 0 ) {
+              continue;
+            }
+            unsigned const nx = x + neighbour_x[k];
+            unsigned const ny = y + neighbour_y[k];
+            float to_go;
+            if( segment_at(nx, ny) == target ) {
+              to_go = 0;
+            } else if( covers(nx, ny) ) {
+              to_go = route(nx, ny).distance[cell(nx, ny)];
+              if( to_go < 0 ) {
+                continue;
+              }
+            } else {
+              continue;
+            }
+            float const total = to_go + static_cast<float>(cost);
+            if( best_k < 0 || total < best ) {
+              best = total;
+              best_k = static_cast<int>(k);
+            }
+          }
+          vec2 const direction = best_k < 0 ? vec2::zero()
+            : vec2(neighbour_x[best_k], neighbour_y[best_k]).normalized();
+          f->direction_x[cell(x, y)] = static_cast<float>(direction.x());
+          f->direction_y[cell(x, y)] = static_cast<float>(direction.y());
+        }
+      }
+    }
+  }
+  for( chunk & c: chunks_ ) {
+    if( c.routes[target] ) {
+      for( float & d: c.routes[target]->distance ) {
+        d = d < 0 ? d : d / straight_cost;
+      }
+    }
+  }
+
+  std::chrono::duration<double> const took = std::chrono::steady_clock::now() - start;
+  flow_build_time_ += took.count();
+}
+
+/* Flow is known at cell centres, and interpolated between them,
+   leaving out cells it doesn't reach */
+template<typename F>
+void level::sample_flow_(sim_vec2 const & pos, unsigned target, F && fn) const {
+  if( target >= segments ) {
+    return;
+  }
+  if( !flow_built_[target] ) {
+    build_flow_(target);
+  }
+  sim_real const half = sim_real(0.5);
+  sim_real const max_x = sim_real(static_cast<int>(w_ - 1));
+  sim_real const max_y = sim_real(static_cast<int>(h_ - 1));
+  sim_real const fx = std::min(std::max(pos.x() - half, sim_real(0)), max_x);
+  sim_real const fy = std::min(std::max(pos.y() - half, sim_real(0)), max_y);
+  unsigned const x0 = static_cast<unsigned>(fx);
+  unsigned const y0 = static_cast<unsigned>(fy);
+  sim_real const tx = fx - sim_real(static_cast<int>(x0));
+  sim_real const ty = fy - sim_real(static_cast<int>(y0));
+  unsigned const xs[2] = { x0, std::min(x0 + 1, w_ - 1) };
+  unsigned const ys[2] = { y0, std::min(y0 + 1, h_ - 1) };
+  sim_real const wx[2] = { 1 - tx, tx };
+  sim_real const wy[2] = { 1 - ty, ty };
+  for( unsigned j=0; j<2; ++j ) {
+    for( unsigned i=0; i<2; ++i ) {
+      flow const * const f = chunk_at_(xs[i], ys[j]).routes[target].get();
+      unsigned const index = (ys[j] % chunk_size)*chunk_size + xs[i] % chunk_size;
+      if( f && f->distance[index] >= 0 ) {
+        fn(*f, index, wx[i]*wy[j]);
+      }
+    }
+  }
+}
+
+sim_vec2 level::flow_direction_at(sim_vec2 const & pos, unsigned target) const {
+  sim_vec2 direction = sim_vec2::zero();
+  sample_flow_(pos, target, [&](flow const & f, unsigned index, sim_real weight) {
+    direction += sim_vec2(sim_real(f.direction_x[index]), sim_real(f.direction_y[index])) * weight;
+  });
+  return direction;
+}
+
+std::optional<sim_real> level::flow_distance_at(sim_vec2 const & pos, unsigned target) const {
+  sim_real distance = 0;
+  sim_real total = 0;
+  sample_flow_(pos, target, [&](flow const & f, unsigned index, sim_real weight) {
+    distance += sim_real(f.distance[index]) * weight;
+    total += weight;
+  });
+  if( total == 0 ) {
+    return std::nullopt;
+  }
+  return distance / total;
+}
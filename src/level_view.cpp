@@ -0,0 +1,167 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#include "level_view.h"
+
+#include "draw_batch.h"
+#include "level.h"
+
+#include <algorithm>
+#include <cmath>
+
+/* A colour for each segment, going round the colour wheel */
+static rgba segment_color(unsigned segment) {
+  float const hue = 6.0f * segment / level::segments;
+  float const x = 1 - std::abs(std::fmod(hue, 2.0f) - 1);
+  float const alpha = 0.4f;
+  switch( static_cast<unsigned>(hue) ) {
+  case 0: return { 1, x, 0, alpha };
+  case 1: return { x, 1, 0, alpha };
+  case 2: return { 0, 1, x, alpha };
+  case 3: return { 0, x, 1, alpha };
+  case 4: return { x, 0, 1, alpha };
+  default: return { 1, 0, x, alpha };
+  }
+}
+
+static void cell_quad(draw_batch & batch, unsigned x, unsigned y, double inset) {
+  batch.quad(vec2(x + inset, y + inset), vec2(x + 1 - inset, y + inset),
+             vec2(x + 1 - inset, y + 1 - inset), vec2(x + inset, y + 1 - inset));
+}
+
+/* Show the values of one layer for the cells of chunk cx, cy. Cells
+   with nothing painted in them are left alone, so open country stays
+   dark. */
+static void draw_layer(draw_batch & batch, level const & lvl, unsigned layer, unsigned cx, unsigned cy) {
+  unsigned const x1 = std::min(lvl.width(), (cx + 1)*level::chunk_size);
+  unsigned const y1 = std::min(lvl.height(), (cy + 1)*level::chunk_size);
+  for( unsigned y=cy*level::chunk_size; y<y1; ++y ) {
+    for( unsigned x=cx*level::chunk_size; x<x1; ++x ) {
+      switch( layer ) {
+      case 0:
+        if( lvl.get_raw(0, x, y) != 0 || lvl.speed_at(x, y) != 0 ) {
+          double const theta = lvl.steer_angle_at(x, y);
+          batch.set_color({ 0.0f, 1.0f, 1.0f, 1.0f });
+          batch.line(vec2(x + 0.5, y + 0.5),
+                     vec2(x + 0.5 + 0.45*std::sin(theta), y + 0.5 + 0.45*std::cos(theta)));
+        }
+        break;
+      case 1:
+        if( lvl.speed_at(x, y) != 0 ) {
+          batch.set_color({ 0.0f, 1.0f, 0.0f, lvl.speed_at(x, y) / 15.0f * 0.6f });
+          cell_quad(batch, x, y, 0);
+        }
+        break;
+      case 2:
+        if( lvl.segment_at(x, y) < level::segments ) {
+          batch.set_color(segment_color(lvl.segment_at(x, y)));
+          cell_quad(batch, x, y, 0);
+        }
+        break;
+      default:
+        if( lvl.spawn_at(x, y) ) {
+          batch.set_color({ 1.0f, 1.0f, 0.0f, 1.0f });
+          cell_quad(batch, x, y, 0.3);
+        }
+        break;
+      }
+    }
+  }
+}
+
+level_view::level_view(std::shared_ptr<level const> lvl)
+  : lvl_(lvl),
+    cache_(lvl->chunks_wide()*lvl->chunks_high())
+{}
+
+level_view::~level_view() {
+}
+
+void level_view::draw_chunks_(draw_batch & batch, unsigned cx0, unsigned cy0, unsigned cx1, unsigned cy1) {
+  for( unsigned cy=cy0; cy<=cy1; ++cy ) {
+    for( unsigned cx=cx0; cx<=cx1; ++cx ) {
+      batch.draw(*cache_[cy*lvl_->chunks_wide() + cx].mesh);
+    }
+  }
+}
+
+void level_view::draw(draw_batch & batch, std::optional<unsigned> layer) {
+  unsigned const chunks_w = lvl_->chunks_wide();
+  unsigned const chunks_h = lvl_->chunks_high();
+  std::vector<std::size_t> changed;
+  for( unsigned cy=0; cy<chunks_h; ++cy ) {
+    for( unsigned cx=0; cx<chunks_w; ++cx ) {
+      cached & c = cache_[cy*chunks_w + cx];
+      unsigned long const revision = lvl_->chunk_revision(cx, cy);
+      if( !c.mesh || c.revision != revision || c.layer != layer ) {
+        if( !c.mesh ) {
+          c.mesh = std::make_unique<batch_mesh>();
+        }
+        batch.record(*c.mesh, [&]() {
+          if( layer ) {
+            draw_layer(batch, *lvl_, *layer, cx, cy);
+          }
+          lvl_->draw_chunk(batch, cx, cy);
+        });
+        c.revision = revision;
+        c.layer = layer;
+        changed.push_back(cy*chunks_w + cx);
+      }
+    }
+  }
+
+  vec2 const size(lvl_->width(), lvl_->height());
+  if( !batch.can_draw_to_texture() ) {
+    draw_chunks_(batch, 0, 0, chunks_w - 1, chunks_h - 1);
+    return;
+  }
+
+  /* One texel per pixel the track covers on screen */
+  vec2 const pixels = batch.to_pixels(size) - batch.to_pixels(vec2::zero());
+  int const width = static_cast<int>(std::lround(std::abs(pixels.x())));
+  int const height = static_cast<int>(std::lround(std::abs(pixels.y())));
+  bool const whole = !baked_ || baked_->width() != width || baked_->height() != height ||
+    baked_layer_ != layer;
+  if( !baked_ || baked_->width() != width || baked_->height() != height ) {
+    baked_ = std::make_unique<batch_target>(width, height);
+  }
+
+  if( whole || !changed.empty() ) {
+    batch.begin_target(*baked_);
+    batch.set_projection(0, size.x(), size.y(), 0);
+    if( whole ) {
+      batch.clear();
+      draw_chunks_(batch, 0, 0, chunks_w - 1, chunks_h - 1);
+    } else {
+      /* Lines can spill a pixel past the edge of a chunk, so clear a
+         little more than the chunk, and draw again everything that
+         could reach that far, clipped to it */
+      double const pad = 2.0 * lvl_->width() / width;
+      auto const chunk_of = [&](double v, unsigned chunks) {
+        return static_cast<unsigned>(std::min(std::max(v, 0.0) / level::chunk_size, chunks - 1.0));
+      };
+      for( std::size_t index: changed ) {
+        unsigned const cx = static_cast<unsigned>(index % chunks_w);
+        unsigned const cy = static_cast<unsigned>(index / chunks_w);
+        vec2 const from = vec2(cx*level::chunk_size, cy*level::chunk_size) - vec2(pad);
+        vec2 const to = vec2((cx + 1)*level::chunk_size, (cy + 1)*level::chunk_size) + vec2(pad);
+        batch.clip(from, to);
+        batch.clear();
+        draw_chunks_(batch, chunk_of(from.x() - pad, chunks_w), chunk_of(from.y() - pad, chunks_h),
+                     chunk_of(to.x() + pad, chunks_w), chunk_of(to.y() + pad, chunks_h));
+        batch.end_clip();
+      }
+    }
+    batch.end_target();
+    baked_layer_ = layer;
+  }
+
+  /* The texture's first row is the bottom of the track */
+  batch.set_texture(baked_->texture());
+  batch.set_color({ 1.0f, 1.0f, 1.0f, 1.0f });
+  batch.quad({ vec2::zero(), vec2(size.x(), 0), size, vec2(0, size.y()) },
+             { vec2(0, 1), vec2(1, 1), vec2(1, 0), vec2(0, 0) });
+  batch.set_texture(0);
+}
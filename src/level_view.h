@@ -0,0 +1,52 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <vector>
+
+class batch_mesh;
+class batch_target;
+class draw_batch;
+class level;
+
+/// Draws a level from a mesh for each of its chunks, recording a
+/// chunk's mesh again only once its cells have changed, so that
+/// painting a few cells of a big track doesn't mean drawing the whole
+/// of it from scratch. It can also show one of the level's layers
+/// over the top, for the track editor.
+///
+/// Where the driver can draw to a texture, the meshes are drawn into
+/// one the size the track is on screen, which is then all that's
+/// drawn each frame. Only the parts of it where cells have changed
+/// are drawn again. The texture is opaque, so the level has to be
+/// drawn before anything else.
+class level_view {
+public:
+  explicit level_view(std::shared_ptr<level const> lvl);
+  ~level_view();
+
+  level_view(level_view const &) = delete;
+  level_view& operator=(level_view const &) = delete;
+
+  /// Draw the level, with layer shown over it if there is one
+  void draw(draw_batch & batch, std::optional<unsigned> layer = std::nullopt);
+
+private:
+  struct cached {
+    std::unique_ptr<batch_mesh> mesh;
+    unsigned long revision = 0;
+    std::optional<unsigned> layer;
+  };
+
+  void draw_chunks_(draw_batch & batch, unsigned cx0, unsigned cy0, unsigned cx1, unsigned cy1);
+
+  std::shared_ptr<level const> lvl_;
+  std::vector<cached> cache_;
+  std::unique_ptr<batch_target> baked_;
+  std::optional<unsigned> baked_layer_;
+};
@@ -5,17 +5,94 @@
 */
 #include "font.h"
 #include "hiscore.h"
+#include "netplay.h"
 #include "race.h"
 #include "render.h"
+#include "replay.h"
 #include "title_screen.h"
 
 #include <atari-controllers>
 
 #include <SDL.h>
 
+#include <algorithm>
 #include <iostream>
+#include <string>
+
+static void usage(char const *argv0) {
+  std::cerr << "Usage: " << argv0 << " [--record FILE | --replay FILE | --edit FILE]\n"
+            << "    [--netplay INDEX --peers HOST:PORT,... [--latency MS]]\n"
+            << "    [--broadcast FILE|udp:HOST:PORT | --spectate FILE|udp:PORT]" << std::endl;
+  std::exit(1);
+}
+
+int main(int argc, char **argv) {
+  /* --record saves a replay of each race, overwriting the last;
+     --replay plays one back instead of starting the game; --netplay
+     races other cabinets, this one being number INDEX in --peers;
+     --broadcast streams each race for --spectate to watch; --edit
+     lets the track be edited mid race, and keeps it in FILE */
+  std::string record;
+  std::string replay_file;
+  std::string broadcast;
+  std::string spectate_source;
+  std::string edit;
+  netplay_config net;
+  bool netplay_race = false;
+  for( int i=1; i<argc; ++i ) {
+    std::string const arg(argv[i]);
+    if( i + 1 >= argc ) {
+      usage(argv[0]);
+    }
+    if( arg == "--record" ) {
+      record = argv[++i];
+    } else if( arg == "--replay" ) {
+      replay_file = argv[++i];
+    } else if( arg == "--broadcast" ) {
+      broadcast = argv[++i];
+    } else if( arg == "--spectate" ) {
+      spectate_source = argv[++i];
+    } else if( arg == "--edit" ) {
+      edit = argv[++i];
+    } else if( arg == "--netplay" ) {
+      net.index = static_cast<unsigned>(std::stoul(argv[++i]));
+      netplay_race = true;
+    } else if( arg == "--peers" ) {
+      std::string const peers(argv[++i]);
+      for( std::size_t begin=0; begin<=peers.size(); ) {
+        std::size_t const end = std::min(peers.find(',', begin), peers.size());
+        net.peers.push_back(peers.substr(begin, end - begin));
+        begin = end + 1;
+      }
+    } else if( arg == "--latency" ) {
+      net.latency = std::stod(argv[++i]) / 1000;
+    } else {
+      usage(argv[0]);
+    }
+  }
+
+  if( netplay_race && net.peers.empty() ) {
+    usage(argv[0]);
+  }
+  /* Rollbacks would rewrite what had already been recorded, so say so
+     rather than race without saving the replay asked for */
+  if( netplay_race && !record.empty() ) {
+    std::cerr << "Netplay races can't be recorded" << std::endl;
+    usage(argv[0]);
+  }
+  if( !edit.empty() && (netplay_race || !record.empty() || !broadcast.empty() ||
+                        !replay_file.empty() || !spectate_source.empty()) ) {
+    usage(argv[0]);
+  }
+
+  std::shared_ptr<replay const> recording;
+  if( !replay_file.empty() ) {
+    recording = replay::load(replay_file);
+    if( !recording ) {
+      std::exit(1);
+    }
+  }
 
-int main(int, char **) {
   if( SDL_Init(SDL_INIT_EVERYTHING) != 0 ) {
     std::cerr << "Failed to initialize SDL: "<<SDL_GetError() <<std::endl;
     std::exit(1);
@@ -30,13 +107,24 @@ int main(int, char **) {
 
   std::vector<hiscore> hiscores = load_hiscores();
 
+  if( recording || !spectate_source.empty() ) {
+    if( recording ) {
+      replay_race(r, recording, cs);
+    } else {
+      spectate(r, spectate_source, cs);
+    }
+    font::quit();
+    SDL_Quit();
+    std::exit(0);
+  }
+
   bool done = false;
   while( !done ) {
     auto pads = title_screen(cs, r, hiscores);
     if( pads.empty() ) {
       std::exit(0);
     }
-    if( !race(r, hiscores, pads, cs) ) {
+    if( !race(r, hiscores, pads, cs, record, netplay_race ? &net : nullptr, broadcast, edit) ) {
       done = true;
     }
     save_hiscores(hiscores);
@@ -0,0 +1,47 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#include "mapped_file.h"
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+std::unique_ptr<mapped_file> mapped_file::open(std::string const & filename) {
+  int const fd = ::open(filename.c_str(), O_RDONLY);
+  if( fd < 0 ) {
+    std::cerr << "Couldn't open " << filename << ": " << std::strerror(errno) << std::endl;
+    return nullptr;
+  }
+  struct stat info;
+  if( fstat(fd, &info) != 0 ) {
+    std::cerr << "Couldn't map " << filename << ": " << std::strerror(errno) << std::endl;
+    close(fd);
+    return nullptr;
+  }
+  if( info.st_size == 0 ) {
+    std::cerr << "Couldn't map " << filename << ": it's empty" << std::endl;
+    close(fd);
+    return nullptr;
+  }
+  std::size_t const size = static_cast<std::size_t>(info.st_size);
+  void * const data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  /* The mapping keeps the file alive by itself */
+  close(fd);
+  if( data == MAP_FAILED ) {
+    std::cerr << "Couldn't map " << filename << ": " << std::strerror(errno) << std::endl;
+    return nullptr;
+  }
+  return std::unique_ptr<mapped_file>(new mapped_file(data, size));
+}
+
+mapped_file::~mapped_file() {
+  munmap(data_, size_);
+}
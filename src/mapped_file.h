@@ -0,0 +1,42 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+/// A whole file mapped into memory, so that it can be used where it
+/// is instead of being read in. The mapping is private: it can be
+/// written to, but the changes only ever reach this copy, never the
+/// file.
+class mapped_file {
+public:
+  /// Returns nothing, after saying why, if filename can't be mapped
+  static std::unique_ptr<mapped_file> open(std::string const & filename);
+
+  ~mapped_file();
+
+  mapped_file(mapped_file const &) = delete;
+  mapped_file& operator=(mapped_file const &) = delete;
+
+  unsigned char * data() const {
+    return static_cast<unsigned char *>(data_);
+  }
+
+  std::size_t size() const {
+    return size_;
+  }
+
+private:
+  mapped_file(void * data, std::size_t size)
+    : data_(data),
+      size_(size)
+  {}
+
+  void * data_;
+  std::size_t size_;
+};
@@ -28,8 +28,12 @@ inline double normalize_angle(double theta) {
 
 /// Return the shorter, signed angle from theta1 to theta, accouting
 /// for wraparound
-inline double angle_between(double theta1, double theta2) {
-  double const distance1 = theta2 - theta1;
-  double const distance2 = std::copysign(2*M_PI - std::fabs(distance1), -distance1);
-  return std::fabs(distance1) < std::fabs(distance2) ? distance1 : distance2;
+template<typename T>
+T angle_between(T theta1, T theta2) {
+  using std::abs;
+  T const two_pi = T(2*M_PI);
+  T const distance1 = theta2 - theta1;
+  T const wrapped = abs(two_pi - abs(distance1));
+  T const distance2 = distance1 > 0 ? -wrapped : wrapped;
+  return abs(distance1) < abs(distance2) ? distance1 : distance2;
 }
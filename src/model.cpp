@@ -5,48 +5,21 @@
 */
 #include "model.h"
 
-#include <GL/gl.h>
+#include "draw_batch.h"
 
-#include <cmath>
-#include <iostream>
+void model::draw(draw_batch & batch) const {
+  batch.push();
+  batch.scale(width, height);
 
-static double const w = 1.0;
-static double const h = 1.2;
+  batch.quad(vec2(-0.20, -0.5), vec2(-0.20,  0.5), vec2( 0.20,  0.5), vec2( 0.20, -0.5));
 
-double model::radius() const {
-  return std::max(w,h)/2;
-}
+  batch.quad(vec2(-0.5,  -0.45), vec2(-0.5,  -0.20), vec2(-0.22, -0.20), vec2(-0.22, -0.45));
+
+  batch.quad(vec2( 0.5,  -0.45), vec2( 0.5,  -0.20), vec2( 0.22, -0.20), vec2( 0.22, -0.45));
+
+  batch.quad(vec2(-0.5,   0.00), vec2(-0.5,   0.25), vec2(-0.22,  0.25), vec2(-0.22,  0.00));
+
+  batch.quad(vec2( 0.5,   0.00), vec2( 0.5,   0.25), vec2( 0.22,  0.25), vec2( 0.22,  0.00));
 
-void model::draw() const {
-  glPushMatrix();
-  glScaled(w, h, 1);
-
-  glBegin(GL_QUADS);
-  glVertex3d(-0.20, -0.5, 0);
-  glVertex3d(-0.20,  0.5, 0);
-  glVertex3d( 0.20,  0.5, 0);
-  glVertex3d( 0.20, -0.5, 0);
-
-  glVertex3d(-0.5,  -0.45 ,0);
-  glVertex3d(-0.5,  -0.20, 0);
-  glVertex3d(-0.22, -0.20, 0);
-  glVertex3d(-0.22, -0.45, 0);
-
-  glVertex3d( 0.5,  -0.45 ,0);
-  glVertex3d( 0.5,  -0.20, 0);
-  glVertex3d( 0.22, -0.20, 0);
-  glVertex3d( 0.22, -0.45, 0);
-
-  glVertex3d(-0.5,   0.00 ,0);
-  glVertex3d(-0.5,   0.25, 0);
-  glVertex3d(-0.22,  0.25, 0);
-  glVertex3d(-0.22,  0.00, 0);
-
-  glVertex3d( 0.5,   0.00 ,0);
-  glVertex3d( 0.5,   0.25, 0);
-  glVertex3d( 0.22,  0.25, 0);
-  glVertex3d( 0.22,  0.00, 0);
-  glEnd();
-
-  glPopMatrix();
+  batch.pop();
 }
@@ -5,10 +5,20 @@
 */
 #pragma once
 
+#include <algorithm>
+
+class draw_batch;
+
 /// A very simple object that can draw a car on demand.
 class model {
  public:
-  void draw() const;
-  double radius() const;
+  void draw(draw_batch & batch) const;
+  double radius() const {
+    return std::max(width, height)/2;
+  }
+
+ private:
+  static constexpr double width = 1.0;
+  static constexpr double height = 1.2;
 };
 
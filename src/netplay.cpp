@@ -0,0 +1,525 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#include "netplay.h"
+
+#include "car.h"
+#include "error.h"
+#include "level.h"
+#include "race_sim.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+#include <arpa/inet.h>
+
+/* Every packet starts with this, a version number, its type and the
+   number of the instance that sent it. Everything is little-endian.
+
+   hello: the track's checksum, the starting grid's checksum, and
+   whether the sender has heard from everyone yet.
+
+   controls: the last of the receiver's steps the sender has controls
+   for; the sender's newest final step and its checksum; then the
+   sender's controls for a run of consecutive steps, starting from the
+   first the receiver hasn't acknowledged. Resending everything not
+   yet acknowledged means lost packets need no special handling. */
+static char const magic[4] = { 'N', 'X', 'N', 'P' };
+static unsigned const version = 1;
+enum packet_type : unsigned char { hello_packet = 0, controls_packet = 1 };
+
+/* Enough steps of controls to keep a packet well inside one ethernet
+   frame */
+static unsigned const max_controls_per_packet = 48;
+
+namespace {
+
+class writer {
+public:
+  writer(packet_type type, unsigned sender) {
+    data_.insert(data_.end(), magic, magic + sizeof(magic));
+    u8(version);
+    u8(type);
+    u8(sender);
+  }
+
+  void u8(unsigned value) {
+    data_.push_back(static_cast<unsigned char>(value));
+  }
+
+  void u32(std::uint32_t value) {
+    for( unsigned i=0; i<4; ++i ) {
+      data_.push_back(static_cast<unsigned char>(value >> (8*i)));
+    }
+  }
+
+  void real(double value) {
+    std::uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    for( unsigned i=0; i<8; ++i ) {
+      data_.push_back(static_cast<unsigned char>(bits >> (8*i)));
+    }
+  }
+
+  std::vector<unsigned char> & data() {
+    return data_;
+  }
+
+private:
+  std::vector<unsigned char> data_;
+};
+
+/* Reads back what writer wrote, remembering if it ever runs off the
+   end */
+class reader {
+public:
+  reader(std::vector<unsigned char> const & data)
+    : data_(data),
+      pos_(0),
+      ok_(true)
+  {}
+
+  unsigned u8() {
+    if( pos_ + 1 > data_.size() ) {
+      ok_ = false;
+      return 0;
+    }
+    return data_[pos_++];
+  }
+
+  std::uint32_t u32() {
+    if( pos_ + 4 > data_.size() ) {
+      ok_ = false;
+      return 0;
+    }
+    std::uint32_t value = 0;
+    for( unsigned i=0; i<4; ++i ) {
+      value |= static_cast<std::uint32_t>(data_[pos_++]) << (8*i);
+    }
+    return value;
+  }
+
+  double real() {
+    if( pos_ + 8 > data_.size() ) {
+      ok_ = false;
+      return 0;
+    }
+    std::uint64_t bits = 0;
+    for( unsigned i=0; i<8; ++i ) {
+      bits |= static_cast<std::uint64_t>(data_[pos_++]) << (8*i);
+    }
+    double value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+  }
+
+  bool ok() const {
+    return ok_;
+  }
+
+private:
+  std::vector<unsigned char> const & data_;
+  std::size_t pos_;
+  bool ok_;
+};
+
+bool same(replay::controls const & a, replay::controls const & b) {
+  return a.throttle == b.throttle && a.brake == b.brake && a.turn == b.turn;
+}
+
+}
+
+std::shared_ptr<netplay> netplay::open(netplay_config const & config) {
+  if( config.peers.size() < 2 || config.peers.size() > 255 || config.index >= config.peers.size() ) {
+    std::cerr << "Netplay needs between 2 and 255 instances, one of which is this one" << std::endl;
+    return nullptr;
+  }
+
+  std::vector<sockaddr_in> addresses(config.peers.size());
+  for( std::size_t i=0; i<config.peers.size(); ++i ) {
+    if( !udp_socket::resolve(config.peers[i], addresses[i]) ) {
+      return nullptr;
+    }
+  }
+
+  auto socket = udp_socket::open(ntohs(addresses[config.index].sin_port));
+  if( !socket ) {
+    return nullptr;
+  }
+  return std::shared_ptr<netplay>(new netplay(config, std::move(socket), addresses));
+}
+
+netplay::netplay(netplay_config const & config, std::unique_ptr<udp_socket> socket,
+                 std::vector<sockaddr_in> const & addresses)
+  : config_(config),
+    socket_(std::move(socket)),
+    peers_(addresses.size()),
+    controls_(addresses.size()),
+    track_(0),
+    start_(0),
+    mismatch_(false),
+    stepping_(0),
+    rollback_from_(0),
+    resimulating_(false),
+    desync_step_(0),
+    dt_(0),
+    rng_(config.index)
+{
+  for( std::size_t i=0; i<addresses.size(); ++i ) {
+    peers_[i].address = addresses[i];
+  }
+}
+
+bool netplay::connect(race_sim & sim, double timeout) {
+  if( sim.cars().size() < players() ) {
+    std::cerr << "Netplay needs a car for each of the " << players() << " instances" << std::endl;
+    return false;
+  }
+
+  track_ = sim.get_level()->checksum();
+  start_ = sim.checksum();
+  snapshots_ = std::make_unique<snapshot_ring>(config_.max_prediction + 1, sim.cars().size());
+  snapshots_->save(sim);
+  checksums_.assign(1, start_);
+  for( auto & log: controls_ ) {
+    log.assign(1, replay::controls{ 0, 0, 0, 0 });
+  }
+  peers_[config_.index].heard = true;
+  peers_[config_.index].ready = true;
+
+  clock::time_point const deadline = clock::now() + std::chrono::duration_cast<clock::duration>(
+    std::chrono::duration<double>(timeout));
+  clock::time_point next_hello = clock::now();
+  for( ;; ) {
+    receive();
+    if( mismatch_ ) {
+      return false;
+    }
+
+    bool heard_all = true;
+    bool all_ready = true;
+    for( auto const & p: peers_ ) {
+      heard_all = heard_all && p.heard;
+      all_ready = all_ready && p.ready;
+    }
+    if( heard_all && all_ready ) {
+      return true;
+    }
+
+    clock::time_point const now = clock::now();
+    if( now > deadline ) {
+      std::cerr << "Gave up waiting for the other instances" << std::endl;
+      return false;
+    }
+    if( now >= next_hello ) {
+      for( unsigned i=0; i<players(); ++i ) {
+        if( i != config_.index ) {
+          writer w(hello_packet, config_.index);
+          w.u32(track_);
+          w.u32(start_);
+          w.u8(heard_all);
+          send(i, std::move(w.data()));
+        }
+      }
+      next_hello = now + std::chrono::milliseconds(100);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+unsigned netplay::advance(race_sim & sim, unsigned steps, double dt) {
+  /* Take the controls before anything else, as rolling back puts the
+     car's controls back as well */
+  std::shared_ptr<car> const me = sim.cars()[config_.index];
+  /* Netplay races don't take twists, so there's none to send */
+  replay::controls const local{ me->throttle(), me->brake(), me->turn(), 0 };
+
+  dt_ = dt;
+  receive();
+  roll_back(sim);
+
+  unsigned long slowest = ~0ul;
+  for( unsigned i=0; i<players(); ++i ) {
+    if( i != config_.index ) {
+      slowest = std::min(slowest, peers_[i].confirmed);
+    }
+  }
+
+  unsigned ran = 0;
+  for( ; ran<steps && !sim.complete(); ++ran ) {
+    unsigned long const next = sim.steps() + 1;
+    if( next > slowest + config_.max_prediction ) {
+      ++stats_.stalls;
+      break;
+    }
+    std::vector<replay::controls> & log = controls_[config_.index];
+    log.resize(next + 1);
+    log[next] = local;
+    peers_[config_.index].confirmed = next;
+    step(sim);
+  }
+
+  /* Leave the car with the controls its player last gave it, whatever
+     the rollback did, so that none are lost if no step ran */
+  me->set_throttle(local.throttle);
+  me->set_brake(local.brake);
+  me->set_turn(local.turn);
+
+  compare_checksums();
+  send_controls();
+  return ran;
+}
+
+bool netplay::finish(race_sim & sim, double timeout) {
+  clock::time_point const deadline = clock::now() + std::chrono::duration_cast<clock::duration>(
+    std::chrono::duration<double>(timeout));
+  unsigned long const mine = peers_[config_.index].confirmed;
+  for( ;; ) {
+    receive();
+    roll_back(sim);
+    compare_checksums();
+    send_controls();
+
+    bool done = true;
+    for( unsigned i=0; i<players(); ++i ) {
+      peer const & p = peers_[i];
+      if( i != config_.index ) {
+        done = done && p.confirmed >= sim.steps() && p.acked >= mine && p.verified >= sim.steps();
+      }
+    }
+    if( desync_step_ != 0 ) {
+      break;
+    }
+    if( done ) {
+      /* Our last packets may be lost, and the others may still be
+         waiting for them, so say it all a few more times */
+      for( unsigned i=0; i<10; ++i ) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        send_controls();
+      }
+      break;
+    }
+    if( clock::now() > deadline ) {
+      std::cerr << "Gave up waiting for the other instances to finish" << std::endl;
+      break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+
+  /* Don't leave anything behind in the latency queue */
+  while( !queue_.empty() ) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    flush();
+  }
+
+  bool agreed = desync_step_ == 0;
+  for( unsigned i=0; i<players(); ++i ) {
+    agreed = agreed && (i == config_.index || peers_[i].verified >= sim.steps());
+  }
+  return agreed;
+}
+
+replay::controls netplay::controls(unsigned car) {
+  std::vector<replay::controls> & log = controls_[car];
+  unsigned long const known = peers_[car].confirmed;
+  if( log.size() <= stepping_ ) {
+    log.resize(stepping_ + 1);
+  }
+  /* Guess that nothing has changed since we last heard */
+  if( stepping_ > known ) {
+    log[stepping_] = log[known];
+  }
+  return log[stepping_];
+}
+
+void netplay::receive() {
+  flush();
+  std::vector<unsigned char> packet;
+  while( socket_->receive(packet) ) {
+    handle(packet);
+  }
+}
+
+void netplay::handle(std::vector<unsigned char> const & packet) {
+  if( packet.size() < 7 || std::memcmp(packet.data(), magic, sizeof(magic)) != 0 ||
+      packet[4] != version || packet[6] >= players() || packet[6] == config_.index ) {
+    return;
+  }
+  unsigned const from = packet[6];
+  peer & p = peers_[from];
+
+  std::vector<unsigned char> const body(packet.begin() + 7, packet.end());
+  reader r(body);
+  if( packet[5] == hello_packet ) {
+    std::uint32_t const track = r.u32();
+    std::uint32_t const start = r.u32();
+    bool const heard_all = r.u8() != 0;
+    if( !r.ok() ) {
+      return;
+    }
+    if( track != track_ || start != start_ ) {
+      std::cerr << "Instance " << from << " is racing on a different "
+                << (track != track_ ? "track" : "starting grid") << std::endl;
+      mismatch_ = true;
+      return;
+    }
+    p.heard = true;
+    p.ready = p.ready || heard_all;
+  } else if( packet[5] == controls_packet ) {
+    unsigned long const ack = r.u32();
+    unsigned long const check_step = r.u32();
+    std::uint32_t const check = r.u32();
+    unsigned long const first = r.u32();
+    unsigned const count = r.u8();
+    if( !r.ok() ) {
+      return;
+    }
+    /* Only someone who has heard from everyone sends these */
+    p.heard = true;
+    p.ready = true;
+    p.acked = std::max(p.acked, ack);
+    if( check_step > p.check_step && check_step > p.verified ) {
+      p.check_step = check_step;
+      p.check = check;
+    }
+    for( unsigned k=0; k<count; ++k ) {
+      replay::controls value;
+      value.throttle = r.real();
+      value.brake = r.real();
+      value.turn = r.real();
+      value.twist = 0;
+      if( !r.ok() ) {
+        return;
+      }
+      if( first + k == p.confirmed + 1 ) {
+        confirm(from, first + k, value);
+      }
+    }
+  }
+}
+
+void netplay::confirm(unsigned car, unsigned long step, replay::controls const & value) {
+  std::vector<replay::controls> & log = controls_[car];
+  unsigned long const simulated = checksums_.size() - 1;
+  if( log.size() <= step ) {
+    log.resize(step + 1);
+  }
+  if( step <= simulated && !same(log[step], value) ) {
+    if( rollback_from_ == 0 || step < rollback_from_ ) {
+      rollback_from_ = step;
+    }
+  }
+  log[step] = value;
+  peers_[car].confirmed = step;
+}
+
+void netplay::roll_back(race_sim & sim) {
+  if( rollback_from_ == 0 ) {
+    return;
+  }
+  unsigned long const end = sim.steps();
+  if( !snapshots_->restore(sim, rollback_from_ - 1) ) {
+    std::cerr << "Can't roll back to step " << rollback_from_ - 1 << ", only to "
+              << snapshots_->oldest() << std::endl;
+    crash();
+  }
+  ++stats_.rollbacks;
+  stats_.resimulated_steps += end - sim.steps();
+  stats_.max_rollback = std::max(stats_.max_rollback, end - sim.steps());
+  resimulating_ = true;
+  while( sim.steps() < end ) {
+    step(sim);
+  }
+  resimulating_ = false;
+  rollback_from_ = 0;
+}
+
+void netplay::step(race_sim & sim) {
+  stepping_ = sim.steps() + 1;
+  sim.step(dt_);
+  checksums_.resize(sim.steps() + 1);
+  checksums_[sim.steps()] = sim.checksum();
+  snapshots_->save(sim);
+}
+
+unsigned long netplay::final_step() const {
+  unsigned long step = checksums_.size() - 1;
+  for( auto const & p: peers_ ) {
+    step = std::min(step, p.confirmed);
+  }
+  return step;
+}
+
+void netplay::compare_checksums() {
+  unsigned long const final = final_step();
+  for( unsigned i=0; i<players(); ++i ) {
+    peer & p = peers_[i];
+    if( i == config_.index || p.check_step == 0 || p.check_step > final ) {
+      continue;
+    }
+    ++stats_.checksums_compared;
+    if( checksums_[p.check_step] != p.check && desync_step_ == 0 ) {
+      desync_step_ = p.check_step;
+      std::cerr << "Instance " << i << " has a different race to this one at step "
+                << desync_step_ << std::endl;
+    }
+    p.verified = p.check_step;
+    p.check_step = 0;
+  }
+}
+
+void netplay::send_controls() {
+  unsigned long const final = final_step();
+  std::vector<replay::controls> const & log = controls_[config_.index];
+  unsigned long const last = peers_[config_.index].confirmed;
+  for( unsigned i=0; i<players(); ++i ) {
+    if( i == config_.index ) {
+      continue;
+    }
+    peer const & p = peers_[i];
+    unsigned long const first = p.acked + 1;
+    unsigned long const end = std::min(last + 1, first + max_controls_per_packet);
+
+    writer w(controls_packet, config_.index);
+    w.u32(static_cast<std::uint32_t>(p.confirmed));
+    w.u32(static_cast<std::uint32_t>(final));
+    w.u32(checksums_[final]);
+    w.u32(static_cast<std::uint32_t>(first));
+    w.u8(end > first ? static_cast<unsigned>(end - first) : 0);
+    for( unsigned long s=first; s<end; ++s ) {
+      w.real(log[s].throttle);
+      w.real(log[s].brake);
+      w.real(log[s].turn);
+    }
+    send(i, std::move(w.data()));
+  }
+}
+
+void netplay::send(unsigned to, std::vector<unsigned char> data) {
+  if( config_.loss > 0 && std::uniform_real_distribution<double>(0, 1)(rng_) < config_.loss ) {
+    return;
+  }
+  double delay = config_.latency;
+  if( config_.jitter > 0 ) {
+    delay += std::uniform_real_distribution<double>(0, config_.jitter)(rng_);
+  }
+  clock::time_point const due = clock::now() + std::chrono::duration_cast<clock::duration>(
+    std::chrono::duration<double>(delay));
+  queue_.push_back(outgoing{ due, to, std::move(data) });
+  flush();
+}
+
+void netplay::flush() {
+  clock::time_point const now = clock::now();
+  auto const due = std::stable_partition(queue_.begin(), queue_.end(), [&](outgoing const & o) {
+    return o.due > now;
+  });
+  for( auto o = due; o != queue_.end(); ++o ) {
+    socket_->send(peers_[o->to].address, o->data);
+  }
+  queue_.erase(due, queue_.end());
+}
@@ -0,0 +1,185 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#pragma once
+
+#include "replay.h"
+#include "snapshot_ring.h"
+#include "udp_socket.h"
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+class race_sim;
+
+/// Who is in a netplay race, and how badly to treat the packets sent
+/// between them, for testing
+struct netplay_config {
+  /// This instance's number, which is also the number of the car it
+  /// drives
+  unsigned index = 0;
+  /// host:port of every instance in the race, in order, including
+  /// this one, whose port is the one it listens on
+  std::vector<std::string> peers;
+  /// How far ahead of the other instances' inputs the race may run,
+  /// guessing at them, before it has to wait
+  unsigned max_prediction = 60;
+  /// Extra delay added to every packet sent, in seconds, plus up to
+  /// jitter more at random
+  double latency = 0;
+  double jitter = 0;
+  /// The fraction of packets sent to throw away
+  double loss = 0;
+};
+
+/// How a netplay race went
+struct netplay_stats {
+  /// Times a remote input turned out not to be what was guessed
+  unsigned long rollbacks = 0;
+  /// Steps run again because of them, and the most in one go
+  unsigned long resimulated_steps = 0;
+  unsigned long max_rollback = 0;
+  /// Times the race had to wait for the other instances to catch up
+  unsigned long stalls = 0;
+  /// Checksums compared with the other instances
+  unsigned long checksums_compared = 0;
+};
+
+/// Rollback netplay: several instances of the race, each with its own
+/// race_sim, exchanging only their own car's controls over UDP.
+///
+/// Every instance steps its race as soon as it can, guessing that the
+/// other cars' controls haven't changed since it last heard. When the
+/// real controls for a step arrive and differ from the guess, the race
+/// is put back to the step before from a snapshot and run forward
+/// again. Once every instance's controls up to a step are known, the
+/// race's checksum at that step is final, and the instances compare
+/// them to catch any that have drifted apart.
+///
+/// Every car from 0 up to the number of instances is driven through
+/// here, by a remote_player, including this instance's own: its
+/// controls are taken from its car before each step and logged, so
+/// that they can be replayed after a rollback too.
+class netplay {
+public:
+  /// Open the socket, or return nothing if it can't be
+  static std::shared_ptr<netplay> open(netplay_config const & config);
+
+  netplay(netplay const &) = delete;
+  netplay& operator=(netplay const &) = delete;
+
+  /// Wait for every other instance to be ready to race, for up to
+  /// timeout seconds. sim must have its cars in their starting
+  /// places; the instances check that they all agree on the track and
+  /// the starting grid. Returns false if they don't, or some never
+  /// turned up.
+  bool connect(race_sim & sim, double timeout);
+
+  /// Deal with whatever has arrived from the other instances, rolling
+  /// back if need be, then take this instance's controls from its car
+  /// and run up to steps more steps of dt seconds, or fewer if the
+  /// race is finished or too far ahead. Returns how many it ran.
+  unsigned advance(race_sim & sim, unsigned steps, double dt);
+
+  /// Once the race is complete, keep swapping controls until every
+  /// instance knows how it ended and they have compared checksums, or
+  /// timeout seconds go by. Returns whether they all agreed.
+  bool finish(race_sim & sim, double timeout);
+
+  /// The controls a car has for the step being run, known or guessed.
+  /// For remote_player.
+  replay::controls controls(unsigned car);
+
+  /// Whether steps are being run again after a rollback, so anything
+  /// they do has already been seen and heard
+  bool resimulating() const {
+    return resimulating_;
+  }
+
+  /// The number of instances, and so of cars driven through here
+  unsigned players() const {
+    return static_cast<unsigned>(peers_.size());
+  }
+
+  /// The step at which this instance's race was found to differ from
+  /// another's, or 0 if it hasn't
+  unsigned long desync_step() const {
+    return desync_step_;
+  }
+
+  netplay_stats const & stats() const {
+    return stats_;
+  }
+
+private:
+  using clock = std::chrono::steady_clock;
+
+  struct peer {
+    sockaddr_in address;
+    /// The last of their steps whose controls we have, and the last
+    /// of ours they have told us they have
+    unsigned long confirmed = 0;
+    unsigned long acked = 0;
+    /// Whether we've heard from them, and whether they have heard
+    /// from everyone
+    bool heard = false;
+    bool ready = false;
+    /// The newest final checksum they've sent, not yet compared, and
+    /// the last step we have compared
+    unsigned long check_step = 0;
+    std::uint32_t check = 0;
+    unsigned long verified = 0;
+  };
+
+  struct outgoing {
+    clock::time_point due;
+    unsigned to;
+    std::vector<unsigned char> data;
+  };
+
+  netplay(netplay_config const & config, std::unique_ptr<udp_socket> socket,
+          std::vector<sockaddr_in> const & addresses);
+
+  void receive();
+  void handle(std::vector<unsigned char> const & packet);
+  void confirm(unsigned car, unsigned long step, replay::controls const & value);
+  void roll_back(race_sim & sim);
+  void step(race_sim & sim);
+  void compare_checksums();
+  unsigned long final_step() const;
+  void send_controls();
+  void send(unsigned to, std::vector<unsigned char> data);
+  void flush();
+
+  netplay_config config_;
+  std::unique_ptr<udp_socket> socket_;
+  std::vector<peer> peers_;
+  /// Every car's controls for every step so far, known or guessed,
+  /// with step n at index n
+  std::vector<std::vector<replay::controls>> controls_;
+  /// The race's checksum after every step so far
+  std::vector<std::uint32_t> checksums_;
+  std::unique_ptr<snapshot_ring> snapshots_;
+  /// The checksums of the track and of the starting grid, which every
+  /// instance must agree on
+  std::uint32_t track_;
+  std::uint32_t start_;
+  bool mismatch_;
+  /// The step being run, and the earliest one a remote input has
+  /// shown to have been guessed wrong, or 0
+  unsigned long stepping_;
+  unsigned long rollback_from_;
+  bool resimulating_;
+  unsigned long desync_step_;
+  /// The length of a step, as last passed to advance()
+  double dt_;
+  std::vector<outgoing> queue_;
+  std::mt19937 rng_;
+  netplay_stats stats_;
+};
@@ -9,35 +9,132 @@
 #include "level.h"
 #include "math_helpers.h"
 
+#include <algorithm>
 #include <cmath>
 
 unsigned ai_player::score() const {
   return controlled_->score();
 }
 
+/* Work in the simulation's own number type, so that fixed point
+   builds drive the same way everywhere */
+static sim_real const arrive_time = sim_real(0.1);
+
+/* Throttle or brake to reach speed_target, and turn towards
+   theta_target */
+static void drive(car & controlled, sim_real theta_target, sim_real speed_target) {
+  using std::cos;
+  sim_real const distance = angle_between(controlled.theta(), theta_target);
+  sim_real const speed = cos(distance) * controlled.vel().mag();
+
+  if( speed > speed_target ) {
+    controlled.set_throttle(0);
+    controlled.set_brake(1);
+  } else if (speed < speed_target ) {
+    controlled.set_throttle(1);
+    controlled.set_brake(0);
+  } else {
+    controlled.set_throttle(0);
+    controlled.set_brake(0);
+  }
+
+  controlled.set_turn(static_cast<double>(distance / arrive_time));
+}
+
 void ai_player::update([[maybe_unused]] double dt)  {
-  double const arrive_time = 0.1;
+  /* The track may be edited mid race; the level remembers the answer
+     until it is */
+  if( environment_->has_steering_layer() ) {
+    follow_layers();
+  } else {
+    follow_flow();
+  }
+}
 
-  vec2 const pos = controlled_->pos();
+void ai_player::follow_layers() {
+  sim_vec2 const pos = controlled_->pos();
 
   unsigned const x = static_cast<unsigned>(pos.x());
   unsigned const y = static_cast<unsigned>(pos.y());
 
-  double const theta_target = environment_->steer_angle_at(x, y);
-  double const distance = angle_between(controlled_->theta(), theta_target);
-  double const speed_target = environment_->speed_at(x, y) * 18 / 15.0;
-  double const speed = std::cos(distance) * controlled_->vel().mag();
+  sim_real const theta_target = sim_real(environment_->steer_angle_at(x, y));
+  sim_real const speed_target = sim_real(environment_->speed_at(x, y) * 18 / 15.0);
+  drive(*controlled_, theta_target, speed_target);
+}
 
-  if( speed > speed_target ) {
-    controlled_->set_throttle(0);
-    controlled_->set_brake(1);
-  } else if (speed < speed_target ) {
-    controlled_->set_throttle(1);
-    controlled_->set_brake(0);
-  } else {
-    controlled_->set_throttle(0);
-    controlled_->set_brake(0);
+void ai_player::follow_flow() {
+  /* Steer for where the flow goes a little way ahead of the car, and
+     slow down by as much as it turns between there and further on */
+  sim_real const steer_ahead = sim_real(0.15);
+  sim_real const brake_ahead = sim_real(2.5);
+  sim_real const top_speed = 18;
+  sim_real const corner_speed = 6;
+  /* The flow runs from cell centre to cell centre, which is too close
+     to the walls to get through narrow gaps, so edge sideways away
+     from any obstacle that comes within this much of the car */
+  sim_real const wall_margin = sim_real(0.5);
+  /* Flow interpolated between cells that point opposite ways can all
+     but cancel out, leaving no way to tell where it's going */
+  auto const flows = [](sim_vec2 const & direction) {
+    return direction.mag() > sim_real(0.01);
+  };
+
+  sim_vec2 const pos = controlled_->pos();
+  sim_vec2 const ahead = pos + controlled_->vel() * steer_ahead;
+  unsigned target = level::next_segment(controlled_->segment());
+  sim_vec2 near = environment_->flow_direction_at(ahead, target);
+  if( !flows(near) ) {
+    /* Knocked back out of the segment last scored, so find the way
+       from the one the car is in */
+    target = level::next_segment(environment_->segment_at(static_cast<unsigned>(pos.x()),
+                                                          static_cast<unsigned>(pos.y())));
+    near = environment_->flow_direction_at(ahead, target);
+  }
+  if( !flows(near) ) {
+    /* Nowhere to go from here; carry on, gently, and hope */
+    drive(*controlled_, controlled_->theta(), corner_speed);
+    return;
+  }
+  sim_vec2 const far = environment_->flow_direction_at(pos + near.normalized() * brake_ahead, target);
+
+  sim_real const clearance = controlled_->collision_shape().radius() + level::obstacle_radius;
+  sim_vec2 away = sim_vec2::zero();
+  int const cell_x = static_cast<int>(ahead.x());
+  int const cell_y = static_cast<int>(ahead.y());
+  for( int j=cell_y - 1; j<=cell_y + 1; ++j ) {
+    for( int i=cell_x - 1; i<=cell_x + 1; ++i ) {
+      if( i < 0 || j < 0 || static_cast<unsigned>(i) >= environment_->width() ||
+          static_cast<unsigned>(j) >= environment_->height() ||
+          !environment_->blocker_at(static_cast<unsigned>(i), static_cast<unsigned>(j)) ) {
+        continue;
+      }
+      sim_vec2 const offset = ahead - sim_vec2(i + sim_real(0.5), j + sim_real(0.5));
+      sim_real const distance = offset.mag();
+      sim_real const gap = distance - clearance;
+      if( gap < wall_margin && distance > 0 ) {
+        away += offset.normalized() * ((wall_margin - gap) / wall_margin);
+      }
+    }
   }
 
-  controlled_->set_turn(distance / arrive_time);
+  using std::abs;
+  using std::atan2;
+  sim_vec2 const along = near.normalized();
+  sim_vec2 const across(along.y(), -along.x());
+  sim_vec2 const heading = along + across * across.dot(away);
+  sim_real const theta_target = atan2(heading.x(), heading.y());
+  sim_real turn = 0;
+  if( flows(far) ) {
+    turn = abs(angle_between(atan2(near.x(), near.y()), atan2(far.x(), far.y())));
+  }
+  sim_real const corner = std::min(turn / sim_real(M_PI/2), sim_real(1));
+  sim_real speed_target = top_speed - (top_speed - corner_speed) * corner;
+  /* Where the speed layer has been painted, say for tuning, it knows
+     better */
+  unsigned const painted = environment_->speed_at(static_cast<unsigned>(pos.x()),
+                                                  static_cast<unsigned>(pos.y()));
+  if( painted != 0 ) {
+    speed_target = sim_real(painted * 18 / 15.0);
+  }
+  drive(*controlled_, theta_target, speed_target);
 }
@@ -14,7 +14,9 @@ class level;
 
 /// An AI player to make up the numbers, if less than 8 human players
 /// are available.  It uses driving instructions baked into the track
-/// to keep things simple.
+/// to keep things simple, or if the track has no steering layer,
+/// follows the track's flow field, looking ahead to slow down for
+/// corners wherever the speed layer doesn't say how fast to go.
 class ai_player: public player {
 public:
   ai_player(std::shared_ptr<car> controlled, std::shared_ptr<level> environment)
@@ -26,6 +28,9 @@ public: // player
   bool is_human() const { return false; }
   unsigned score() const;
 private:
+  void follow_layers();
+  void follow_flow();
+
   std::shared_ptr<car> controlled_;
   std::shared_ptr<level> environment_;
 };
@@ -9,8 +9,9 @@
 
 #include <atari-controllers>
 
-joystick_player::joystick_player(std::shared_ptr<car> controlled, std::shared_ptr<controllers::classic> ctrl)
-  : human_player(controlled), ctrl_(ctrl)
+joystick_player::joystick_player(std::shared_ptr<car> controlled, std::shared_ptr<controllers::classic> ctrl,
+                                 bool twist)
+  : human_player(controlled), ctrl_(ctrl), twist_(twist)
 {
 }
 
@@ -24,7 +25,9 @@ bool joystick_player::handle_event(std::shared_ptr<controllers::event const> evt
         get_car()->set_turn(-axis->get_value());
         break;
       case controllers::axis::stick_twist:
-        get_car()->set_theta(get_car()->theta() - 720*(M_PI/180.0) * axis->get_value());
+        if( twist_ ) {
+          get_car()->add_twist(720*(M_PI/180.0) * axis->get_value());
+        }
         break;
       default:
         break;
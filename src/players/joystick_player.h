@@ -15,9 +15,12 @@ namespace controllers {
 /// A joystick player is someone using an Atari Classic controller.
 class joystick_player: public human_player {
 public:
-  joystick_player(std::shared_ptr<car> controlled, std::shared_ptr<controllers::classic> ctrl);
+  /// Twisting the stick turns the car on the spot, unless twist is
+  /// false
+  joystick_player(std::shared_ptr<car> controlled, std::shared_ptr<controllers::classic> ctrl, bool twist);
 public: // event_handler
   bool handle_event(std::shared_ptr<controllers::event const> evt);
 private:
   std::shared_ptr<controllers::classic> ctrl_;
+  bool twist_;
 };
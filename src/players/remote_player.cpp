@@ -0,0 +1,20 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#include "remote_player.h"
+
+#include "car.h"
+#include "netplay.h"
+
+unsigned remote_player::score() const {
+  return controlled_->score();
+}
+
+void remote_player::update([[maybe_unused]] double dt) {
+  replay::controls const c = session_->controls(index_);
+  controlled_->set_throttle(c.throttle);
+  controlled_->set_brake(c.brake);
+  controlled_->set_turn(c.turn);
+}
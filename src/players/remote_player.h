@@ -0,0 +1,36 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#pragma once
+
+#include "player.h"
+
+#include <memory>
+
+class car;
+class netplay;
+
+/// Drives a car in a netplay race with the controls sent by the
+/// instance racing it, or the best guess at them until they arrive.
+/// Each instance's own car is driven this way too, from the controls
+/// its human player gave it, so that rolling back replays them.
+class remote_player: public player {
+public:
+  remote_player(std::shared_ptr<car> controlled, std::shared_ptr<netplay> session, unsigned index)
+    : controlled_(controlled),
+      session_(session),
+      index_(index)
+  {}
+public: // player
+  void update(double dt);
+  /// Remote players are people, but their scores belong on their own
+  /// cabinet's table
+  bool is_human() const { return false; }
+  unsigned score() const;
+private:
+  std::shared_ptr<car> controlled_;
+  std::shared_ptr<netplay> session_;
+  unsigned index_;
+};
@@ -0,0 +1,21 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#include "replay_player.h"
+
+#include "car.h"
+#include "replay.h"
+
+unsigned replay_player::score() const {
+  return controlled_->score();
+}
+
+void replay_player::update([[maybe_unused]] double dt) {
+  replay::controls const c = recording_->controls_at(index_, ++step_, cursor_);
+  controlled_->set_throttle(c.throttle);
+  controlled_->set_brake(c.brake);
+  controlled_->set_turn(c.turn);
+  controlled_->set_twist(c.twist);
+}
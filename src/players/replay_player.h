@@ -0,0 +1,36 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#pragma once
+
+#include "player.h"
+
+#include <memory>
+
+class car;
+class replay;
+
+/// Drives a car exactly as it was driven when a replay was recorded.
+/// It must be added to the race before the first step.
+class replay_player: public player {
+public:
+  replay_player(std::shared_ptr<car> controlled, std::shared_ptr<replay const> recording, unsigned index)
+    : controlled_(controlled),
+      recording_(recording),
+      index_(index),
+      step_(0),
+      cursor_(0)
+  {}
+public: // player
+  void update(double dt);
+  bool is_human() const { return false; }
+  unsigned score() const;
+private:
+  std::shared_ptr<car> controlled_;
+  std::shared_ptr<replay const> recording_;
+  unsigned index_;
+  unsigned long step_;
+  std::size_t cursor_;
+};
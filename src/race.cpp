@@ -7,276 +7,431 @@
 
 #include "car.h"
 #include "error.h"
-#include "font.h"
+#include "fixed_step.h"
+#include "frame_state.h"
 #include "hiscore.h"
 #include "level.h"
+#include "netplay.h"
 #include "race_audio.h"
-#include "race_start_sequence.h"
+#include "race_sim.h"
+#include "race_stream.h"
+#include "race_view.h"
 #include "render.h"
-#include "render_helpers.h"
-#include "timer.h"
+#include "render_thread.h"
+#include "replay.h"
+#include "track_editor.h"
 #include "players/ai_player.h"
 #include "players/joystick_player.h"
 #include "players/modern_pad_player.h"
 #include "players/pad_player.h"
+#include "players/remote_player.h"
+#include "players/replay_player.h"
 
 #include <atari-controllers>
 
-#include <GL/gl.h>
-
+#include <chrono>
+#include <cstdint>
 #include <cstdlib>
 #include <cmath>
-#include <iomanip>
+#include <filesystem>
 #include <iostream>
-#include <sstream>
+#include <thread>
+
+/* Passes on everything that happens in a netplay race, apart from
+   while steps are being run again after a rollback, which would only
+   repeat the sounds of what has already happened */
+class netplay_events: public race_events {
+public:
+  netplay_events(race_events & target, std::shared_ptr<netplay const> session)
+    : target_(target),
+      session_(session)
+  {}
+
+  void on_starting_beep() {
+    if( !session_->resimulating() ) {
+      target_.on_starting_beep();
+    }
+  }
 
-static void init_projection(std::shared_ptr<level> lvl)
-{
-  glMatrixMode(GL_PROJECTION);
-  glLoadIdentity();
+  void on_crash(vec2 const & pos, double vel) {
+    if( !session_->resimulating() ) {
+      target_.on_crash(pos, vel);
+    }
+  }
 
-  glOrtho(-7.0/18*lvl->width(), (25.0/18*lvl->width()), lvl->height(), 0, 0, 1);
+private:
+  race_events & target_;
+  std::shared_ptr<netplay const> session_;
+};
 
-  glMatrixMode(GL_MODELVIEW);
-  glLoadIdentity();
+/* Netplay doesn't send twists of the classic stick, so netplay races
+   leave them out */
+static std::shared_ptr<human_player> make_human_player(std::shared_ptr<car> c,
+                                                       std::shared_ptr<controllers::controller> pad,
+                                                       bool twist)
+{
+  switch( pad->get_kind() ) {
+  case controllers::controller::kind::modern:
+    return std::make_shared<modern_pad_player>(c, std::dynamic_pointer_cast<controllers::modern>(pad));
+  case controllers::controller::kind::classic:
+    return std::make_shared<joystick_player>(c, std::dynamic_pointer_cast<controllers::classic>(pad), twist);
+  default:
+    return std::make_shared<pad_player>(c, pad);
+  }
 }
 
-static void draw_scores(std::vector<std::shared_ptr<car>> const & cars, font const & f)
+/* Poll SDL and the controllers, passing controller events on to
+   event_handlers. Returns false if the player quit. */
+static bool handle_events(std::shared_ptr<controllers::collection> cs,
+                          std::vector<std::shared_ptr<event_handler>> const & event_handlers,
+                          double elapsed)
 {
-  unsigned const per_side = (cars.size() + 1)/2;
-
-  glMatrixMode(GL_PROJECTION);
-  glPushMatrix();
-  glLoadIdentity();
-  glOrtho(-7.0/18, 25.0/18, 1, 0, 0, 1);
-
-  glMatrixMode(GL_MODELVIEW);
-  glPushMatrix();
-  glLoadIdentity();
-
-  for( std::size_t i=0; i<cars.size(); ++i ) {
-    unsigned const side = i < per_side ? 0 : 1;
-    unsigned const index = i % per_side;
-    glPushMatrix();
-    glScaled(1.0/ per_side, 1.0/per_side, 1);
-    glTranslated(side ? 0 : per_side, index + 1 - (double)side, 0);
-    glRotated(90, 0, 0, side ? 1 : -1);
-    glScaled(0.25, 0.25, 1);
-    glTranslated(1, 0, 0);
-
-    std::stringstream ss;
-    ss << std::setw(2) << std::setfill('0') << cars[i]->score();
-    set_color(cars[i]->color());
-    f.render_text_to_height(ss.str(), vec2(0, 0), 1);
-
-    glPopMatrix();
+  bool quit = false;
+  SDL_Event evt;
+  while( SDL_PollEvent(&evt) ) {
+    if( !cs->handle_event(evt) ) {
+      if( evt.type == SDL_QUIT ) {
+        quit = true;
+      } else if( evt.type == SDL_KEYDOWN && evt.key.keysym.sym == SDLK_ESCAPE ) {
+        quit = true;
+      }
+    }
   }
+  cs->update(static_cast<std::uint64_t>(elapsed * 1e9));
 
-  glPopMatrix();
-
-  glMatrixMode(GL_PROJECTION);
-  glPopMatrix();
-
-  glMatrixMode(GL_MODELVIEW);
+  for( auto & event: cs->get_events() ) {
+    for( auto c: event_handlers ) {
+      if( c->handle_event(event) ) {
+        break;
+      }
+    }
+  }
+  return !quit;
 }
 
-static void process_collisions(std::shared_ptr<level> lvl,
-                               std::vector<std::shared_ptr<car>> &cars,
-                               race_audio & audio) {
+/* Run the race until it finishes, or until last_step for a replay of
+   a race that was abandoned. It's drawn on a render_thread, from a
+   frame_state published after each round of steps, so this thread
+   keeps to the simulation's pace whatever the display does. In a
+   netplay race the session does the stepping. If stream isn't null
+   the race is broadcast through it. If editor isn't null, the race
+   stops while it's in use. Returns false if the player quit. */
+static bool run(render &r, race_sim & sim, std::shared_ptr<controllers::collection> cs,
+                std::vector<std::shared_ptr<event_handler>> const & event_handlers,
+                double step, unsigned long last_step, std::shared_ptr<netplay> session,
+                race_stream_writer * stream, track_editor * editor)
+{
+  auto const & cars = sim.cars();
+  render_thread drawing(r, sim.get_level()->clone());
+  frame_state frame;
+
+  /* The simulation runs at a fixed rate, independent of the display;
+     if a frame takes far too long we skip ahead instead of trying to
+     simulate the whole gap. */
+  fixed_step sim_clock(step, 12);
+  std::uint64_t const ticks_per_second = SDL_GetPerformanceFrequency();
+  std::uint64_t last_frame = SDL_GetPerformanceCounter();
+  bool quit = false;
   for( ;; ) {
-    bool collisions = false;
-    for( auto c1: cars ) {
-      circle c1_shape = c1->collision_shape();
-      for( ;; ) {
-        auto level_shape = lvl->get_intersecting_shape(c1_shape);
-        if( !level_shape ) {
-          break;
-        }
-        double const bounce = 0.2;
-        vec2 const sep = c1_shape.separation_direction(*level_shape);
-        /* move out of collision */
-        double const closing_vel = -c1->vel().dot(sep);
-        c1->set_pos(c1->pos() + sep * c1_shape.intersection_distance(*level_shape));
-        c1->set_vel(c1->vel() + (1 + bounce) * closing_vel * sep);
-        c1_shape = c1->collision_shape();
-        audio.play_crash(c1->pos(), closing_vel);
-        collisions = true;
-      }
+    std::uint64_t const this_frame = SDL_GetPerformanceCounter();
+    double const elapsed = (this_frame - last_frame)/static_cast<double>(ticks_per_second);
+    last_frame = this_frame;
 
-      /* Collisions with cars */
-      for( auto c2: cars ) {
-        if( c1 == c2 ) {
-          continue;
-        }
-        circle const c2_shape = c2->collision_shape();
-        if( c1_shape.intersects(c2_shape) ) {
-          double const bounce = 0.5;
-          vec2 const sep = c1_shape.separation_direction(c2_shape);
-          /* move out of collision */
-          double const distance = c1_shape.intersection_distance(c2_shape);
-          c1->set_pos(c1->pos() + sep * distance * 0.5 );
-          c2->set_pos(c2->pos() - sep * distance * 0.5 );
-
-          /* bounce */
-          double const closing_vel = c2->vel().dot(sep) - c1->vel().dot(sep);
-          double const separating_vel = -closing_vel * bounce;
-          double const dv = separating_vel - closing_vel;
-          c1->set_vel(c1->vel() - dv * sep * 0.5);
-          c2->set_vel(c2->vel() + dv * sep * 0.5);
-          c1->set_collided(closing_vel, vec2::y_axis().rotated(c1->theta()).cross(sep));
-          c2->set_collided(closing_vel, vec2::y_axis().rotated(c2->theta()).cross(sep));
-          audio.play_crash(c1->pos(), closing_vel);
-
-          collisions = true;
-        }
+    if( !handle_events(cs, event_handlers, elapsed) ) {
+      quit = true;
+      break;
+    }
+
+    bool const editing = editor && editor->active();
+    unsigned const steps = editing ? 0 : sim_clock.advance(elapsed);
+    if( editing ) {
+      editor->update(elapsed);
+    } else if( session ) {
+      session->advance(sim, steps, sim_clock.step());
+    } else {
+      for( unsigned step=0; step<steps && !sim.complete() && sim.steps() < last_step; ++step ) {
+        sim.step(sim_clock.step());
       }
     }
+    if( stream ) {
+      stream->update(sim, sim_clock.step());
+    }
 
-    if( !collisions ) {
+    if( sim.complete() || sim.steps() >= last_step || (session && session->desync_step() != 0) ) {
       break;
     }
-  }
-}
 
-static void spawn_cars(std::vector<std::shared_ptr<car>> & cars, std::shared_ptr<level> lvl) {
-  unsigned index = 0;
-
-  for ( unsigned j=0; j<lvl->height(); ++j ) {
-    for( unsigned i=0; i<lvl->width(); ++i ) {
-      if( lvl->spawn_at(i, j) ) {
-        if( index == cars.size() ) {
-          return;
-        }
-        {
-          const unsigned ix = index++;
-          cars[ix]->set_pos( vec2(i +0.5, j+0.5));
-          cars[ix]->set_vel( vec2(0,0));
-          cars[ix]->set_theta( lvl->steer_angle_at(i,j));
-        }
+    frame.cars.clear();
+    for( auto c: cars ) {
+      frame.cars.push_back({ c->state(), c->color() });
+    }
+    frame.alpha = sim_clock.alpha();
+    frame.published = SDL_GetPerformanceCounter();
+    frame.step = sim_clock.step();
+    frame.editor.reset();
+    frame.edits.clear();
+    if( editor ) {
+      if( editing ) {
+        frame.editor = editor->get_overlay();
       }
+      editor->take_edits(frame.edits);
     }
+    drawing.publish(frame);
+
+    /* Sleep until the next step is due */
+    std::this_thread::sleep_for(std::chrono::duration<double>((1 - sim_clock.alpha()) * sim_clock.step()));
   }
-}
 
-static void score_car(std::shared_ptr<car> c, std::shared_ptr<level> lvl) {
-  vec2 const pos = c->pos();
-  unsigned const x = static_cast<unsigned>(pos.x());
-  unsigned const y = static_cast<unsigned>(pos.y());
-  unsigned const old_segment = c->segment();
-  unsigned const new_segment = lvl->segment_at(x, y);
-  if( new_segment != old_segment ) {
-    if( new_segment == (old_segment + 1) % 0xE) {
-      c->set_segment(lvl->segment_at(x,y));
-      c->add_score(5);
-    }
+  if( session && !quit ) {
+    session->finish(sim, 10);
+  }
+  if( stream ) {
+    stream->finish(sim, sim_clock.step());
   }
+
+  for( auto c: cars ) {
+    std::cout << "Score: "<<c->color()<<": "<<c->score()<<std::endl;
+  }
+  return !quit;
 }
 
 bool race(render &r,
           std::vector<hiscore>& hiscores,
           std::vector<std::shared_ptr<controllers::controller>>& pads,
-          std::shared_ptr<controllers::collection> cs)
+          std::shared_ptr<controllers::collection> cs,
+          std::string const & record,
+          netplay_config const * net,
+          std::string const & broadcast,
+          std::string const & edit)
 {
-  std::vector<std::shared_ptr<car>> cars;
   std::vector<std::shared_ptr<player>> players;
   std::vector<std::shared_ptr<event_handler>> event_handlers;
 
+  double const step = 1.0/120;
+  double const duration = 30;
 
-  font f2("res/CourierPrime-Regular.ttf", 300);
+  std::shared_ptr<netplay> session;
+  if( net ) {
+    session = netplay::open(*net);
+    if( !session ) {
+      return false;
+    }
+  }
 
-  auto lvl = level::load("res/track.dat");
-  init_projection(lvl);
+  /* Carry on editing where the last race left off */
+  bool const edited = !edit.empty() && std::filesystem::exists(edit);
+  auto lvl = level::load(edited ? edit : "res/track.dat");
   race_audio audio(lvl);
-
-  for( unsigned i=0; i<pads.size(); ++i ) {
-    std::shared_ptr<car> c = std::make_shared<car>(vec2(1.5), i, std::make_shared<model>());
-    cars.push_back(c);
-    if( pads[i] ) {
-      std::shared_ptr<human_player> player;
-      switch( pads[i]->get_kind() ) {
-      case controllers::controller::kind::modern:
-        player = std::make_shared<modern_pad_player>(c, std::dynamic_pointer_cast<controllers::modern>(pads[i]));
-        break;
-      case controllers::controller::kind::classic:
-        player = std::make_shared<joystick_player>(c, std::dynamic_pointer_cast<controllers::classic>(pads[i]));
-        break;
-      default:
-        player = std::make_shared<pad_player>(c, pads[i]);
-        break;
+  race_events * events = &audio;
+  std::unique_ptr<race_stream_writer> stream;
+  if( !broadcast.empty() ) {
+    stream = race_stream_writer::open(broadcast, *events);
+    if( !stream ) {
+      return false;
+    }
+    events = stream.get();
+  }
+  std::unique_ptr<netplay_events> filtered;
+  if( session ) {
+    filtered = std::make_unique<netplay_events>(*events, session);
+    events = filtered.get();
+  }
+  race_sim sim(lvl, duration, *events);
+
+  if( session ) {
+    /* One car per cabinet, every one driven through the session. Ours
+       takes its controls from the first pad picked on the title
+       screen. */
+    std::shared_ptr<controllers::controller> pad;
+    for( auto p: pads ) {
+      if( p && !pad ) {
+        pad = p;
+      }
+    }
+    for( unsigned i=0; i<session->players(); ++i ) {
+      std::shared_ptr<car> c = sim.add_car();
+      sim.add_player(std::make_shared<remote_player>(c, session, i));
+      if( i == net->index && pad ) {
+        auto player = make_human_player(c, pad, false);
+        players.push_back(player);
+        event_handlers.push_back(player);
       }
-      players.push_back(player);
-      event_handlers.push_back(player);
-    } else {
-      auto ai = std::make_shared<ai_player>(c, lvl);
-      players.push_back(ai);
+    }
+  } else {
+    for( unsigned i=0; i<pads.size(); ++i ) {
+      std::shared_ptr<car> c = sim.add_car();
+      if( pads[i] ) {
+        auto player = make_human_player(c, pads[i], true);
+        players.push_back(player);
+        event_handlers.push_back(player);
+      } else {
+        auto ai = std::make_shared<ai_player>(c, lvl);
+        players.push_back(ai);
+      }
+      sim.add_player(players.back());
     }
   }
 
-  spawn_cars(cars, lvl);
+  sim.spawn();
 
-  unsigned last_frame = SDL_GetTicks();
-  race_start_sequence start(audio);
-  timer match_timer(30);
-  bool quit = false;
-  for( ;; ) {
-    unsigned const this_frame = SDL_GetTicks();
-    double const elapsed = (this_frame - last_frame)/1000.0;
-    last_frame = this_frame;
-
-    if( !start.complete() ) {
-      start.update(elapsed);
-    } else {
-      match_timer.update(elapsed);
-      if( match_timer.complete() ) {
-        break;
-      }
+  if( session ) {
+    std::cout << "Waiting for the other cabinets" << std::endl;
+    if( !session->connect(sim, 30) ) {
+      return false;
     }
+  }
 
-    SDL_Event evt;
-    while( SDL_PollEvent(&evt) ) {
-      if( !cs->handle_event(evt) ) {
-        if( evt.type == SDL_QUIT ) {
-          quit = true;
-        } else if( evt.type == SDL_KEYDOWN && evt.key.keysym.sym == SDLK_ESCAPE ) {
-          quit = true;
-        }
-      }
+  /* Only the human players need recording; the AI will do the same
+     thing again given the same race. Netplay races can't be recorded,
+     as rollbacks would rewrite what's already been recorded. */
+  std::shared_ptr<replay> recording;
+  if( !record.empty() && !session ) {
+    std::vector<bool> recorded;
+    for( auto p: players ) {
+      recorded.push_back(p->is_human());
     }
-    cs->update(static_cast<std::uint64_t>(elapsed * 1e9));
+    recording = std::make_shared<replay>(lvl->checksum(), 0, step, duration, recorded);
+    sim.set_recording(recording);
+  }
 
-    for( auto & event: cs->get_events() ) {
-      for( auto c: event_handlers ) {
-        if( c->handle_event(event) ) {
-          break;
-        }
+  /* Edits would spoil recordings, broadcasts and netplay races, which
+     all expect the track to stay the same; main() doesn't allow them
+     together */
+  std::shared_ptr<track_editor> editor;
+  if( !edit.empty() ) {
+    for( auto p: pads ) {
+      if( p && !editor ) {
+        editor = std::make_shared<track_editor>(lvl, p, edit);
       }
     }
+    if( editor ) {
+      event_handlers.insert(event_handlers.begin(), editor);
+    }
+  }
 
-    if( quit ) {
-      break;
+  bool const finished = run(r, sim, cs, event_handlers, step, ~0ul, session, stream.get(), editor.get());
+
+  if( recording ) {
+    recording->finish(sim.steps(), sim.checksum());
+    recording->save(record);
+  }
+
+  for( auto p: players ) {
+    if( p->is_human() ) {
+      new_hiscore(hiscores, p->score());
     }
+  }
 
-    for( auto p: players ) {
-      p->update(elapsed);
+  return finished;
+}
+
+bool replay_race(render &r,
+                 std::shared_ptr<replay const> recording,
+                 std::shared_ptr<controllers::collection> cs)
+{
+  auto lvl = level::load("res/track.dat");
+  if( lvl->checksum() != recording->track_checksum() ) {
+    std::cerr << "The replay was recorded on a different track" << std::endl;
+    return false;
+  }
+  if( recording->seed() != 0 ) {
+    std::cerr << "The replay was recorded by native-sim; replay it there" << std::endl;
+    return false;
+  }
+  race_audio audio(lvl);
+  race_sim sim(lvl, recording->duration(), audio);
+
+  for( unsigned i=0; i<recording->cars(); ++i ) {
+    std::shared_ptr<car> c = sim.add_car();
+    if( recording->recorded(i) ) {
+      sim.add_player(std::make_shared<replay_player>(c, recording, i));
+    } else {
+      sim.add_player(std::make_shared<ai_player>(c, lvl));
     }
+  }
+  sim.spawn();
+
+  bool const finished = run(r, sim, cs, {}, recording->step(), recording->steps(), nullptr, nullptr, nullptr);
+  if( finished && sim.checksum() != recording->final_checksum() ) {
+    std::cerr << "The replay finished differently to the race it recorded" << std::endl;
+  }
+  return finished;
+}
+
+bool spectate(render &r,
+              std::string const & source,
+              std::shared_ptr<controllers::collection> cs)
+{
+  auto input = race_stream_source::open(source);
+  if( !input ) {
+    return false;
+  }
+
+  auto lvl = level::load("res/track.dat");
+  race_audio audio(lvl);
+  race_view view(lvl);
+
+  race_stream_reader stream;
+  std::vector<std::shared_ptr<car>> cars;
+  std::vector<unsigned char> frame;
+  frame_state shown = {};
+
+  /* Frames are shown at the pace they were written, a frame behind,
+     drawing each car part way between the last two it was seen in. A
+     live race runs a frame behind too, so there's always the next one
+     to head for; if it doesn't turn up in time the cars wait where
+     they are. */
+  std::uint64_t const ticks_per_second = SDL_GetPerformanceFrequency();
+  std::uint64_t last_frame = SDL_GetPerformanceCounter();
+  double ahead = 0;
+  bool quit = false;
+  while( !stream.finished() ) {
+    std::uint64_t const this_frame = SDL_GetPerformanceCounter();
+    double const elapsed = (this_frame - last_frame)/static_cast<double>(ticks_per_second);
+    last_frame = this_frame;
 
-    glClear(GL_COLOR_BUFFER_BIT);
-    lvl->draw();
+    if( !handle_events(cs, {}, elapsed) ) {
+      quit = true;
+      break;
+    }
 
-    /* Disable the cars while the starting beeps are sounding */
-    if( start.complete() ) {
-      for( auto c: cars ) {
-        c->update(elapsed);
-        score_car(c, lvl);
+    ahead -= elapsed;
+    while( ahead <= 0 && !stream.finished() && input->next(frame) ) {
+      if( !stream.read(frame, audio) ) {
+        continue;
+      }
+      if( stream.track_checksum() != lvl->checksum() ) {
+        std::cerr << "The race is being run on a different track" << std::endl;
+        return false;
+      }
+      while( cars.size() < stream.cars().size() ) {
+        cars.push_back(std::make_shared<car>(sim_vec2(sim_real(1.5)), cars.size(), std::make_shared<model>()));
       }
+      for( std::size_t i=0; i<cars.size(); ++i ) {
+        auto const & view = stream.cars()[i];
+        cars[i]->store_previous();
+        cars[i]->set_pos(sim_vec2(view.pos));
+        cars[i]->set_theta(sim_real(view.theta));
+        cars[i]->set_score(view.score);
+        cars[i]->set_segment(view.segment);
+      }
+      /* Don't try to catch up on more than a second of live race at
+         once, after a stall */
+      ahead = std::max(ahead + stream.frame_seconds(), input->live() ? -1.0 : -stream.frame_seconds());
+    }
+    if( !input->live() && ahead <= 0 && !stream.finished() ) {
+      std::cerr << "The race stream ended early" << std::endl;
+      break;
     }
 
-    process_collisions(lvl, cars, audio);
+    double const alpha = stream.synced() && stream.frame_seconds() > 0
+      ? std::min(std::max(1 - ahead / stream.frame_seconds(), 0.0), 1.0) : 1;
 
+    shown.cars.clear();
     for( auto c: cars ) {
-      c->draw();
+      shown.cars.push_back({ c->state(), c->color() });
     }
-    draw_scores(cars, f2);
+    view.draw(r.batch(), shown, alpha);
 
     r.swap();
   }
@@ -284,12 +439,5 @@ bool race(render &r,
   for( auto c: cars ) {
     std::cout << "Score: "<<c->color()<<": "<<c->score()<<std::endl;
   }
-
-  for( auto p: players ) {
-    if( p->is_human() ) {
-      new_hiscore(hiscores, p->score());
-    }
-  }
-
   return !quit;
 }
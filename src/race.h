@@ -6,10 +6,13 @@
 #pragma once
 
 #include <memory>
+#include <string>
 #include <vector>
 
 class hiscore;
+struct netplay_config;
 class render;
+class replay;
 namespace controllers {
   class controller;
   class collection;
@@ -18,8 +21,31 @@ namespace controllers {
 /// Run one race, recording high scores. pads are the controllers
 /// selected for use by players on the title screen, while cs is the
 /// controller set which you need to keep updating to get controller
-/// events.
+/// events. If record isn't empty, a replay of the race is saved
+/// there. If net isn't null, the race is against other cabinets over
+/// the network, one car each, instead of against the AI. If broadcast
+/// isn't empty, the race is streamed there for spectate(), to a file
+/// or to udp:host:port. If edit isn't empty, the first pad can edit
+/// the track mid race (see track_editor), which is saved to and
+/// loaded from there.
 bool race(render &r,
           std::vector<hiscore>& hiscores,
           std::vector<std::shared_ptr<controllers::controller>>& pads,
-          std::shared_ptr<controllers::collection> cs);
+          std::shared_ptr<controllers::collection> cs,
+          std::string const & record,
+          netplay_config const * net,
+          std::string const & broadcast,
+          std::string const & edit);
+
+/// Play back a replay saved by race(). Returns false if it couldn't
+/// be played, or the player quit part way through.
+bool replay_race(render &r,
+                 std::shared_ptr<replay const> recording,
+                 std::shared_ptr<controllers::collection> cs);
+
+/// Watch a race streamed by race(), from a file or live from
+/// udp:port. Returns false if it couldn't be watched, or the player
+/// quit part way through.
+bool spectate(render &r,
+              std::string const & source,
+              std::shared_ptr<controllers::collection> cs);
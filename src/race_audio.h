@@ -6,6 +6,7 @@
 #pragma once
 
 #include "level.h"
+#include "race_events.h"
 #include "sound/emitter2d.h"
 #include "sound/sample.h"
 #include "sound/soundscape2d.h"
@@ -15,7 +16,7 @@
 #include <memory>
 
 /// A wrapper for the simple in-game audio.
-class race_audio {
+class race_audio: public race_events {
 public:
   race_audio(std::shared_ptr<level> lvl)
     : soundscape_(std::make_shared<soundscape2d>(rectangle(vec2::zero(), vec2(lvl->width(), lvl->height())),
@@ -26,7 +27,8 @@ public:
       tannoy_(std::make_shared<tannoy>(soundscape_))
   {}
 
-  void play_crash(vec2 const & pos, double vel) {
+public: // race_events
+  void on_crash(vec2 const & pos, double vel) {
     if( vel < 5  ) {
       return;
     }
@@ -47,7 +49,7 @@ public:
     emitter->play(crash_sound_);
   }
 
-  void play_starting_beep() {
+  void on_starting_beep() {
     tannoy_->play(beep_sound_);
   }
 
@@ -0,0 +1,19 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#pragma once
+
+#include "vec2.h"
+
+/// Things that happen during a race which the outside world might
+/// want to react to, for example by playing a sound. The default
+/// implementation ignores everything, which is what a headless
+/// simulation wants.
+class race_events {
+public:
+  virtual ~race_events() {}
+  virtual void on_starting_beep() {}
+  virtual void on_crash([[maybe_unused]] vec2 const & pos, [[maybe_unused]] double vel) {}
+};
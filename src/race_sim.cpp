@@ -0,0 +1,299 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#include "race_sim.h"
+
+#include "car.h"
+#include "checksum.h"
+#include "level.h"
+#include "model.h"
+#include "player.h"
+#include "race_events.h"
+#include "replay.h"
+
+#include <algorithm>
+
+race_sim::race_sim(std::shared_ptr<level> lvl, double duration, race_events & events)
+  : level_(lvl),
+    events_(events),
+    start_(events),
+    match_timer_(duration),
+    batched_(false),
+    steps_(0),
+    batch_(std::make_shared<car_batch>()),
+    max_iterations_(16),
+    tolerance_(sim_real(1e-4))
+{}
+
+std::shared_ptr<car> race_sim::add_car() {
+  auto c = std::make_shared<car>(sim_vec2(sim_real(1.5)), cars_.size(), std::make_shared<model>(), batch_);
+  cars_.push_back(c);
+  return c;
+}
+
+void race_sim::spawn() {
+  unsigned index = 0;
+
+  for ( unsigned j=0; j<level_->height(); ++j ) {
+    for( unsigned i=0; i<level_->width(); ++i ) {
+      if( level_->spawn_at(i, j) ) {
+        if( index == cars_.size() ) {
+          return;
+        }
+        {
+          const unsigned ix = index++;
+          cars_[ix]->set_pos( sim_vec2(i +sim_real(0.5), j+sim_real(0.5)));
+          cars_[ix]->set_vel( sim_vec2(0,0));
+          cars_[ix]->set_theta( sim_real(level_->steer_angle_at(i,j)));
+          cars_[ix]->store_previous();
+        }
+      }
+    }
+  }
+}
+
+void race_sim::step(double dt) {
+  ++steps_;
+  for( auto c: cars_ ) {
+    c->store_previous();
+  }
+
+  if( !start_.complete() ) {
+    start_.update(dt);
+  } else {
+    match_timer_.update(dt);
+    if( match_timer_.complete() ) {
+      return;
+    }
+  }
+
+  for( auto p: players_ ) {
+    p->update(dt);
+  }
+  if( recording_ ) {
+    recording_->record(steps_, cars_);
+  }
+  for( auto c: cars_ ) {
+    c->apply_twist();
+  }
+
+  /* Disable the cars while the starting beeps are sounding */
+  if( start_.complete() ) {
+    starts_.clear();
+    for( auto c: cars_ ) {
+      starts_.push_back(c->pos());
+    }
+
+    if( batched_ ) {
+      batch_->update(dt);
+    } else {
+      for( auto c: cars_ ) {
+        c->update(dt);
+      }
+    }
+    sweep_collisions();
+
+    for( auto c: cars_ ) {
+      score_car(*c);
+    }
+  }
+
+  process_collisions();
+}
+
+void race_sim::save(race_state & race, car_state * cars) const {
+  race.steps = steps_;
+  race.match_elapsed = match_timer_.elapsed();
+  race.start = start_.get_state();
+  for( std::size_t i=0; i<cars_.size(); ++i ) {
+    cars[i] = cars_[i]->state();
+  }
+}
+
+void race_sim::restore(race_state const & race, car_state const * cars) {
+  steps_ = race.steps;
+  match_timer_.set_elapsed(race.match_elapsed);
+  start_.set_state(race.start);
+  for( std::size_t i=0; i<cars_.size(); ++i ) {
+    cars_[i]->set_state(cars[i]);
+  }
+}
+
+std::uint32_t race_sim::checksum() const {
+  ::checksum sum;
+  race_start_sequence::state const start = start_.get_state();
+  sum.add(steps_);
+  sum.add(match_timer_.elapsed());
+  sum.add(start.seconds);
+  sum.add(start.elapsed);
+  for( auto c: cars_ ) {
+    car_state const s = c->state();
+    for( sim_vec2 const & v: { s.pos, s.heading, s.prev_pos, s.prev_heading, s.vel } ) {
+      sum.add(v.x());
+      sum.add(v.y());
+    }
+    sum.add(s.throttle);
+    sum.add(s.brake);
+    sum.add(s.turn);
+    sum.add(s.spin_timer);
+    sum.add(s.spin);
+    sum.add(s.segment);
+    sum.add(s.score);
+  }
+  return sum.value();
+}
+
+void race_sim::score_car(car & c) {
+  sim_vec2 const pos = c.pos();
+  unsigned const x = static_cast<unsigned>(pos.x());
+  unsigned const y = static_cast<unsigned>(pos.y());
+  unsigned const old_segment = c.segment();
+  unsigned const new_segment = level_->segment_at(x, y);
+  if( new_segment != old_segment ) {
+    if( new_segment == level::next_segment(old_segment) ) {
+      c.set_segment(level_->segment_at(x,y));
+      c.add_score(5);
+    }
+  }
+}
+
+/* A car that moves a long way in one step could pass straight
+   through an obstacle or another car, so sweep its collision shape
+   along the path it took, and pull it back to just after the first
+   contact; process_collisions() then sorts out the bounce. Slower cars
+   can't get far enough past anything to be a problem, and aren't
+   swept at all. */
+void race_sim::sweep_collisions() {
+  sim_real const skin = sim_real(1e-3);
+
+  impacts_.assign(cars_.size(), 1);
+  shapes_.clear();
+  for( std::size_t i=0; i<cars_.size(); ++i ) {
+    circle const shape(starts_[i], cars_[i]->collision_shape().radius());
+    sim_vec2 const motion = cars_[i]->pos() - starts_[i];
+    sim_real const distance = motion.mag();
+    if( distance > shape.radius() * sim_real(0.5) ) {
+      auto const t = level_->time_of_impact(shape, motion);
+      if( t ) {
+        impacts_[i] = std::min(impacts_[i], *t + skin / distance);
+      }
+    }
+    /* A circle that encloses the whole path, for the broadphase */
+    shapes_.emplace_back(starts_[i] + motion * sim_real(0.5), shape.radius() + distance * sim_real(0.5));
+  }
+
+  broadphase_.find_pairs(shapes_, [&](unsigned i, unsigned j) {
+    circle const a(starts_[i], cars_[i]->collision_shape().radius());
+    circle const b(starts_[j], cars_[j]->collision_shape().radius());
+    sim_vec2 const motion = (cars_[i]->pos() - starts_[i]) - (cars_[j]->pos() - starts_[j]);
+    sim_real const distance = motion.mag();
+    if( distance <= std::min(a.radius(), b.radius()) * sim_real(0.5) ) {
+      return;
+    }
+    auto const t = a.time_of_impact(motion, b);
+    if( t ) {
+      impacts_[i] = std::min(impacts_[i], *t + skin / distance);
+      impacts_[j] = std::min(impacts_[j], *t + skin / distance);
+    }
+  });
+
+  for( std::size_t i=0; i<cars_.size(); ++i ) {
+    if( impacts_[i] < 1 ) {
+      sim_vec2 const motion = cars_[i]->pos() - starts_[i];
+      cars_[i]->set_pos(starts_[i] + motion * impacts_[i]);
+    }
+  }
+}
+
+/* Push every car out of whatever it overlaps, and bounce it off.
+   Each pass can push cars into something else, so repeat until a pass
+   finds nothing deeper than the tolerance, but give up after
+   max_iterations_ passes so that a pile-up can't stall the step;
+   whatever is left over gets another go next step. */
+void race_sim::process_collisions() {
+  collisions_ = collision_stats();
+  collisions_.converged = false;
+  while( collisions_.iterations < max_iterations_ ) {
+    ++collisions_.iterations;
+    collisions_.residual_penetration = 0;
+    bool found = false;
+    for( auto c: cars_ ) {
+      if( resolve_level_contacts(*c) ) {
+        found = true;
+      }
+    }
+
+    /* Collisions with cars */
+    shapes_.clear();
+    for( auto c: cars_ ) {
+      shapes_.push_back(c->collision_shape());
+    }
+    broadphase_.find_pairs(shapes_, [&](unsigned i, unsigned j) {
+      car & c1 = *cars_[i];
+      car & c2 = *cars_[j];
+      circle const c1_shape = c1.collision_shape();
+      circle const c2_shape = c2.collision_shape();
+      sim_real const distance = c1_shape.intersection_distance(c2_shape);
+      if( distance < tolerance_ ) {
+        return;
+      }
+      sim_real const bounce = sim_real(0.5);
+      sim_vec2 const sep = c1_shape.separation_direction(c2_shape);
+      /* move out of collision */
+      c1.set_pos(c1.pos() + sep * distance * sim_real(0.5) );
+      c2.set_pos(c2.pos() - sep * distance * sim_real(0.5) );
+
+      /* bounce */
+      sim_real const closing_vel = c2.vel().dot(sep) - c1.vel().dot(sep);
+      sim_real const separating_vel = -closing_vel * bounce;
+      sim_real const dv = separating_vel - closing_vel;
+      c1.set_vel(c1.vel() - dv * sep * sim_real(0.5));
+      c2.set_vel(c2.vel() + dv * sep * sim_real(0.5));
+      c1.set_collided(closing_vel, c1.heading().cross(sep));
+      c2.set_collided(closing_vel, c2.heading().cross(sep));
+      events_.on_crash(vec2(c1.pos()), static_cast<double>(closing_vel));
+
+      record_contact(distance);
+      found = true;
+    });
+
+    if( !found ) {
+      collisions_.converged = true;
+      break;
+    }
+  }
+}
+
+/* Push c out of the obstacles it overlaps, one at a time, returning
+   whether there were any. Squeezed between two obstacles, it could be
+   pushed back and forth, so this is capped like the passes are. */
+bool race_sim::resolve_level_contacts(car & c) {
+  bool found = false;
+  circle shape = c.collision_shape();
+  for( unsigned i=0; i<max_iterations_; ++i ) {
+    auto const obstacle = level_->get_intersecting_shape(shape, tolerance_);
+    if( !obstacle ) {
+      break;
+    }
+    sim_real const bounce = sim_real(0.2);
+    sim_vec2 const sep = shape.separation_direction(*obstacle);
+    sim_real const distance = shape.intersection_distance(*obstacle);
+    /* move out of collision */
+    sim_real const closing_vel = -c.vel().dot(sep);
+    c.set_pos(c.pos() + sep * distance);
+    c.set_vel(c.vel() + (1 + bounce) * closing_vel * sep);
+    shape = c.collision_shape();
+    events_.on_crash(vec2(c.pos()), static_cast<double>(closing_vel));
+
+    record_contact(distance);
+    found = true;
+  }
+  return found;
+}
+
+void race_sim::record_contact(sim_real penetration) {
+  ++collisions_.contacts;
+  collisions_.residual_penetration = std::max(collisions_.residual_penetration, penetration);
+}
@@ -0,0 +1,155 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#pragma once
+
+#include "broadphase.h"
+#include "car_batch.h"
+#include "circle.h"
+#include "race_start_sequence.h"
+#include "sim_real.h"
+#include "timer.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+class car;
+struct car_state;
+class level;
+class player;
+class race_events;
+class replay;
+
+/// What the collision solver did during one step
+struct collision_stats {
+  /// Passes over all the contacts
+  unsigned iterations = 0;
+  /// Contacts resolved, counting a contact again each pass it's found
+  unsigned contacts = 0;
+  /// The deepest penetration found in the final pass. Within the
+  /// solver's tolerance unless it ran out of iterations.
+  sim_real residual_penetration = 0;
+  /// Whether the final pass found nothing left to resolve
+  bool converged = true;
+};
+
+/// Everything about a race_sim that changes as it runs, apart from
+/// its cars, as plain data
+struct race_state {
+  unsigned long steps;
+  double match_elapsed;
+  race_start_sequence::state start;
+};
+
+/// The simulation side of a race: the track, the cars on it and the
+/// players driving them, with no window, audio or GL involved. It is
+/// advanced in fixed steps; anything interesting that happens is
+/// reported through race_events.
+class race_sim {
+public:
+  race_sim(std::shared_ptr<level> lvl, double duration, race_events & events);
+
+  /// Add a new car to the race. Cars are coloured in the order they
+  /// are added.
+  std::shared_ptr<car> add_car();
+
+  void add_player(std::shared_ptr<player> p) {
+    players_.push_back(p);
+  }
+
+  /// Put every car on a spawn point, in the order they were added.
+  void spawn();
+
+  /// Advance the race by dt seconds.
+  void step(double dt);
+
+  /// How many times step() has been called
+  unsigned long steps() const {
+    return steps_;
+  }
+
+  /// Copy the state of the race into race, and of its cars into
+  /// cars, which must have room for every car. The players are
+  /// stateless, their decisions living on in the cars' controls, so
+  /// this is everything needed to carry on from here later.
+  void save(race_state & race, car_state * cars) const;
+
+  /// Put the race back to a state saved earlier, with the same cars
+  void restore(race_state const & race, car_state const * cars);
+
+  /// A hash of everything save() would copy, to check whether two
+  /// runs of a race are still in step
+  std::uint32_t checksum() const;
+
+  /// Step all the cars together with car_batch, rather than one at a
+  /// time with car::update. The cars keep their state in the batch
+  /// either way, so this can be changed at any step.
+  void set_batched(bool batched) {
+    batched_ = batched;
+  }
+
+  /// Record the controls of the cars rec says to, every step from now
+  /// on.
+  void set_recording(std::shared_ptr<replay> rec) {
+    recording_ = rec;
+  }
+
+  /// Limit the collision solver to max_iterations passes per step.
+  /// Overlaps of less than tolerance are left alone.
+  void set_solver_limits(unsigned max_iterations, sim_real tolerance) {
+    max_iterations_ = max_iterations;
+    tolerance_ = tolerance;
+  }
+
+  /// What the collision solver did during the last step
+  collision_stats const & last_collisions() const {
+    return collisions_;
+  }
+
+  /// Whether the starting beeps have finished, so the cars can move.
+  bool started() const {
+    return start_.complete();
+  }
+
+  /// Whether the race is over.
+  bool complete() const {
+    return match_timer_.complete();
+  }
+
+  std::shared_ptr<level> get_level() const {
+    return level_;
+  }
+
+  std::vector<std::shared_ptr<car>> const & cars() const {
+    return cars_;
+  }
+
+private:
+  void score_car(car & c);
+  void sweep_collisions();
+  void process_collisions();
+  bool resolve_level_contacts(car & c);
+  void record_contact(sim_real penetration);
+
+  std::shared_ptr<level> level_;
+  race_events & events_;
+  std::vector<std::shared_ptr<car>> cars_;
+  std::vector<std::shared_ptr<player>> players_;
+  std::shared_ptr<replay> recording_;
+  race_start_sequence start_;
+  timer match_timer_;
+  bool batched_;
+  unsigned long steps_;
+  /* Every car's driving state, which the cars read and write in place */
+  std::shared_ptr<car_batch> batch_;
+  broadphase broadphase_;
+  std::vector<circle> shapes_;
+  std::vector<sim_vec2> starts_;
+  std::vector<sim_real> impacts_;
+  unsigned max_iterations_;
+  sim_real tolerance_;
+  collision_stats collisions_;
+};
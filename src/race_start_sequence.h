@@ -5,17 +5,23 @@
 */
 #pragma once
 
-#include "race_audio.h"
+#include "race_events.h"
 #include "timer.h"
 
 /// A little helper to track beeping three times before the race
 /// starts
 class race_start_sequence {
 public:
-  race_start_sequence(race_audio & audio)
+  /// Where the sequence has got to, as plain data
+  struct state {
+    unsigned seconds;
+    double elapsed;
+  };
+
+  race_start_sequence(race_events & events)
     : seconds_(0),
       timer_(1),
-      audio_(audio)
+      events_(events)
   {
     timer_.expire();
   }
@@ -28,13 +34,22 @@ public:
     if( timer_.complete() ) {
       seconds_++;
       if( seconds_ < 4 ) {
-        audio_.play_starting_beep();
+        events_.on_starting_beep();
         timer_.reset();
       }
     }
   }
+
+  state get_state() const {
+    return { seconds_, timer_.elapsed() };
+  }
+  void set_state(state const & s) {
+    seconds_ = s.seconds;
+    timer_.set_elapsed(s.elapsed);
+  }
+
 private:
   unsigned seconds_;
   timer timer_;
-  race_audio & audio_;
+  race_events & events_;
 };
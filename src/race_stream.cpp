@@ -0,0 +1,460 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#include "race_stream.h"
+
+#include "car.h"
+#include "level.h"
+#include "race_sim.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+
+/* A file starts with this and a version number, and then holds each
+   frame as its length and its bytes. Over UDP each datagram is one
+   frame, as it would be in the file.
+
+   A frame is its kind and sequence number, then:
+
+   key: the track's checksum, the step length, the step number, the
+   number of cars, then each car's position, heading, score and
+   segment.
+
+   delta: the number of steps since the last frame, then each car's
+   position and heading, as the difference from where they would be
+   if the car carried on as it did over the last frame.
+
+   end: as delta, for the last frame of the race.
+
+   Then both have the events since the last frame. Everything is a
+   varint, zigzagged where it can be negative, except the checksum and
+   the step length. */
+static char const magic[4] = { 'N', 'X', 'S', 'S' };
+static unsigned const version = 1;
+
+enum frame_kind : unsigned char { key_frame = 0, delta_frame = 1, end_frame = 2 };
+enum event_kind : unsigned char { beep_event = 0, crash_event = 1, segment_event = 2 };
+
+/* Units of a cell, and of a turn, that positions and headings are
+   rounded to */
+static double const position_scale = 256;
+static std::int32_t const turn_steps = 4096;
+/* Crash positions and speeds only place a sound, so are rougher */
+static double const crash_scale = 16;
+
+/* A key frame every this many frames */
+static unsigned const key_interval = 60;
+
+static void write_varint(std::vector<unsigned char> & out, std::uint64_t value) {
+  while( value >= 0x80 ) {
+    out.push_back(static_cast<unsigned char>(value | 0x80));
+    value >>= 7;
+  }
+  out.push_back(static_cast<unsigned char>(value));
+}
+
+static void write_signed(std::vector<unsigned char> & out, std::int64_t value) {
+  write_varint(out, (static_cast<std::uint64_t>(value) << 1) ^ static_cast<std::uint64_t>(value >> 63));
+}
+
+static void write_fixed(std::vector<unsigned char> & out, std::uint64_t value, unsigned bytes) {
+  for( unsigned i=0; i<bytes; ++i ) {
+    out.push_back(static_cast<unsigned char>(value >> (8*i)));
+  }
+}
+
+/* Headings are kept modulo a turn, and their differences between -half
+   and +half a turn */
+static std::int32_t wrap_turn(std::int32_t value) {
+  return ((value % turn_steps) + turn_steps) % turn_steps;
+}
+
+static std::int32_t wrap_half_turn(std::int32_t value) {
+  return wrap_turn(value + turn_steps/2) - turn_steps/2;
+}
+
+namespace {
+
+/* Reads back what the write_ functions wrote, remembering if it ever
+   runs off the end */
+class reader {
+public:
+  reader(std::vector<unsigned char> const & data)
+    : data_(data),
+      pos_(0),
+      ok_(true)
+  {}
+
+  std::uint64_t varint() {
+    std::uint64_t value = 0;
+    for( unsigned shift=0; shift<64; shift+=7 ) {
+      if( pos_ >= data_.size() ) {
+        ok_ = false;
+        return 0;
+      }
+      unsigned char const byte = data_[pos_++];
+      value |= static_cast<std::uint64_t>(byte & 0x7F) << shift;
+      if( !(byte & 0x80) ) {
+        return value;
+      }
+    }
+    ok_ = false;
+    return 0;
+  }
+
+  std::int64_t signed_varint() {
+    std::uint64_t const value = varint();
+    return static_cast<std::int64_t>(value >> 1) ^ -static_cast<std::int64_t>(value & 1);
+  }
+
+  std::uint64_t fixed(unsigned bytes) {
+    if( pos_ + bytes > data_.size() ) {
+      ok_ = false;
+      return 0;
+    }
+    std::uint64_t value = 0;
+    for( unsigned i=0; i<bytes; ++i ) {
+      value |= static_cast<std::uint64_t>(data_[pos_++]) << (8*i);
+    }
+    return value;
+  }
+
+  bool ok() const {
+    return ok_;
+  }
+
+  bool done() const {
+    return pos_ == data_.size();
+  }
+
+  /// How many bytes are still to be read
+  std::size_t left() const {
+    return data_.size() - std::min(pos_, data_.size());
+  }
+
+private:
+  std::vector<unsigned char> const & data_;
+  std::size_t pos_;
+  bool ok_;
+};
+
+}
+
+std::unique_ptr<race_stream_writer> race_stream_writer::open(std::string const & destination,
+                                                             race_events & forward,
+                                                             unsigned steps_per_frame) {
+  std::unique_ptr<race_stream_writer> writer(new race_stream_writer(forward, std::max(1u, steps_per_frame)));
+  if( destination.compare(0, 4, "udp:") == 0 ) {
+    if( !udp_socket::resolve(destination.substr(4), writer->address_) ) {
+      return nullptr;
+    }
+    writer->socket_ = udp_socket::open(0);
+    if( !writer->socket_ ) {
+      return nullptr;
+    }
+  } else {
+    writer->file_.open(destination, std::ios::binary);
+    if( !writer->file_ ) {
+      std::cerr << "Couldn't write " << destination << std::endl;
+      return nullptr;
+    }
+    std::vector<unsigned char> header(magic, magic + sizeof(magic));
+    write_varint(header, version);
+    writer->file_.write(reinterpret_cast<char const *>(header.data()), header.size());
+    writer->bytes_ += header.size();
+  }
+  return writer;
+}
+
+void race_stream_writer::update(race_sim const & sim, double step) {
+  if( frames_ == 0 || sim.steps() >= last_step_ + steps_per_frame_ ) {
+    write_frame(sim, step, false);
+  }
+}
+
+void race_stream_writer::finish(race_sim const & sim, double step) {
+  if( frames_ == 0 ) {
+    write_frame(sim, step, false);
+  }
+  write_frame(sim, step, true);
+}
+
+void race_stream_writer::on_starting_beep() {
+  events_.push_back(beep_event);
+  ++event_count_;
+  forward_.on_starting_beep();
+}
+
+void race_stream_writer::on_crash(vec2 const & pos, double vel) {
+  events_.push_back(crash_event);
+  write_varint(events_, static_cast<std::uint64_t>(std::max(0l, std::lround(pos.x() * crash_scale))));
+  write_varint(events_, static_cast<std::uint64_t>(std::max(0l, std::lround(pos.y() * crash_scale))));
+  write_varint(events_, static_cast<std::uint64_t>(std::max(0l, std::lround(vel * crash_scale))));
+  ++event_count_;
+  forward_.on_crash(pos, vel);
+}
+
+void race_stream_writer::write_frame(race_sim const & sim, double step, bool last) {
+  auto const & cars = sim.cars();
+  bool const key = frames_ % key_interval == 0 && !last;
+  if( sent_.size() != cars.size() ) {
+    sent_.resize(cars.size());
+  }
+
+  std::vector<unsigned char> frame;
+  frame.push_back(key ? key_frame : last ? end_frame : delta_frame);
+  write_varint(frame, frames_);
+  if( key ) {
+    write_fixed(frame, sim.get_level()->checksum(), 4);
+    std::uint64_t step_bits;
+    std::memcpy(&step_bits, &step, sizeof(step_bits));
+    write_fixed(frame, step_bits, 8);
+    write_varint(frame, sim.steps());
+    write_varint(frame, cars.size());
+  } else {
+    write_varint(frame, sim.steps() - last_step_);
+  }
+
+  for( std::size_t i=0; i<cars.size(); ++i ) {
+    car const & c = *cars[i];
+    sent & s = sent_[i];
+    vec2 const pos(c.pos());
+    std::int32_t const x = static_cast<std::int32_t>(std::lround(pos.x() * position_scale));
+    std::int32_t const y = static_cast<std::int32_t>(std::lround(pos.y() * position_scale));
+    std::int32_t const theta = wrap_turn(static_cast<std::int32_t>(
+      std::lround(static_cast<double>(c.theta()) * turn_steps / (2*M_PI))));
+    if( key ) {
+      write_signed(frame, x);
+      write_signed(frame, y);
+      write_varint(frame, static_cast<std::uint64_t>(theta));
+      write_varint(frame, c.score());
+      write_varint(frame, c.segment());
+      s.prev_x = x;
+      s.prev_y = y;
+      s.prev_theta = theta;
+    } else {
+      write_signed(frame, x - (2*s.x - s.prev_x));
+      write_signed(frame, y - (2*s.y - s.prev_y));
+      write_signed(frame, wrap_half_turn(theta - (2*s.theta - s.prev_theta)));
+      s.prev_x = s.x;
+      s.prev_y = s.y;
+      s.prev_theta = s.theta;
+
+      /* Key frames carry scores and segments themselves */
+      if( c.segment() != s.segment ) {
+        events_.push_back(segment_event);
+        write_varint(events_, i);
+        write_varint(events_, c.segment());
+        write_varint(events_, c.score());
+        ++event_count_;
+      }
+    }
+    s.x = x;
+    s.y = y;
+    s.theta = theta;
+    s.segment = c.segment();
+  }
+
+  write_varint(frame, event_count_);
+  frame.insert(frame.end(), events_.begin(), events_.end());
+  events_.clear();
+  event_count_ = 0;
+
+  if( socket_ ) {
+    socket_->send(address_, frame);
+  } else {
+    std::vector<unsigned char> length;
+    write_varint(length, frame.size());
+    file_.write(reinterpret_cast<char const *>(length.data()), length.size());
+    file_.write(reinterpret_cast<char const *>(frame.data()), frame.size());
+    bytes_ += length.size();
+    if( last ) {
+      file_.flush();
+    }
+  }
+  bytes_ += frame.size();
+  ++frames_;
+  last_step_ = sim.steps();
+}
+
+bool race_stream_reader::read(std::vector<unsigned char> const & frame, race_events & events) {
+  reader in(frame);
+  unsigned const kind = static_cast<unsigned>(in.fixed(1));
+  unsigned long const sequence = in.varint();
+  if( !in.ok() || kind > end_frame ) {
+    return false;
+  }
+  if( kind != key_frame && (!synced_ || sequence != sequence_ + 1) ) {
+    synced_ = false;
+    return false;
+  }
+
+  /* Work on copies, so that a corrupt frame changes nothing */
+  std::vector<known> cars = known_;
+  std::vector<car_view> views = views_;
+  std::uint32_t track = track_checksum_;
+  double step = step_;
+  unsigned long steps = steps_;
+  unsigned long frame_steps = frame_steps_;
+  std::size_t count;
+  if( kind == key_frame ) {
+    track = static_cast<std::uint32_t>(in.fixed(4));
+    std::uint64_t const step_bits = in.fixed(8);
+    std::memcpy(&step, &step_bits, sizeof(step));
+    unsigned long const new_steps = in.varint();
+    frame_steps = synced_ && new_steps > steps ? new_steps - steps : 0;
+    steps = new_steps;
+    count = in.varint();
+    if( !in.ok() || count > 1024 ) {
+      return false;
+    }
+    cars.resize(count);
+    views.resize(count);
+  } else {
+    frame_steps = in.varint();
+    steps += frame_steps;
+    count = cars.size();
+  }
+
+  for( std::size_t i=0; i<count; ++i ) {
+    known & k = cars[i];
+    std::int32_t x, y, theta;
+    if( kind == key_frame ) {
+      x = static_cast<std::int32_t>(in.signed_varint());
+      y = static_cast<std::int32_t>(in.signed_varint());
+      theta = wrap_turn(static_cast<std::int32_t>(in.varint()));
+      views[i].score = static_cast<unsigned>(in.varint());
+      views[i].segment = static_cast<unsigned>(in.varint());
+      k.prev_x = x;
+      k.prev_y = y;
+      k.prev_theta = theta;
+    } else {
+      x = static_cast<std::int32_t>(in.signed_varint() + (2*k.x - k.prev_x));
+      y = static_cast<std::int32_t>(in.signed_varint() + (2*k.y - k.prev_y));
+      theta = wrap_turn(static_cast<std::int32_t>(in.signed_varint() + (2*k.theta - k.prev_theta)));
+      k.prev_x = k.x;
+      k.prev_y = k.y;
+      k.prev_theta = k.theta;
+    }
+    k.x = x;
+    k.y = y;
+    k.theta = theta;
+    views[i].pos = vec2(x / position_scale, y / position_scale);
+    views[i].theta = theta * (2*M_PI) / turn_steps;
+  }
+
+  /* Check the events all read before acting on any of them */
+  struct event {
+    unsigned kind;
+    std::uint64_t a, b, c;
+  };
+  /* Every event takes at least a byte, so a count that claims more
+     than are left is corrupt, and mustn't be allocated for */
+  std::uint64_t const happened_count = in.varint();
+  if( !in.ok() || happened_count > in.left() ) {
+    return false;
+  }
+  std::vector<event> happened(happened_count);
+  for( auto & e: happened ) {
+    e.kind = static_cast<unsigned>(in.fixed(1));
+    if( e.kind == crash_event || e.kind == segment_event ) {
+      e.a = in.varint();
+      e.b = in.varint();
+      e.c = in.varint();
+    } else if( e.kind != beep_event ) {
+      return false;
+    }
+    if( !in.ok() || (e.kind == segment_event && e.a >= count) ) {
+      return false;
+    }
+  }
+  if( !in.ok() || !in.done() ) {
+    return false;
+  }
+
+  for( auto const & e: happened ) {
+    switch( e.kind ) {
+    case beep_event:
+      events.on_starting_beep();
+      break;
+    case crash_event:
+      events.on_crash(vec2(e.a / crash_scale, e.b / crash_scale), e.c / crash_scale);
+      break;
+    case segment_event:
+      views[e.a].segment = static_cast<unsigned>(e.b);
+      views[e.a].score = static_cast<unsigned>(e.c);
+      break;
+    }
+  }
+
+  known_ = cars;
+  views_ = views;
+  track_checksum_ = track;
+  step_ = step;
+  steps_ = steps;
+  frame_steps_ = frame_steps;
+  sequence_ = sequence;
+  synced_ = true;
+  finished_ = kind == end_frame;
+  return true;
+}
+
+std::unique_ptr<race_stream_source> race_stream_source::open(std::string const & source) {
+  std::unique_ptr<race_stream_source> res(new race_stream_source());
+  if( source.compare(0, 4, "udp:") == 0 ) {
+    char const *first = source.c_str() + 4;
+    char const *last = source.c_str() + source.size();
+    unsigned port = 0;
+    auto const parsed = std::from_chars(first, last, port);
+    if( parsed.ec != std::errc() || parsed.ptr != last || port == 0 || port > 0xFFFF ) {
+      std::cerr << "Expected udp:PORT, not " << source << std::endl;
+      return nullptr;
+    }
+    res->socket_ = udp_socket::open(static_cast<unsigned short>(port));
+    if( !res->socket_ ) {
+      return nullptr;
+    }
+    return res;
+  }
+
+  res->file_.open(source, std::ios::binary | std::ios::ate);
+  res->file_size_ = static_cast<std::uint64_t>(std::max<std::streamoff>(res->file_.tellg(), 0));
+  res->file_.seekg(0);
+  char header[sizeof(magic) + 1];
+  if( !res->file_.read(header, sizeof(header)) ||
+      std::memcmp(header, magic, sizeof(magic)) != 0 || static_cast<unsigned char>(header[4]) != version ) {
+    std::cerr << source << " isn't a race stream this version can read" << std::endl;
+    return nullptr;
+  }
+  return res;
+}
+
+bool race_stream_source::next(std::vector<unsigned char> & frame) {
+  if( socket_ ) {
+    return socket_->receive(frame);
+  }
+
+  std::uint64_t length = 0;
+  for( unsigned shift=0; ; shift+=7 ) {
+    int const byte = file_.get();
+    if( byte == std::char_traits<char>::eof() || shift >= 64 ) {
+      return false;
+    }
+    length |= static_cast<std::uint64_t>(byte & 0x7F) << shift;
+    if( !(byte & 0x80) ) {
+      break;
+    }
+  }
+  std::streamoff const here = file_.tellg();
+  if( here < 0 || length > file_size_ - static_cast<std::uint64_t>(here) ) {
+    std::cerr << "A race stream frame runs past the end of the file" << std::endl;
+    return false;
+  }
+  frame.resize(length);
+  return static_cast<bool>(file_.read(reinterpret_cast<char *>(frame.data()), length));
+}
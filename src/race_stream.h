@@ -0,0 +1,176 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#pragma once
+
+#include "race_events.h"
+#include "udp_socket.h"
+#include "vec2.h"
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+class race_sim;
+
+/// Writes a race out as it happens, for spectators to watch without
+/// running a simulation of their own: where each car is, which way
+/// it's pointing, its score, and the crashes, beeps and segment
+/// crossings in between.
+///
+/// The race is sent as a frame every few steps. Positions are rounded
+/// to 1/256 of a cell and headings to 1/4096 of a turn, and each is
+/// sent as how far it is from where it would be if it carried on as it
+/// did over the last frame, so a car driving steadily costs a byte or
+/// so per value. Every couple of seconds there's a key frame of
+/// absolute values instead, which spectators who join late or lose a
+/// frame can start from. Eight cars come to around 1KB/s.
+///
+/// It sits in front of whatever else wants the race's events, and
+/// passes them on.
+class race_stream_writer: public race_events {
+public:
+  /// Write to a file, or to udp:host:port as one datagram per frame.
+  /// Returns nothing, after saying why, if that can't be opened.
+  static std::unique_ptr<race_stream_writer> open(std::string const & destination, race_events & forward,
+                                                  unsigned steps_per_frame = 4);
+
+  /// Write a frame of sim, if it has moved on far enough since the
+  /// last. step is the length of each step, in seconds.
+  void update(race_sim const & sim, double step);
+
+  /// Write the last frame, saying the race is over
+  void finish(race_sim const & sim, double step);
+
+  /// How much has been written
+  std::size_t bytes() const {
+    return bytes_;
+  }
+  unsigned long frames() const {
+    return frames_;
+  }
+
+public: // race_events
+  void on_starting_beep();
+  void on_crash(vec2 const & pos, double vel);
+
+private:
+  race_stream_writer(race_events & forward, unsigned steps_per_frame)
+    : forward_(forward),
+      steps_per_frame_(steps_per_frame),
+      last_step_(0),
+      frames_(0),
+      bytes_(0),
+      event_count_(0)
+  {}
+
+  void write_frame(race_sim const & sim, double step, bool last);
+
+  race_events & forward_;
+  unsigned steps_per_frame_;
+  unsigned long last_step_;
+  unsigned long frames_;
+  std::size_t bytes_;
+  /// The events since the last frame, ready written
+  std::vector<unsigned char> events_;
+  unsigned event_count_;
+  /// What the spectators have been sent so far, per car
+  struct sent {
+    std::int32_t x, y, theta;
+    std::int32_t prev_x, prev_y, prev_theta;
+    unsigned segment;
+  };
+  std::vector<sent> sent_;
+  std::ofstream file_;
+  std::unique_ptr<udp_socket> socket_;
+  sockaddr_in address_;
+};
+
+/// Rebuilds a race from the frames race_stream_writer writes
+class race_stream_reader {
+public:
+  /// A car as the stream last showed it
+  struct car_view {
+    vec2 pos;
+    double theta;
+    unsigned score;
+    unsigned segment;
+  };
+
+  /// Apply one frame, passing its events on to events. Returns false
+  /// if it can't be used: if it's corrupt, or follows one that went
+  /// missing, in which case frames are ignored until the next key
+  /// frame.
+  bool read(std::vector<unsigned char> const & frame, race_events & events);
+
+  /// Whether a key frame has been seen, so the cars are known
+  bool synced() const {
+    return synced_;
+  }
+
+  /// Only meaningful once synced
+  std::uint32_t track_checksum() const {
+    return track_checksum_;
+  }
+  /// The race time the last frame covered, in seconds
+  double frame_seconds() const {
+    return frame_steps_ * step_;
+  }
+  unsigned long step() const {
+    return steps_;
+  }
+  /// Whether the race is over
+  bool finished() const {
+    return finished_;
+  }
+  std::vector<car_view> const & cars() const {
+    return views_;
+  }
+
+private:
+  struct known {
+    std::int32_t x, y, theta;
+    std::int32_t prev_x, prev_y, prev_theta;
+  };
+
+  bool synced_ = false;
+  bool finished_ = false;
+  std::uint32_t track_checksum_ = 0;
+  double step_ = 0;
+  unsigned long sequence_ = 0;
+  unsigned long steps_ = 0;
+  unsigned long frame_steps_ = 0;
+  std::vector<known> known_;
+  std::vector<car_view> views_;
+};
+
+/// Where race_stream_reader's frames come from: a file, or udp:port
+/// for a live race
+class race_stream_source {
+public:
+  /// Returns nothing, after saying why, if source can't be opened
+  static std::unique_ptr<race_stream_source> open(std::string const & source);
+
+  /// Fetch the next frame, returning false if there isn't one yet, or
+  /// a file has run out or is corrupt
+  bool next(std::vector<unsigned char> & frame);
+
+  /// Whether frames arrive as the race happens, rather than all being
+  /// there already
+  bool live() const {
+    return socket_ != nullptr;
+  }
+
+private:
+  race_stream_source() = default;
+
+  std::ifstream file_;
+  /* How long the file is, so a corrupt frame length can't ask for
+     more than it holds */
+  std::uint64_t file_size_ = 0;
+  std::unique_ptr<udp_socket> socket_;
+};
@@ -0,0 +1,90 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#include "race_view.h"
+
+#include "car.h"
+#include "draw_batch.h"
+#include "frame_state.h"
+#include "level.h"
+#include "render_helpers.h"
+
+#include <GL/gl.h>
+
+#include <cmath>
+#include <iomanip>
+#include <sstream>
+
+race_view::race_view(std::shared_ptr<level> lvl)
+  : lvl_(lvl),
+    view_(lvl),
+    font_("res/CourierPrime-Regular.ttf", 300),
+    editor_label_(font_)
+{}
+
+void race_view::draw(draw_batch & batch, frame_state const & frame, double alpha)
+{
+  for( auto const & edit: frame.edits ) {
+    lvl_->set_raw(edit.layer, edit.x, edit.y, edit.value);
+  }
+
+  batch.set_projection(-7.0/18*lvl_->width(), (25.0/18*lvl_->width()), lvl_->height(), 0);
+  glClear(GL_COLOR_BUFFER_BIT);
+  view_.draw(batch, frame.editor ? std::optional<unsigned>(frame.editor->layer) : std::nullopt);
+
+  for( auto const & c: frame.cars ) {
+    car::draw(batch, model_, c.state, c.color, alpha);
+  }
+  draw_scores_(batch, frame);
+
+  if( frame.editor ) {
+    /* The cursor, and what it paints */
+    double const x = frame.editor->x;
+    double const y = frame.editor->y;
+    vec2 const corners[4] = { vec2(x, y), vec2(x + 1, y), vec2(x + 1, y + 1), vec2(x, y + 1) };
+    batch.set_color({ 1.0f, 0.0f, 1.0f, 1.0f });
+    batch.line_loop(corners, 4);
+    editor_label_.set(frame.editor->label);
+    editor_label_.draw_to_height(batch, vec2(x + 1.5, y), 1);
+  }
+}
+
+/* Each car's score, down the side of the track */
+void race_view::draw_scores_(draw_batch & batch, frame_state const & frame)
+{
+  auto const & cars = frame.cars;
+  unsigned const per_side = (cars.size() + 1)/2;
+
+  batch.push();
+  batch.set_projection(-7.0/18, 25.0/18, 1, 0);
+
+  while( scores_.size() < cars.size() ) {
+    scores_.emplace_back(font_);
+  }
+  for( std::size_t i=0; i<cars.size(); ++i ) {
+    unsigned const side = i < per_side ? 0 : 1;
+    unsigned const index = i % per_side;
+    batch.push();
+    batch.scale(1.0/ per_side, 1.0/per_side);
+    batch.translate(side ? 0 : per_side, index + 1 - (double)side);
+    batch.rotate((side ? 1 : -1) * M_PI/2);
+    batch.scale(0.25, 0.25);
+    batch.translate(1, 0);
+
+    score & s = scores_[i];
+    if( s.shown != cars[i].state.score ) {
+      s.shown = cars[i].state.score;
+      std::stringstream ss;
+      ss << std::setw(2) << std::setfill('0') << *s.shown;
+      s.label.set(ss.str());
+    }
+    batch.set_color(car_color(cars[i].color));
+    s.label.draw_to_height(batch, vec2(0, 0), 1);
+
+    batch.pop();
+  }
+
+  batch.pop();
+}
@@ -0,0 +1,56 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#pragma once
+
+#include "font.h"
+#include "level_view.h"
+#include "model.h"
+
+#include <memory>
+#include <optional>
+#include <vector>
+
+class draw_batch;
+class level;
+struct frame_state;
+
+/// Draws a race from frame_states: the track, the cars, their scores
+/// and the track editor. What it draws with belongs to the GL context
+/// that's current when it's made, so it has to stay on that thread.
+class race_view {
+public:
+  /// lvl is the track the race is on, or a clone of it if the race is
+  /// on another thread. Cells painted in the frames drawn are painted
+  /// on it too.
+  explicit race_view(std::shared_ptr<level> lvl);
+
+  race_view(race_view const &) = delete;
+  race_view& operator=(race_view const &) = delete;
+
+  /// Draw frame, with the cars alpha of the way from their previous
+  /// states to their current ones
+  void draw(draw_batch & batch, frame_state const & frame, double alpha);
+
+private:
+  /* A score's text is only made again when the score changes */
+  struct score {
+    explicit score(font const & f)
+      : label(f)
+    {}
+
+    std::optional<unsigned> shown;
+    text label;
+  };
+
+  void draw_scores_(draw_batch & batch, frame_state const & frame);
+
+  std::shared_ptr<level> lvl_;
+  level_view view_;
+  model model_;
+  font font_;
+  std::vector<score> scores_;
+  text editor_label_;
+};
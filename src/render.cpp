@@ -13,10 +13,7 @@
 static SDL_GLContext init_gl(SDL_Window *win) {
   SDL_GLContext ctx = SDL_GL_CreateContext(win);
 
-  glShadeModel(GL_FLAT);
   glClearColor(0, 0, 0, 0);
-  glEnable(GL_LINE_SMOOTH);
-  glHint(GL_LINE_SMOOTH_HINT, GL_NICEST);
   glEnable(GL_BLEND);
   glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
@@ -39,9 +36,14 @@ render::render(std::string const &title)
     crash();
   }
   ctx_ = init_gl(win_);
+  int w, h;
+  SDL_GetWindowSize(win_, &w, &h);
+  batch_ = std::make_unique<draw_batch>(w, h);
 }
 
 render::~render() {
+  /* The batch's buffers belong to the context */
+  batch_.reset();
   if( ctx_ ) {
     SDL_GL_DeleteContext(ctx_);
   }
@@ -51,5 +53,17 @@ render::~render() {
 }
 
 void render::swap() {
+  batch_->flush();
   SDL_GL_SwapWindow(win_);
 }
+
+void render::make_current() {
+  if( SDL_GL_MakeCurrent(win_, ctx_) != 0 ) {
+    std::cerr << "Failed to make the GL context current: "<<SDL_GetError() <<std::endl;
+    crash();
+  }
+}
+
+void render::release_context() {
+  SDL_GL_MakeCurrent(win_, NULL);
+}
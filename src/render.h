@@ -5,20 +5,33 @@
 */
 #pragma once
 
+#include "draw_batch.h"
+
 #include <SDL.h>
 
 #include <memory>
 
 /// This object owns our render context, so that it gets automatically
-/// cleaned up on exit.
+/// cleaned up on exit, and the batch that everything is drawn through.
 class render {
  public:
   render(std::string const &window_title);
   ~render();
 
+  draw_batch & batch() {
+    return *batch_;
+  }
+
+  /// Flush the batch and show what's been drawn
   void swap();
 
+  /// Make the GL context current on this thread, for drawing from
+  /// here, having released it from wherever it was current before
+  void make_current();
+  void release_context();
+
  private:
   SDL_Window * win_;
   SDL_GLContext ctx_;
+  std::unique_ptr<draw_batch> batch_;
 };
@@ -5,33 +5,24 @@
 */
 #pragma once
 
+#include "draw_batch.h"
 #include "error.h"
 
 #include <GL/gl.h>
 
-#include <cmath>
 #include <iostream>
 
-/// Set one of the 8 car colours as the GL draw color
-inline void set_color(unsigned color) {
+/// One of the 8 car colours
+inline rgba car_color(unsigned color) {
   switch(color & 7) {
-  case 0: glColor3d(1.0, 0.0, 0.0); break; // Red
-  case 1: glColor3d(0.0, 1.0, 0.0); break; // Green
-  case 2: glColor3d(0.2, 0.2, 1.0); break; // Blue
-  case 3: glColor3d(1.0, 0.0, 1.0); break; // Purple
-  case 4: glColor3d(1.0, 1.0, 0.0); break; // Yellow
-  case 5: glColor3d(0.0, 1.0, 1.0); break; // Cyan
-  case 6: glColor3d(1.0, 1.0, 1.0); break; // White
-  case 7: glColor3d(1.0, 0.5, 0.5); break; // Pink
-  }
-}
-
-/// Call glVertex for a given number of points on a circle
-inline void circle_vertices(double x, double y, double r, unsigned points) {
-  double const step = 2 * M_PI / points;
-  for( unsigned k=0; k<points; ++k ) {
-    double const angle = k * step;
-    glVertex3d( std::cos(angle) * r + x, std::sin(angle)*r + y, 0);
+  case 0: return { 1.0f, 0.0f, 0.0f, 1.0f }; // Red
+  case 1: return { 0.0f, 1.0f, 0.0f, 1.0f }; // Green
+  case 2: return { 0.2f, 0.2f, 1.0f, 1.0f }; // Blue
+  case 3: return { 1.0f, 0.0f, 1.0f, 1.0f }; // Purple
+  case 4: return { 1.0f, 1.0f, 0.0f, 1.0f }; // Yellow
+  case 5: return { 0.0f, 1.0f, 1.0f, 1.0f }; // Cyan
+  case 6: return { 1.0f, 1.0f, 1.0f, 1.0f }; // White
+  default: return { 1.0f, 0.5f, 0.5f, 1.0f }; // Pink
   }
 }
 
@@ -0,0 +1,73 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#include "render_thread.h"
+
+#include "race_view.h"
+#include "render.h"
+
+#include <SDL.h>
+
+#include <utility>
+
+render_thread::render_thread(render & r, std::shared_ptr<level> lvl)
+  : r_(r),
+    lvl_(lvl),
+    ticks_per_second_(SDL_GetPerformanceFrequency()),
+    fresh_(false),
+    stopping_(false)
+{
+  r_.release_context();
+  thread_ = std::thread(&render_thread::run_, this);
+}
+
+render_thread::~render_thread() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  published_.notify_one();
+  thread_.join();
+  r_.make_current();
+}
+
+void render_thread::publish(frame_state & frame) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    /* The last frame hasn't been drawn, and won't be now, but its
+       cells still need painting */
+    if( fresh_ ) {
+      frame.edits.insert(frame.edits.begin(), pending_.edits.begin(), pending_.edits.end());
+    }
+    std::swap(pending_, frame);
+    fresh_ = true;
+  }
+  published_.notify_one();
+}
+
+void render_thread::run_() {
+  r_.make_current();
+  {
+    race_view view(lvl_);
+    frame_state current;
+    for( ;; ) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        published_.wait(lock, [this] { return fresh_ || stopping_; });
+        if( stopping_ ) {
+          break;
+        }
+        std::swap(current, pending_);
+        fresh_ = false;
+      }
+
+      view.draw(r_.batch(), current, current.alpha_at(SDL_GetPerformanceCounter(), ticks_per_second_));
+      r_.swap();
+    }
+  }
+  /* Everything the view drew with belongs to the context, so it has
+     to go before the context is released */
+  r_.release_context();
+}
@@ -0,0 +1,59 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#pragma once
+
+#include "frame_state.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+class level;
+class render;
+
+/// Draws a race on a thread of its own, so that waiting on the swap,
+/// for the display or a stalled GPU or compositor, doesn't hold up
+/// polling the controllers or stepping the simulation.
+///
+/// The race publishes a frame_state whenever it has stepped. The
+/// thread draws the newest one it has been given, skipping any it was
+/// too slow for, apart from the cells they painted. The cars are
+/// moved on by however long the frame waited to be drawn.
+///
+/// It takes render's GL context for as long as it runs, and hands it
+/// back to the thread that made it when it's destroyed.
+class render_thread {
+public:
+  /// lvl is drawn on the render thread, so it mustn't be the race's
+  /// own level; clone() that
+  render_thread(render & r, std::shared_ptr<level> lvl);
+  ~render_thread();
+
+  render_thread(render_thread const &) = delete;
+  render_thread& operator=(render_thread const &) = delete;
+
+  /// Hand frame over to be drawn. frame is left holding an older
+  /// state, so that its storage can be reused for the next one.
+  void publish(frame_state & frame);
+
+private:
+  void run_();
+
+  render & r_;
+  std::shared_ptr<level> lvl_;
+  std::uint64_t ticks_per_second_;
+
+  std::mutex mutex_;
+  std::condition_variable published_;
+  /* The newest frame, if fresh_, otherwise one already drawn */
+  frame_state pending_;
+  bool fresh_;
+  bool stopping_;
+
+  std::thread thread_;
+};
@@ -0,0 +1,268 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#include "replay.h"
+
+#include "car.h"
+#include "sim_real.h"
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+
+/* The file starts with this and a version number. The rest is all
+   varints, apart from the doubles, which are stored as their bit
+   patterns, byte-reversed so that round numbers with mostly zero
+   mantissas come out short. */
+static char const magic[4] = { 'N', 'X', 'R', 'P' };
+static unsigned const version = 3;
+
+/* Which number type the simulation was built with. Fixed point and
+   double are the same size, so sizeof(sim_real) can't tell them apart */
+#if defined(NATIVE_SIM_FIXED)
+static unsigned const precision = 2;
+#elif defined(NATIVE_SIM_FLOAT32)
+static unsigned const precision = 1;
+#else
+static unsigned const precision = 0;
+#endif
+
+static void write_varint(std::vector<unsigned char> & out, std::uint64_t value) {
+  while( value >= 0x80 ) {
+    out.push_back(static_cast<unsigned char>(value | 0x80));
+    value >>= 7;
+  }
+  out.push_back(static_cast<unsigned char>(value));
+}
+
+static std::uint64_t reverse_bytes(std::uint64_t value) {
+  std::uint64_t res = 0;
+  for( unsigned i=0; i<8; ++i ) {
+    res = (res << 8) | (value & 0xFF);
+    value >>= 8;
+  }
+  return res;
+}
+
+static void write_double(std::vector<unsigned char> & out, double value) {
+  std::uint64_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  write_varint(out, reverse_bytes(bits));
+}
+
+namespace {
+
+/* Reads back what the write_ functions wrote, remembering if it ever
+   runs off the end */
+class reader {
+public:
+  reader(std::vector<unsigned char> const & data)
+    : data_(data),
+      pos_(0),
+      ok_(true)
+  {}
+
+  std::uint64_t varint() {
+    std::uint64_t value = 0;
+    for( unsigned shift=0; shift<64; shift+=7 ) {
+      if( pos_ >= data_.size() ) {
+        ok_ = false;
+        return 0;
+      }
+      unsigned char const byte = data_[pos_++];
+      value |= static_cast<std::uint64_t>(byte & 0x7F) << shift;
+      if( !(byte & 0x80) ) {
+        return value;
+      }
+    }
+    ok_ = false;
+    return 0;
+  }
+
+  double real() {
+    std::uint64_t const bits = reverse_bytes(varint());
+    double value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+  }
+
+  bool bytes(char const *expected, std::size_t n) {
+    if( pos_ + n > data_.size() || std::memcmp(&data_[pos_], expected, n) != 0 ) {
+      ok_ = false;
+    }
+    pos_ += n;
+    return ok_;
+  }
+
+  bool ok() const {
+    return ok_;
+  }
+
+private:
+  std::vector<unsigned char> const & data_;
+  std::size_t pos_;
+  bool ok_;
+};
+
+}
+
+replay::replay(std::uint32_t track_checksum, unsigned seed, double step, double duration,
+               std::vector<bool> const & recorded)
+  : track_checksum_(track_checksum),
+    seed_(seed),
+    step_(step),
+    duration_(duration),
+    steps_(0),
+    final_checksum_(0),
+    recorded_(recorded),
+    changes_(recorded.size())
+{}
+
+std::shared_ptr<replay> replay::load(std::string const & filename) {
+  std::ifstream infile(filename, std::ios::binary);
+  if( !infile ) {
+    std::cerr << "Couldn't open replay " << filename << std::endl;
+    return nullptr;
+  }
+  std::vector<unsigned char> const data((std::istreambuf_iterator<char>(infile)),
+                                        std::istreambuf_iterator<char>());
+  reader in(data);
+
+  if( !in.bytes(magic, sizeof(magic)) || in.varint() != version ) {
+    std::cerr << filename << " isn't a replay this version can read" << std::endl;
+    return nullptr;
+  }
+  if( in.varint() != precision ) {
+    std::cerr << filename << " was recorded with a different precision simulation" << std::endl;
+    return nullptr;
+  }
+
+  auto const track_checksum = static_cast<std::uint32_t>(in.varint());
+  auto const seed = static_cast<unsigned>(in.varint());
+  double const step = in.real();
+  double const duration = in.real();
+  unsigned long const steps = in.varint();
+  auto const final_checksum = static_cast<std::uint32_t>(in.varint());
+  std::uint64_t const cars = in.varint();
+  if( !in.ok() || cars > data.size() ) {
+    std::cerr << filename << " is truncated" << std::endl;
+    return nullptr;
+  }
+
+  std::vector<bool> recorded(cars);
+  for( auto && r: recorded ) {
+    r = in.varint() != 0;
+  }
+  auto res = std::make_shared<replay>(track_checksum, seed, step, duration, recorded);
+  res->steps_ = steps;
+  res->final_checksum_ = final_checksum;
+
+  for( unsigned i=0; i<cars && in.ok(); ++i ) {
+    if( !recorded[i] ) {
+      continue;
+    }
+    std::uint64_t const count = in.varint();
+    change current = { 0, { 0, 0, 0, 0 } };
+    for( std::uint64_t j=0; j<count && in.ok(); ++j ) {
+      /* The low bits say which of the controls changed */
+      std::uint64_t const head = in.varint();
+      current.step += head >> 4;
+      if( head & 1 ) {
+        current.value.throttle = in.real();
+      }
+      if( head & 2 ) {
+        current.value.brake = in.real();
+      }
+      if( head & 4 ) {
+        current.value.turn = in.real();
+      }
+      if( head & 8 ) {
+        current.value.twist = in.real();
+      }
+      res->changes_[i].push_back(current);
+    }
+  }
+  if( !in.ok() ) {
+    std::cerr << filename << " is truncated" << std::endl;
+    return nullptr;
+  }
+  return res;
+}
+
+bool replay::save(std::string const & filename) const {
+  std::vector<unsigned char> out(magic, magic + sizeof(magic));
+  write_varint(out, version);
+  write_varint(out, precision);
+  write_varint(out, track_checksum_);
+  write_varint(out, seed_);
+  write_double(out, step_);
+  write_double(out, duration_);
+  write_varint(out, steps_);
+  write_varint(out, final_checksum_);
+  write_varint(out, changes_.size());
+  for( bool r: recorded_ ) {
+    write_varint(out, r);
+  }
+
+  for( unsigned i=0; i<changes_.size(); ++i ) {
+    if( !recorded_[i] ) {
+      continue;
+    }
+    write_varint(out, changes_[i].size());
+    change previous = { 0, { 0, 0, 0, 0 } };
+    for( auto const & c: changes_[i] ) {
+      unsigned const mask =
+        (c.value.throttle != previous.value.throttle ? 1 : 0) |
+        (c.value.brake != previous.value.brake ? 2 : 0) |
+        (c.value.turn != previous.value.turn ? 4 : 0) |
+        (c.value.twist != previous.value.twist ? 8 : 0);
+      write_varint(out, ((c.step - previous.step) << 4) | mask);
+      if( mask & 1 ) {
+        write_double(out, c.value.throttle);
+      }
+      if( mask & 2 ) {
+        write_double(out, c.value.brake);
+      }
+      if( mask & 4 ) {
+        write_double(out, c.value.turn);
+      }
+      if( mask & 8 ) {
+        write_double(out, c.value.twist);
+      }
+      previous = c;
+    }
+  }
+
+  std::ofstream outfile(filename, std::ios::binary);
+  outfile.write(reinterpret_cast<char const *>(out.data()), static_cast<std::streamsize>(out.size()));
+  if( !outfile ) {
+    std::cerr << "Couldn't write replay " << filename << std::endl;
+    return false;
+  }
+  return true;
+}
+
+void replay::record(unsigned long step, std::vector<std::shared_ptr<car>> const & cars) {
+  for( unsigned i=0; i<changes_.size() && i<cars.size(); ++i ) {
+    if( !recorded_[i] ) {
+      continue;
+    }
+    controls const now = { cars[i]->throttle(), cars[i]->brake(), cars[i]->turn(), cars[i]->twist() };
+    controls const before = changes_[i].empty() ? controls{ 0, 0, 0, 0 } : changes_[i].back().value;
+    if( now.throttle != before.throttle || now.brake != before.brake || now.turn != before.turn ||
+        now.twist != before.twist ) {
+      changes_[i].push_back({ step, now });
+    }
+  }
+}
+
+replay::controls replay::controls_at(unsigned car, unsigned long step, std::size_t & cursor) const {
+  auto const & changes = changes_[car];
+  while( cursor < changes.size() && changes[cursor].step <= step ) {
+    ++cursor;
+  }
+  return cursor == 0 ? controls{ 0, 0, 0, 0 } : changes[cursor - 1].value;
+}
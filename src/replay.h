@@ -0,0 +1,106 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+class car;
+
+/// A recording of a race: the controls of the human-driven cars, step
+/// by step, and enough about the race to set it up again. The AI cars
+/// aren't recorded, since they drive the same way every time the rest
+/// of the race does.
+///
+/// Only changes to a car's controls are stored, and on disk each is a
+/// step count since the previous change plus the new values, all as
+/// varints, so a race comes to a few KB.
+class replay {
+public:
+  /// What a car's player asked it to do. twist is how far the car
+  /// was twisted round on the spot that step, as by car::add_twist().
+  struct controls {
+    double throttle;
+    double brake;
+    double turn;
+    double twist;
+  };
+
+  /// Start an empty recording. recorded says which cars are to be
+  /// recorded; seed is how the cars were placed, as for native-sim,
+  /// with 0 meaning on the track's spawn points.
+  replay(std::uint32_t track_checksum, unsigned seed, double step, double duration,
+         std::vector<bool> const & recorded);
+
+  /// Read a recording from a file, or return nothing if it can't be
+  /// read.
+  static std::shared_ptr<replay> load(std::string const & filename);
+
+  /// Write the recording to a file, returning whether it worked.
+  bool save(std::string const & filename) const;
+
+  /// Record the controls of the recorded cars for the given step,
+  /// after the players have had their say.
+  void record(unsigned long step, std::vector<std::shared_ptr<car>> const & cars);
+
+  /// Note how many steps the race ran for, and a checksum of how it
+  /// ended, so that playback can stop in the same place and check it
+  /// got there the same way.
+  void finish(unsigned long steps, std::uint32_t final_checksum) {
+    steps_ = steps;
+    final_checksum_ = final_checksum;
+  }
+
+  /// The controls the given recorded car had on the given step,
+  /// counting from 1. cursor should start at 0 and be passed back in
+  /// each time; as long as the steps asked for don't go backwards,
+  /// each call is then constant time.
+  controls controls_at(unsigned car, unsigned long step, std::size_t & cursor) const;
+
+  std::uint32_t track_checksum() const {
+    return track_checksum_;
+  }
+  unsigned seed() const {
+    return seed_;
+  }
+  double step() const {
+    return step_;
+  }
+  double duration() const {
+    return duration_;
+  }
+  /// The number of cars in the race, recorded or not
+  unsigned cars() const {
+    return static_cast<unsigned>(changes_.size());
+  }
+  bool recorded(unsigned car) const {
+    return recorded_[car];
+  }
+  /// How many steps were recorded
+  unsigned long steps() const {
+    return steps_;
+  }
+  std::uint32_t final_checksum() const {
+    return final_checksum_;
+  }
+
+private:
+  struct change {
+    unsigned long step;
+    controls value;
+  };
+
+  std::uint32_t track_checksum_;
+  unsigned seed_;
+  double step_;
+  double duration_;
+  unsigned long steps_;
+  std::uint32_t final_checksum_;
+  std::vector<bool> recorded_;
+  std::vector<std::vector<change>> changes_;
+};
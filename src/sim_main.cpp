@@ -0,0 +1,781 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#include "car.h"
+#include "car_batch.h"
+#include "fixed_step.h"
+#include "level.h"
+#include "netplay.h"
+#include "race_events.h"
+#include "race_sim.h"
+#include "race_stream.h"
+#include "replay.h"
+#include "snapshot_ring.h"
+#include "players/ai_player.h"
+#include "players/remote_player.h"
+#include "players/replay_player.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Run races with nothing but AI drivers and no window, audio or GL,
+   to measure how quickly the simulation itself runs, or to try out
+   lots of variations of a track's speed layer. */
+
+struct sim_options {
+  std::string track = "res/track.dat";
+  unsigned cars = 8;
+  double duration = 30;
+  unsigned seed = 1;
+  double step = 1.0/120;
+  bool batched = false;
+  unsigned farm = 0;
+  unsigned farm_seeds = 4;
+  unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+  std::string save;
+  unsigned solver_iterations = 16;
+  double solver_tolerance = 1e-4;
+  double rewind = 0;
+  std::string record;
+  std::string replay;
+  std::string broadcast;
+  std::string check_replay;
+  bool check_batch = false;
+  /* How many of the cars scripted_players drive, for check_replay */
+  unsigned scripted = 0;
+  /* Racing against other copies of native-sim, if peers isn't empty */
+  netplay_config net;
+  /* The replay being played back, if any, which sets up the race in
+     place of the options above */
+  std::shared_ptr<::replay const> playback;
+};
+
+/* The collision solver's statistics, summed over every step of a race */
+struct solver_totals {
+  unsigned long iterations = 0;
+  unsigned long contacts = 0;
+  unsigned max_iterations = 0;
+  unsigned long unconverged_steps = 0;
+  double worst_residual = 0;
+};
+
+/* How a race went */
+struct race_report {
+  unsigned long steps = 0;
+  std::vector<unsigned> scores;
+  std::vector<vec2> positions;
+  solver_totals solver;
+  std::uint32_t checksum = 0;
+};
+
+static void usage(char const *argv0) {
+  std::cerr << "Usage: " << argv0
+            << " [--track FILE] [--cars N] [--duration SECONDS] [--seed N] [--step SECONDS] [--batched]\n"
+            << "    [--farm VARIANTS] [--farm-seeds N] [--threads N] [--save FILE]\n"
+            << "    [--solver-iterations N] [--solver-tolerance DISTANCE] [--rewind SECONDS]\n"
+            << "    [--record FILE] [--replay FILE] [--broadcast FILE] [--check-replay FILE] [--check-batch]\n"
+            << "    [--netplay INDEX --peers HOST:PORT,... [--latency MS] [--jitter MS] [--loss PERCENT]]"
+            << std::endl;
+  std::exit(1);
+}
+
+static sim_options parse_options(int argc, char **argv) {
+  sim_options opts;
+  for( int i=1; i<argc; ++i ) {
+    std::string const arg(argv[i]);
+    if( arg == "--batched" ) {
+      opts.batched = true;
+      continue;
+    }
+    if( arg == "--check-batch" ) {
+      opts.check_batch = true;
+      continue;
+    }
+    if( i + 1 >= argc ) {
+      usage(argv[0]);
+    }
+    char const *value = argv[++i];
+    if( arg == "--track" ) {
+      opts.track = value;
+    } else if( arg == "--cars" ) {
+      opts.cars = static_cast<unsigned>(std::stoul(value));
+    } else if( arg == "--duration" ) {
+      opts.duration = std::stod(value);
+    } else if( arg == "--seed" ) {
+      opts.seed = static_cast<unsigned>(std::stoul(value));
+    } else if( arg == "--step" ) {
+      opts.step = std::stod(value);
+    } else if( arg == "--farm" ) {
+      opts.farm = static_cast<unsigned>(std::stoul(value));
+    } else if( arg == "--farm-seeds" ) {
+      opts.farm_seeds = static_cast<unsigned>(std::stoul(value));
+    } else if( arg == "--threads" ) {
+      opts.threads = static_cast<unsigned>(std::stoul(value));
+    } else if( arg == "--save" ) {
+      opts.save = value;
+    } else if( arg == "--solver-iterations" ) {
+      opts.solver_iterations = static_cast<unsigned>(std::stoul(value));
+    } else if( arg == "--solver-tolerance" ) {
+      opts.solver_tolerance = std::stod(value);
+    } else if( arg == "--rewind" ) {
+      opts.rewind = std::stod(value);
+    } else if( arg == "--record" ) {
+      opts.record = value;
+    } else if( arg == "--replay" ) {
+      opts.replay = value;
+    } else if( arg == "--broadcast" ) {
+      opts.broadcast = value;
+    } else if( arg == "--check-replay" ) {
+      opts.check_replay = value;
+    } else if( arg == "--netplay" ) {
+      opts.net.index = static_cast<unsigned>(std::stoul(value));
+    } else if( arg == "--peers" ) {
+      std::string const peers(value);
+      for( std::size_t begin=0; begin<=peers.size(); ) {
+        std::size_t const end = std::min(peers.find(',', begin), peers.size());
+        opts.net.peers.push_back(peers.substr(begin, end - begin));
+        begin = end + 1;
+      }
+    } else if( arg == "--latency" ) {
+      opts.net.latency = std::stod(value) / 1000;
+    } else if( arg == "--jitter" ) {
+      opts.net.jitter = std::stod(value) / 1000;
+    } else if( arg == "--loss" ) {
+      opts.net.loss = std::stod(value) / 100;
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if( opts.cars == 0 || opts.duration <= 0 || opts.step <= 0 || opts.threads == 0 || opts.farm_seeds == 0 ||
+      opts.solver_iterations == 0 || opts.solver_tolerance < 0 || opts.rewind < 0 ||
+      (opts.farm > 0 && (!opts.record.empty() || !opts.replay.empty() || !opts.broadcast.empty())) ||
+      (!opts.check_replay.empty() && (opts.farm > 0 || opts.rewind > 0 || !opts.record.empty() ||
+                                      !opts.replay.empty() || !opts.broadcast.empty())) ||
+      (!opts.net.peers.empty() && (opts.farm > 0 || opts.rewind > 0 || !opts.check_replay.empty() ||
+                                   !opts.record.empty() || !opts.replay.empty())) ) {
+    usage(argv[0]);
+  }
+  return opts;
+}
+
+/* The track only has a handful of spawn points, so shuffle the grid
+   using the seed, and drop any cars that don't fit onto random free
+   cells elsewhere on the track. Seed 0 starts the cars on the spawn
+   points in order, as the game does. */
+static void place_cars(race_sim &sim, unsigned seed) {
+  if( seed == 0 ) {
+    sim.spawn();
+    return;
+  }
+  std::mt19937 rng(seed);
+  auto const & cars = sim.cars();
+  auto lvl = sim.get_level();
+
+  std::vector<std::pair<vec2, double>> slots;
+  std::vector<std::pair<unsigned, unsigned>> free_cells;
+  for( unsigned j=0; j<lvl->height(); ++j ) {
+    for( unsigned i=0; i<lvl->width(); ++i ) {
+      if( lvl->spawn_at(i, j) ) {
+        slots.emplace_back(vec2(i + 0.5, j + 0.5), lvl->steer_angle_at(i, j));
+      } else if( !lvl->blocker_at(i, j) ) {
+        free_cells.emplace_back(i, j);
+      }
+    }
+  }
+  std::shuffle(slots.begin(), slots.end(), rng);
+  std::shuffle(free_cells.begin(), free_cells.end(), rng);
+  for( auto const & cell: free_cells ) {
+    if( slots.size() >= cars.size() ) {
+      break;
+    }
+    slots.emplace_back(vec2(cell.first + 0.5, cell.second + 0.5),
+                       lvl->steer_angle_at(cell.first, cell.second));
+  }
+
+  for( std::size_t i=0; i<cars.size() && i<slots.size(); ++i ) {
+    cars[i]->set_pos(sim_vec2(slots[i].first));
+    cars[i]->set_vel(sim_vec2::zero());
+    cars[i]->set_theta(sim_real(slots[i].second));
+    cars[i]->store_previous();
+  }
+}
+
+/* A stand-in for a person at the controls, for check_replay. It
+   drives as the AI does, but fumbles it as people do: the stick only
+   reads in steps, it sometimes steers off or lifts off for a while,
+   and now and then it's twisted. It goes the same way every time for
+   the same seed. */
+class scripted_player: public player {
+public:
+  scripted_player(std::shared_ptr<car> controlled, std::shared_ptr<level> environment, unsigned seed)
+    : controlled_(controlled),
+      driver_(controlled, environment),
+      rng_(seed),
+      fumble_steps_(0),
+      fumble_turn_(0),
+      fumble_throttle_(0)
+  {}
+public: // player
+  void update(double dt) {
+    driver_.update(dt);
+
+    std::uniform_real_distribution<double> chance(0, 1);
+    if( fumble_steps_ == 0 && chance(rng_) < 1.0/90 ) {
+      fumble_steps_ = std::uniform_int_distribution<unsigned>(5, 60)(rng_);
+      fumble_turn_ = stick(chance(rng_) * 2 - 1);
+      fumble_throttle_ = chance(rng_) < 0.5 ? 1 : 0;
+    }
+    if( fumble_steps_ > 0 ) {
+      --fumble_steps_;
+      controlled_->set_turn(fumble_turn_);
+      controlled_->set_throttle(fumble_throttle_);
+      controlled_->set_brake(1 - fumble_throttle_);
+    } else {
+      controlled_->set_turn(stick(controlled_->turn()));
+    }
+    if( chance(rng_) < 1.0/240 ) {
+      controlled_->add_twist(720*(M_PI/180.0) * stick(chance(rng_) * 0.1 - 0.05));
+    }
+  }
+  bool is_human() const { return true; }
+  unsigned score() const {
+    return controlled_->score();
+  }
+private:
+  /* An analogue stick reads in 256 steps */
+  static double stick(double value) {
+    return std::round(value * 128) / 128;
+  }
+
+  std::shared_ptr<car> controlled_;
+  ai_player driver_;
+  std::mt19937 rng_;
+  unsigned fumble_steps_;
+  double fumble_turn_;
+  double fumble_throttle_;
+};
+
+/* Fill sim with drivers, set up as the options ask: AI, apart from
+   any cars a replay being played back has recordings for, that are
+   driven over the network, or that are scripted */
+static void setup_race(race_sim &sim, sim_options const & opts, unsigned seed,
+                       std::shared_ptr<netplay> session = nullptr) {
+  sim.set_batched(opts.batched);
+  sim.set_solver_limits(opts.solver_iterations, static_cast<sim_real>(opts.solver_tolerance));
+  for( unsigned i=0; i<opts.cars; ++i ) {
+    auto c = sim.add_car();
+    if( session && i < session->players() ) {
+      sim.add_player(std::make_shared<remote_player>(c, session, i));
+    } else if( opts.playback && opts.playback->recorded(i) ) {
+      sim.add_player(std::make_shared<replay_player>(c, opts.playback, i));
+    } else if( i < opts.scripted ) {
+      sim.add_player(std::make_shared<scripted_player>(c, sim.get_level(), seed * opts.cars + i));
+    } else {
+      sim.add_player(std::make_shared<ai_player>(c, sim.get_level()));
+    }
+  }
+
+  place_cars(sim, seed);
+}
+
+/* Run one complete race on lvl. Everything the race touches is local
+   to this call, so any number of these can run at once on different
+   threads, as long as they each have their own level. */
+static void run_race(std::shared_ptr<level> lvl, sim_options const & opts,
+                     unsigned seed, race_report & report) {
+  race_events events;
+  std::unique_ptr<race_stream_writer> stream;
+  if( !opts.broadcast.empty() ) {
+    stream = race_stream_writer::open(opts.broadcast, events);
+    if( !stream ) {
+      std::exit(1);
+    }
+  }
+  race_sim sim(lvl, opts.duration, stream ? static_cast<race_events &>(*stream) : events);
+  setup_race(sim, opts, seed);
+
+  std::shared_ptr<replay> recording;
+  if( !opts.record.empty() ) {
+    std::vector<bool> recorded(opts.cars, false);
+    for( unsigned i=0; i<opts.cars; ++i ) {
+      recorded[i] = i < opts.scripted || (opts.playback && opts.playback->recorded(i));
+    }
+    recording = std::make_shared<replay>(lvl->checksum(), seed, opts.step, opts.duration, recorded);
+    sim.set_recording(recording);
+  }
+
+  /* A replay of a race that was abandoned stops where it did */
+  unsigned long const last_step = opts.playback ? opts.playback->steps() : ~0ul;
+
+  report = race_report();
+  solver_totals & solver = report.solver;
+  while( !sim.complete() && sim.steps() < last_step ) {
+    sim.step(opts.step);
+    if( stream ) {
+      stream->update(sim, opts.step);
+    }
+
+    collision_stats const & stats = sim.last_collisions();
+    solver.iterations += stats.iterations;
+    solver.contacts += stats.contacts;
+    solver.max_iterations = std::max(solver.max_iterations, stats.iterations);
+    if( !stats.converged ) {
+      ++solver.unconverged_steps;
+    }
+    solver.worst_residual = std::max(solver.worst_residual, static_cast<double>(stats.residual_penetration));
+  }
+
+  if( stream ) {
+    stream->finish(sim, opts.step);
+  }
+
+  for( auto c: sim.cars() ) {
+    report.scores.push_back(c->score());
+    report.positions.push_back(vec2(c->pos()));
+  }
+  report.steps = sim.steps();
+  report.checksum = sim.checksum();
+
+  if( recording ) {
+    recording->finish(report.steps, report.checksum);
+    if( !recording->save(opts.record) ) {
+      std::exit(1);
+    }
+  }
+}
+
+static bool same_state(car_state const & a, car_state const & b) {
+  return a.pos.x() == b.pos.x() && a.pos.y() == b.pos.y() &&
+    a.heading.x() == b.heading.x() && a.heading.y() == b.heading.y() &&
+    a.prev_pos.x() == b.prev_pos.x() && a.prev_pos.y() == b.prev_pos.y() &&
+    a.prev_heading.x() == b.prev_heading.x() && a.prev_heading.y() == b.prev_heading.y() &&
+    a.vel.x() == b.vel.x() && a.vel.y() == b.vel.y() &&
+    a.throttle == b.throttle && a.brake == b.brake && a.turn == b.turn &&
+    a.spin_timer == b.spin_timer && a.spin == b.spin &&
+    a.segment == b.segment && a.score == b.score;
+}
+
+/* Run a race keeping the last few seconds of snapshots, then rewind
+   as far as they go and run the end of the race again. It should
+   finish exactly as it did the first time. */
+static int check_rewind(std::shared_ptr<level> lvl, sim_options const & opts) {
+  race_events events;
+  race_sim sim(lvl, opts.duration, events);
+  setup_race(sim, opts, opts.seed);
+
+  std::size_t const capacity = std::max(1l, std::lround(opts.rewind / opts.step));
+  snapshot_ring ring(capacity, sim.cars().size());
+  double saving = 0;
+  while( !sim.complete() ) {
+    sim.step(opts.step);
+    auto const begin = std::chrono::steady_clock::now();
+    ring.save(sim);
+    auto const end = std::chrono::steady_clock::now();
+    saving += std::chrono::duration<double>(end - begin).count();
+  }
+
+  race_state first_race;
+  std::vector<car_state> first_cars(sim.cars().size());
+  sim.save(first_race, first_cars.data());
+
+  unsigned long const rewound = ring.newest() - ring.oldest();
+  ring.restore(sim, ring.oldest());
+  while( sim.steps() < first_race.steps ) {
+    sim.step(opts.step);
+  }
+
+  race_state second_race;
+  std::vector<car_state> second_cars(sim.cars().size());
+  sim.save(second_race, second_cars.data());
+
+  std::cout << "Took " << sim.steps() << " snapshots of " << ring.snapshot_bytes() << " bytes, "
+            << saving / sim.steps() * 1e6 << "us each" << std::endl;
+  bool same = second_race.match_elapsed == first_race.match_elapsed;
+  for( std::size_t i=0; i<first_cars.size(); ++i ) {
+    same = same && same_state(first_cars[i], second_cars[i]);
+  }
+  if( !same ) {
+    std::cerr << "Race finished differently after rewinding " << rewound << " steps" << std::endl;
+    return 1;
+  }
+  std::cout << "Rewound " << rewound << " steps (" << rewound * opts.step
+            << "s) and finished the same way again" << std::endl;
+  return 0;
+}
+
+/* Play back a race stream written by run_race, as a spectator would,
+   and check that it ends up where the race did, give or take the
+   rounding */
+static int check_broadcast(sim_options const & opts, race_report const & report) {
+  auto source = race_stream_source::open(opts.broadcast);
+  if( !source ) {
+    return 1;
+  }
+  race_stream_reader stream;
+  race_events events;
+  std::vector<unsigned char> frame;
+  unsigned long frames = 0;
+  while( source->next(frame) ) {
+    if( !stream.read(frame, events) ) {
+      std::cerr << "Frame " << frames << " of " << opts.broadcast << " couldn't be read" << std::endl;
+      return 1;
+    }
+    ++frames;
+  }
+
+  double worst = 0;
+  bool scores_match = stream.finished() && stream.cars().size() == report.scores.size();
+  for( std::size_t i=0; scores_match && i<report.scores.size(); ++i ) {
+    vec2 const error = stream.cars()[i].pos - report.positions[i];
+    worst = std::max(worst, error.mag());
+    scores_match = stream.cars()[i].score == report.scores[i];
+  }
+  if( !scores_match ) {
+    std::cerr << "The race stream didn't end as the race did" << std::endl;
+    return 1;
+  }
+  std::ifstream file(opts.broadcast, std::ios::binary | std::ios::ate);
+  double const bytes = static_cast<double>(file.tellg());
+  std::cout << "Broadcast " << frames << " frames in " << bytes << " bytes, "
+            << bytes / (report.steps * opts.step) << " bytes per second; cars ended up within "
+            << worst << " of where they were" << std::endl;
+  return 0;
+}
+
+/* Run a race, and after every step, copy the cars into two new
+   fields, step one a car at a time with car::update and the other
+   all at once with car_batch, and check that they end up in the same
+   places, give or take the rounding of each build's sin and cos */
+static int check_batch(std::shared_ptr<level> lvl, sim_options const & opts) {
+#if defined(NATIVE_SIM_FIXED)
+  double const tolerance = 1e-8;
+#elif defined(NATIVE_SIM_FLOAT32)
+  double const tolerance = 1e-4;
+#else
+  double const tolerance = 1e-9;
+#endif
+  race_events events;
+  race_sim sim(lvl, opts.duration, events);
+  setup_race(sim, opts, opts.seed);
+
+  auto const batch = std::make_shared<car_batch>();
+  std::vector<std::shared_ptr<car>> singles;
+  std::vector<std::shared_ptr<car>> batched;
+  for( unsigned i=0; i<sim.cars().size(); ++i ) {
+    singles.push_back(std::make_shared<car>(sim_vec2::zero(), i, std::make_shared<model>()));
+    batched.push_back(std::make_shared<car>(sim_vec2::zero(), i, std::make_shared<model>(), batch));
+  }
+
+  double worst = 0;
+  while( !sim.complete() ) {
+    sim.step(opts.step);
+    for( std::size_t i=0; i<singles.size(); ++i ) {
+      car_state const s = sim.cars()[i]->state();
+      singles[i]->set_state(s);
+      batched[i]->set_state(s);
+      singles[i]->update(opts.step);
+    }
+    batch->update(opts.step);
+    for( std::size_t i=0; i<singles.size(); ++i ) {
+      car const & a = *singles[i];
+      car const & b = *batched[i];
+      for( sim_vec2 const & error: { a.pos() - b.pos(), a.vel() - b.vel(), a.heading() - b.heading() } ) {
+        worst = std::max(worst, static_cast<double>(error.mag()));
+      }
+      if( a.state().spin != b.state().spin ) {
+        worst = std::max(worst, 1.0);
+      }
+    }
+  }
+
+  if( worst > tolerance ) {
+    std::cerr << "car_batch (" << car_batch::instruction_set() << ") and car::update drifted " << worst
+              << " apart in one step" << std::endl;
+    return 1;
+  }
+  std::cout << "car_batch (" << car_batch::instruction_set() << ") and car::update agreed to within "
+            << worst << " over " << sim.steps() << " steps" << std::endl;
+  return 0;
+}
+
+/* Record a race with half the cars driven by scripted_players, as
+   people would drive them, then play the recording back. It should
+   finish exactly as it did the first time. */
+static int check_replay(std::shared_ptr<level> lvl, sim_options const & opts) {
+  sim_options recording = opts;
+  recording.record = opts.check_replay;
+  recording.scripted = (opts.cars + 1) / 2;
+  race_report first;
+  run_race(lvl, recording, opts.seed, first);
+
+  sim_options playback = opts;
+  playback.playback = replay::load(opts.check_replay);
+  if( !playback.playback ) {
+    return 1;
+  }
+  race_report second;
+  run_race(lvl, playback, opts.seed, second);
+
+  std::ifstream file(opts.check_replay, std::ios::binary | std::ios::ate);
+  std::cout << "Recorded " << recording.scripted << " scripted cars for " << first.steps << " steps in "
+            << file.tellg() << " bytes" << std::endl;
+  if( second.steps != first.steps || second.checksum != first.checksum || second.scores != first.scores ) {
+    std::cerr << "The replay finished differently to the race it recorded" << std::endl;
+    return 1;
+  }
+  std::cout << "The replay finished exactly as the race it recorded did" << std::endl;
+  return 0;
+}
+
+/* Race against other copies of native-sim over the network, in real
+   time. Each drives its own car with an AI of its own, which stands
+   in for a person watching the screen: it only sees the race as this
+   instance has guessed it, so the others' guesses at what it does are
+   often wrong and have to be rolled back. Every instance should print
+   the same scores and checksum. */
+static int run_netplay(std::shared_ptr<level> lvl, sim_options const & opts) {
+  auto session = netplay::open(opts.net);
+  if( !session ) {
+    return 1;
+  }
+  race_events events;
+  race_sim sim(lvl, opts.duration, events);
+  setup_race(sim, opts, opts.seed, session);
+  if( !session->connect(sim, 30) ) {
+    return 1;
+  }
+  ai_player driver(sim.cars()[opts.net.index], lvl);
+
+  fixed_step sim_clock(opts.step, 12);
+  auto last_frame = std::chrono::steady_clock::now();
+  while( !sim.complete() && session->desync_step() == 0 ) {
+    auto const this_frame = std::chrono::steady_clock::now();
+    double const elapsed = std::chrono::duration<double>(this_frame - last_frame).count();
+    last_frame = this_frame;
+
+    driver.update(opts.step);
+    session->advance(sim, sim_clock.advance(elapsed), opts.step);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  bool const agreed = session->finish(sim, 10);
+
+  for( unsigned i=0; i<sim.cars().size(); ++i ) {
+    std::cout << "Score: " << i << ": " << sim.cars()[i]->score() << std::endl;
+  }
+  netplay_stats const & stats = session->stats();
+  std::cout << "Raced " << sim.steps() << " steps against " << session->players() - 1
+            << " other instances: " << stats.rollbacks << " rollbacks, re-running "
+            << stats.resimulated_steps << " steps, at most " << stats.max_rollback << " at once; "
+            << stats.stalls << " stalls; " << stats.checksums_compared << " checksums compared" << std::endl;
+  std::cout << "Final checksum: " << std::hex << sim.checksum() << std::dec << std::endl;
+  if( !agreed ) {
+    std::cerr << "The instances didn't finish the same race" << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+/* Nudge the AI's target speed up or down by a random amount in each
+   track segment. Variant 0 is always the track as it was loaded. */
+static std::vector<int> vary_speed_layer(level & lvl, unsigned variant, unsigned seed) {
+  std::vector<int> offsets(0xE, 0);
+  if( variant != 0 ) {
+    std::mt19937 rng(seed ^ (variant * 2654435761u));
+    std::uniform_int_distribution<int> offset(-3, 3);
+    for( auto & o: offsets ) {
+      o = offset(rng);
+    }
+  }
+
+  for( unsigned j=0; j<lvl.height(); ++j ) {
+    for( unsigned i=0; i<lvl.width(); ++i ) {
+      unsigned const segment = lvl.segment_at(i, j);
+      if( segment < offsets.size() ) {
+        int const speed = static_cast<int>(lvl.speed_at(i, j)) + offsets[segment];
+        lvl.set_raw(1, i, j, static_cast<unsigned char>(std::min(std::max(speed, 0), 15)));
+      }
+    }
+  }
+  return offsets;
+}
+
+/* Only the offsets are kept, not the track they made, which can be
+   big; the best is made again from them to be saved */
+struct farm_result {
+  std::vector<int> offsets;
+  double mean_score;
+};
+
+/* Race many variations of the track's speed layer, spread over all
+   the cores, and report which did best. Every variation is raced
+   from the same few grids, seeded from opts.seed up, and scored by
+   the mean over all of them, so that no variation wins by being
+   dealt an easy start. Each worker only ever writes to the results
+   of the variations it claimed. */
+static int run_farm(std::shared_ptr<level> base, sim_options const & opts) {
+  std::vector<farm_result> results(opts.farm);
+  std::atomic<unsigned> next(0);
+  std::atomic<unsigned long> total_steps(0);
+
+  auto worker = [&]() {
+    race_report report;
+    for( ;; ) {
+      unsigned const variant = next++;
+      if( variant >= opts.farm ) {
+        return;
+      }
+      auto lvl = base->clone();
+      results[variant].offsets = vary_speed_layer(*lvl, variant, opts.seed);
+      double total = 0;
+      std::size_t scores = 0;
+      for( unsigned k=0; k<opts.farm_seeds; ++k ) {
+        run_race(lvl, opts, opts.seed + k, report);
+        total_steps += report.steps;
+        for( auto s: report.scores ) {
+          total += s;
+        }
+        scores += report.scores.size();
+      }
+      results[variant].mean_score = total / scores;
+    }
+  };
+
+  auto const begin = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for( unsigned i=0; i<opts.threads; ++i ) {
+    threads.emplace_back(worker);
+  }
+  for( auto & t: threads ) {
+    t.join();
+  }
+  auto const end = std::chrono::steady_clock::now();
+  double const wall = std::chrono::duration<double>(end - begin).count();
+
+  std::vector<unsigned> ranking(results.size());
+  for( unsigned i=0; i<ranking.size(); ++i ) {
+    ranking[i] = i;
+  }
+  std::stable_sort(ranking.begin(), ranking.end(), [&](unsigned a, unsigned b) {
+    return results[a].mean_score > results[b].mean_score;
+  });
+
+  std::cout << "Unmodified track: mean score " << results[0].mean_score << std::endl;
+  for( unsigned i=0; i<ranking.size() && i<5; ++i ) {
+    farm_result const & r = results[ranking[i]];
+    std::cout << "Variant " << ranking[i] << ": mean score " << r.mean_score << ", segment offsets";
+    for( auto o: r.offsets ) {
+      std::cout << " " << o;
+    }
+    std::cout << std::endl;
+  }
+  unsigned long const races = static_cast<unsigned long>(opts.farm) * opts.farm_seeds;
+  std::cout << "Ran " << races << " races, " << opts.farm_seeds << " for each variant, on "
+            << opts.threads << " threads in " << wall << "s: " << races / wall << " races per second, "
+            << total_steps * opts.step / wall << " simulated seconds per second" << std::endl;
+
+  if( !opts.save.empty() ) {
+    auto best = base->clone();
+    vary_speed_layer(*best, ranking[0], opts.seed);
+    if( !best->save(opts.save) ) {
+      return 1;
+    }
+    std::cout << "Saved variant " << ranking[0] << " to " << opts.save << std::endl;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  sim_options opts = parse_options(argc, argv);
+
+  auto const load_start = std::chrono::steady_clock::now();
+  auto lvl = level::load(opts.track);
+  std::chrono::duration<double> const load_time = std::chrono::steady_clock::now() - load_start;
+  std::cout << "Loaded the " << lvl->width() << "x" << lvl->height() << " track in "
+            << load_time.count() * 1000 << "ms" << std::endl;
+  if( !opts.replay.empty() ) {
+    opts.playback = replay::load(opts.replay);
+    if( !opts.playback ) {
+      return 1;
+    }
+    if( opts.playback->track_checksum() != lvl->checksum() ) {
+      std::cerr << opts.replay << " was recorded on a different track to " << opts.track << std::endl;
+      return 1;
+    }
+    opts.cars = opts.playback->cars();
+    opts.seed = opts.playback->seed();
+    opts.step = opts.playback->step();
+    opts.duration = opts.playback->duration();
+  }
+
+  if( opts.farm > 0 ) {
+    return run_farm(lvl, opts);
+  }
+  if( opts.rewind > 0 ) {
+    return check_rewind(lvl, opts);
+  }
+  if( !opts.check_replay.empty() ) {
+    return check_replay(lvl, opts);
+  }
+  if( opts.check_batch ) {
+    return check_batch(lvl, opts);
+  }
+  if( !opts.net.peers.empty() ) {
+    return run_netplay(lvl, opts);
+  }
+
+  race_report report;
+  auto const begin = std::chrono::steady_clock::now();
+  run_race(lvl, opts, opts.seed, report);
+  auto const end = std::chrono::steady_clock::now();
+  unsigned long const steps = report.steps;
+  std::vector<unsigned> const & scores = report.scores;
+  solver_totals const & solver = report.solver;
+
+  double const simulated = steps * opts.step;
+  double const wall = std::chrono::duration<double>(end - begin).count();
+
+  for( unsigned i=0; i<scores.size(); ++i ) {
+    std::cout << "Score: " << i << ": " << scores[i] << std::endl;
+  }
+  std::cout << "Simulated " << simulated << "s in " << wall << "s ("
+            << steps << " steps): "
+            << simulated / wall << " simulated seconds per second";
+  if( opts.batched ) {
+    std::cout << " (batched, " << car_batch::instruction_set() << ")";
+  }
+  std::cout << std::endl;
+  std::cout << "Collision solver: " << static_cast<double>(solver.iterations) / steps
+            << " passes per step on average, at most " << solver.max_iterations << "; "
+            << static_cast<double>(solver.contacts) / steps << " contacts per step; "
+            << solver.unconverged_steps << " steps hit the pass limit, leaving up to "
+            << solver.worst_residual << " penetration" << std::endl;
+  if( lvl->flow_build_time() > 0 ) {
+    std::cout << "The track has no steering layer; the AI followed its flow field, built in "
+              << lvl->flow_build_time() * 1000 << "ms" << std::endl;
+  }
+
+  if( !opts.broadcast.empty() && opts.broadcast.compare(0, 4, "udp:") != 0 &&
+      check_broadcast(opts, report) != 0 ) {
+    return 1;
+  }
+
+  if( opts.playback ) {
+    if( report.checksum != opts.playback->final_checksum() ) {
+      std::cerr << "The race finished differently to when it was recorded" << std::endl;
+      return 1;
+    }
+    std::cout << "The race finished exactly as it did when it was recorded" << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,25 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#pragma once
+
+#include "vec2.h"
+
+/// The scalar type the race simulation works in: cars, collision
+/// shapes and the batched update. It's double unless the build sets
+/// NATIVE_SIM_FLOAT32, which halves the size of all that state, or
+/// NATIVE_SIM_FIXED, which makes every result bit for bit the same on
+/// any machine. Everything outside the simulation, like rendering
+/// and audio, sticks with double and vec2.
+#if defined(NATIVE_SIM_FIXED)
+#include "fixed.h"
+using sim_real = fixed;
+#elif defined(NATIVE_SIM_FLOAT32)
+using sim_real = float;
+#else
+using sim_real = double;
+#endif
+
+using sim_vec2 = basic_vec2<sim_real>;
@@ -0,0 +1,99 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#pragma once
+
+#include "car.h"
+#include "error.h"
+#include "race_sim.h"
+
+#include <iostream>
+#include <vector>
+
+/// The most recent states of a race_sim, one per step, so that it can
+/// be rewound to any of them. All the storage is allocated up front
+/// as flat arrays of plain data, so taking a snapshot is just a copy
+/// and is cheap enough to do every step.
+class snapshot_ring {
+public:
+  snapshot_ring(std::size_t capacity, std::size_t cars)
+    : capacity_(capacity),
+      cars_per_snapshot_(cars),
+      count_(0),
+      newest_(0),
+      races_(capacity),
+      cars_(capacity * cars)
+  {}
+
+  /// Snapshot sim as it is now, dropping the oldest snapshot if the
+  /// ring is full. Snapshots are only kept of consecutive steps, so if
+  /// this isn't the step after the newest one held, the ring is
+  /// emptied first.
+  void save(race_sim const & sim) {
+    check_(sim);
+    if( count_ > 0 && sim.steps() != newest_ + 1 ) {
+      count_ = 0;
+    }
+    std::size_t const slot = slot_(sim.steps());
+    sim.save(races_[slot], &cars_[slot * cars_per_snapshot_]);
+    newest_ = sim.steps();
+    if( count_ < capacity_ ) {
+      ++count_;
+    }
+  }
+
+  /// Put sim back as it was at the given step, and forget every
+  /// snapshot after it. Returns false, leaving sim alone, if that
+  /// step isn't held.
+  bool restore(race_sim & sim, unsigned long step) {
+    check_(sim);
+    if( count_ == 0 || step < oldest() || step > newest_ ) {
+      return false;
+    }
+    std::size_t const slot = slot_(step);
+    sim.restore(races_[slot], &cars_[slot * cars_per_snapshot_]);
+    count_ -= newest_ - step;
+    newest_ = step;
+    return true;
+  }
+
+  std::size_t size() const {
+    return count_;
+  }
+
+  /// The step numbers of the oldest and newest snapshots held. Only
+  /// meaningful if size() is not zero.
+  unsigned long oldest() const {
+    return newest_ + 1 - count_;
+  }
+  unsigned long newest() const {
+    return newest_;
+  }
+
+  /// The memory used by each snapshot, in bytes
+  std::size_t snapshot_bytes() const {
+    return sizeof(race_state) + cars_per_snapshot_ * sizeof(car_state);
+  }
+
+private:
+  std::size_t slot_(unsigned long step) const {
+    return step % capacity_;
+  }
+
+  void check_(race_sim const & sim) const {
+    if( sim.cars().size() != cars_per_snapshot_ ) {
+      std::cerr << "Snapshot ring sized for " << cars_per_snapshot_ << " cars, but the race has "
+                << sim.cars().size() << std::endl;
+      crash();
+    }
+  }
+
+  std::size_t capacity_;
+  std::size_t cars_per_snapshot_;
+  std::size_t count_;
+  unsigned long newest_;
+  std::vector<race_state> races_;
+  std::vector<car_state> cars_;
+};
@@ -28,6 +28,13 @@ public:
   bool complete() const {
     return elapsed_ >= duration_;
   }
+
+  double elapsed() const {
+    return elapsed_;
+  }
+  void set_elapsed(double elapsed) {
+    elapsed_ = elapsed;
+  }
 private:
   double elapsed_;
   double duration_;
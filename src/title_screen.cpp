@@ -27,16 +27,27 @@ enum class slot_state {
   ready
 };
 
-static void draw_title(font const& f) {
-  glColor3d(1, 1, 1);
-  f.render_text_centered_to_width("Native Homebrew Example", vec2(0.5,0), 1);
-}
+/* Nothing on the title screen changes while it's up, so the text is
+   all laid out once */
+class title_text {
+public:
+  title_text(font const &f, std::vector<hiscore> const &hs);
+  void draw(draw_batch & batch);
+
+private:
+  text title_;
+  text heading_;
+  std::vector<text> dates_;
+  std::vector<text> scores_;
+};
 
-static void draw_hiscores(font const &f, std::vector<hiscore> const &hs) {
-  glColor3d(1, 1, 1);
-  f.render_text_centered_to_height("BEST SCORES", vec2(0.5, 0.15), 0.05);
-  for( unsigned i=0; i<hs.size(); ++i ) {
-    auto & h = hs[i];
+title_text::title_text(font const &f, std::vector<hiscore> const &hs)
+  : title_(f),
+    heading_(f)
+{
+  title_.set("Native Homebrew Example");
+  heading_.set("BEST SCORES");
+  for( auto & h: hs ) {
     std::stringstream ss;
     ss << std::setw(2) << std::setfill('0')
        << h.year() << "-"
@@ -49,13 +60,25 @@ static void draw_hiscores(font const &f, std::vector<hiscore> const &hs) {
        << h.hour() << ":"
        << std::setw(2) << std::setfill('0')
        << h.minute();
-    glColor3d(1, 1, 1);
-    f.render_text_to_height(ss.str(), vec2(0, 0.2 + i*0.08), 0.05);
+    dates_.emplace_back(f);
+    dates_.back().set(ss.str());
     ss.str(std::string());
     ss << std::setw(4) << std::setfill('0')
        << h.score();
-    glColor3d(1, 1, 0);
-    f.render_text_right_to_height(ss.str(), vec2(1, 0.2 + i*0.08), 0.05);
+    scores_.emplace_back(f);
+    scores_.back().set(ss.str());
+  }
+}
+
+void title_text::draw(draw_batch & batch) {
+  batch.set_color({ 1.0f, 1.0f, 1.0f, 1.0f });
+  title_.draw_centered_to_width(batch, vec2(0.5,0), 1);
+  heading_.draw_centered_to_height(batch, vec2(0.5, 0.15), 0.05);
+  for( unsigned i=0; i<dates_.size(); ++i ) {
+    batch.set_color({ 1.0f, 1.0f, 1.0f, 1.0f });
+    dates_[i].draw_to_height(batch, vec2(0, 0.2 + i*0.08), 0.05);
+    batch.set_color({ 1.0f, 1.0f, 0.0f, 1.0f });
+    scores_[i].draw_right_to_height(batch, vec2(1, 0.2 + i*0.08), 0.05);
   }
 }
 
@@ -134,14 +157,10 @@ title_screen(std::shared_ptr<controllers::collection> cs,
   }
 
   font f("res/CourierPrime-Regular.ttf", 300);
+  title_text texts(f, hs);
 
-  glMatrixMode(GL_PROJECTION);
-  glLoadIdentity();
-
-  glOrtho(-7.0/18, (25.0/18), 1, 0, 0, 1);
-
-  glMatrixMode(GL_MODELVIEW);
-  glLoadIdentity();
+  draw_batch & batch = r.batch();
+  batch.set_projection(-7.0/18, (25.0/18), 1, 0);
 
   unsigned last_frame = SDL_GetTicks();
   bool quit = false;
@@ -267,50 +286,45 @@ title_screen(std::shared_ptr<controllers::collection> cs,
     }
 
     glClear(GL_COLOR_BUFFER_BIT);
-    draw_title(f);
-    draw_hiscores(f, hs);
+    texts.draw(batch);
 
     model m;
     for( unsigned i=0; i<slots.size(); ++i ) {
-      glPushMatrix();
+      batch.push();
       double const x = i < 4 ? -0.25 : 1;
       double const y = (i % 4) * 0.25;
-      glTranslated(x, y, 0);
-      glScaled(0.25, 0.25, 1);
+      batch.translate(x, y);
+      batch.scale(0.25, 0.25);
 
-      glColor3d(1, 1, 1);
-      glBegin(GL_LINE_LOOP);
-      circle_vertices(0.5, 0.5, 0.4, 50);
-      glEnd();
+      batch.set_color({ 1.0f, 1.0f, 1.0f, 1.0f });
+      batch.circle_outline(vec2(0.5, 0.5), 0.4, 50);
 
       switch(slots[i].state) {
       case slot_state::empty:
         break;
       case slot_state::present:
-        set_color(i);
-        glPushMatrix();
-        glTranslated(0.5, 0.5, 0);
-        glScaled(0.5, 0.5, 1);
-        glRotated(slots[i].angle * 180 / M_PI, 0, 0, 1);
-        m.draw();
-        glPopMatrix();
+        batch.set_color(car_color(i));
+        batch.push();
+        batch.translate(0.5, 0.5);
+        batch.scale(0.5, 0.5);
+        batch.rotate(slots[i].angle);
+        m.draw(batch);
+        batch.pop();
         break;
       case slot_state::ready:
-        glColor3d(0.5, 0.5, 0.5);
-        glBegin(GL_POLYGON);
-        circle_vertices(0.5, 0.5, 0.4, 50);
-        glEnd();
-
-        set_color(i);
-        glPushMatrix();
-        glTranslated(0.5, 0.5, 0);
-        glScaled(0.5, 0.5, 1);
-        glRotated(slots[i].angle * 180 / M_PI, 0, 0, 1);
-        m.draw();
-        glPopMatrix();
+        batch.set_color({ 0.5f, 0.5f, 0.5f, 1.0f });
+        batch.circle(vec2(0.5, 0.5), 0.4, 50);
+
+        batch.set_color(car_color(i));
+        batch.push();
+        batch.translate(0.5, 0.5);
+        batch.scale(0.5, 0.5);
+        batch.rotate(slots[i].angle);
+        m.draw(batch);
+        batch.pop();
         break;
       }
-      glPopMatrix();
+      batch.pop();
     }
 
     r.swap();
@@ -0,0 +1,33 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#include "level.h"
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+/* Convert a track between the text format it's edited in and the
+   binary format the game maps, in either direction */
+int main(int argc, char **argv) {
+  bool text = false;
+  int first = 1;
+  if( argc > 1 && std::string(argv[1]) == "--text" ) {
+    text = true;
+    ++first;
+  }
+  if( argc - first != 2 ) {
+    std::cerr << "Usage: " << argv[0] << " [--text] IN OUT\n"
+              << "Converts the track IN, in either format, to the binary format, or to text\n"
+              << "with --text, and saves it as OUT." << std::endl;
+    return 1;
+  }
+
+  auto lvl = level::load(argv[first]);
+  if( text ) {
+    return lvl->save(argv[first + 1]) ? 0 : 1;
+  }
+  return lvl->save_binary(argv[first + 1]) ? 0 : 1;
+}
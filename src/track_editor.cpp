@@ -0,0 +1,171 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#include "track_editor.h"
+
+#include "level.h"
+
+#include <atari-controllers>
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <sstream>
+
+namespace {
+  struct brush {
+    char const * name;
+    unsigned layer;
+    unsigned values;
+  };
+}
+
+/* Painting the ground layer makes open ground, walls or spawn
+   points. Segments 0xE and 0xF are off the lap. */
+static brush const brushes[] = {
+  { "GROUND", 3, 3 },
+  { "SEGMENT", 2, 16 },
+  { "STEER", 0, 16 },
+  { "SPEED", 1, 16 },
+};
+static unsigned const brush_count = sizeof(brushes) / sizeof(brushes[0]);
+static char const * const ground_names[] = { "OPEN", "WALL", "SPAWN" };
+
+track_editor::track_editor(std::shared_ptr<level> lvl,
+                           std::shared_ptr<controllers::controller> pad,
+                           std::string const & filename)
+  : lvl_(lvl),
+    pad_(pad),
+    filename_(filename),
+    active_(false),
+    painting_(false),
+    brush_(0),
+    value_(1),
+    cursor_(lvl->width() / 2.0, lvl->height() / 2.0),
+    last_painted_(cursor_),
+    stick_(vec2::zero())
+{}
+
+track_editor::overlay track_editor::get_overlay() const {
+  std::stringstream ss;
+  if( brushes[brush_].layer == 3 ) {
+    ss << ground_names[value_];
+  } else {
+    ss << brushes[brush_].name << " " << value_;
+  }
+  return { brushes[brush_].layer,
+           static_cast<unsigned>(cursor_.x()), static_cast<unsigned>(cursor_.y()),
+           ss.str() };
+}
+
+bool track_editor::handle_event(std::shared_ptr<controllers::event const> evt) {
+  if( evt->source() != pad_ ) {
+    return false;
+  }
+  switch( evt->get_kind() ) {
+  case controllers::event::kind::axis_motion:
+    if( active_ ) {
+      auto axis = std::dynamic_pointer_cast<controllers::axis_event const>(evt);
+      /* Sticks drift a little around the middle */
+      double const value = std::abs(axis->get_value()) < 0.2 ? 0 : axis->get_value();
+      switch( axis->get_axis() ) {
+      case controllers::axis::stick_x:
+      case controllers::axis::left_stick_x:
+      case controllers::axis::dpad_x:
+        stick_ = vec2(value, stick_.y());
+        break;
+      case controllers::axis::stick_y:
+      case controllers::axis::left_stick_y:
+      case controllers::axis::dpad_y:
+        stick_ = vec2(stick_.x(), value);
+        break;
+      default:
+        break;
+      }
+    }
+    return active_;
+  case controllers::event::kind::button_down:
+    {
+      auto button = std::dynamic_pointer_cast<controllers::button_event const>(evt);
+      if( button->get_button() == controllers::button::back ) {
+        active_ = !active_;
+        painting_ = false;
+        stick_ = vec2::zero();
+        if( !active_ ) {
+          if( lvl_->save(filename_) ) {
+            std::cout << "Saved the track to " << filename_ << std::endl;
+          }
+        }
+        return true;
+      }
+      if( !active_ ) {
+        return false;
+      }
+      switch( button->get_button() ) {
+      case controllers::button::a:
+        painting_ = true;
+        last_painted_ = cursor_;
+        paint(cursor_);
+        break;
+      case controllers::button::b:
+        brush_ = (brush_ + 1) % brush_count;
+        value_ = std::min(value_, brushes[brush_].values - 1);
+        break;
+      case controllers::button::menu:
+        value_ = (value_ + 1) % brushes[brush_].values;
+        break;
+      default:
+        break;
+      }
+      return true;
+    }
+  case controllers::event::kind::button_up:
+    if( active_ ) {
+      auto button = std::dynamic_pointer_cast<controllers::button_event const>(evt);
+      if( button->get_button() == controllers::button::a ) {
+        painting_ = false;
+      }
+    }
+    return active_;
+  default:
+    break;
+  }
+  return false;
+}
+
+void track_editor::update(double dt) {
+  /* Crossing the track takes a few seconds, however big it is */
+  double const speed = std::max(8.0, std::max(lvl_->width(), lvl_->height()) / 4.0);
+  vec2 const moved = cursor_ + stick_ * (speed * dt);
+  cursor_ = vec2(std::min(std::max(moved.x(), 0.0), lvl_->width() - 0.001),
+                 std::min(std::max(moved.y(), 0.0), lvl_->height() - 0.001));
+  if( painting_ ) {
+    /* Fill in the cells between here and the last frame's cursor, in
+       case it moved more than a cell */
+    vec2 const stroke = cursor_ - last_painted_;
+    unsigned const steps = static_cast<unsigned>(std::ceil(stroke.mag() * 2));
+    for( unsigned k=1; k<=steps; ++k ) {
+      paint(last_painted_ + stroke * (static_cast<double>(k) / steps));
+    }
+    last_painted_ = cursor_;
+  }
+}
+
+void track_editor::take_edits(std::vector<cell_edit> & edits) {
+  edits.insert(edits.end(), edits_.begin(), edits_.end());
+  edits_.clear();
+}
+
+void track_editor::paint(vec2 const & pos) {
+  cell_edit const edit = {
+    brushes[brush_].layer,
+    static_cast<unsigned>(pos.x()), static_cast<unsigned>(pos.y()),
+    static_cast<unsigned char>(value_)
+  };
+  if( lvl_->get_raw(edit.layer, edit.x, edit.y) != edit.value ) {
+    lvl_->set_raw(edit.layer, edit.x, edit.y, edit.value);
+    edits_.push_back(edit);
+  }
+}
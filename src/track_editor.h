@@ -0,0 +1,81 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#pragma once
+
+#include "event_handler.h"
+#include "vec2.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+class level;
+namespace controllers {
+  class controller;
+}
+
+/// A cell painted by track_editor
+struct cell_edit {
+  unsigned layer;
+  unsigned x, y;
+  unsigned char value;
+};
+
+/// Paints the cells of a level with a controller, over the race. The
+/// race is paused while it's in use. Back turns it on and off, saving
+/// the track as text when it's turned off. The stick moves the
+/// cursor, A paints, B picks which layer to paint and Menu which
+/// value to paint with.
+///
+/// The level only rebuilds what the painted cells affect, so the race
+/// carries on with the new track straight away.
+class track_editor: public event_handler {
+public:
+  /// What's drawn over the track while it's in use
+  struct overlay {
+    /// The layer being painted
+    unsigned layer;
+    /// The cell under the cursor
+    unsigned x, y;
+    /// What it paints with
+    std::string label;
+  };
+
+  track_editor(std::shared_ptr<level> lvl,
+               std::shared_ptr<controllers::controller> pad,
+               std::string const & filename);
+
+  bool active() const {
+    return active_;
+  }
+
+  overlay get_overlay() const;
+
+  /// Move the cursor, and paint if A is held
+  void update(double dt);
+
+  /// Move the cells painted since the last call onto the end of
+  /// edits, for passing on to copies of the level
+  void take_edits(std::vector<cell_edit> & edits);
+
+public: // event_handler
+  bool handle_event(std::shared_ptr<controllers::event const> evt);
+
+private:
+  void paint(vec2 const & pos);
+
+  std::shared_ptr<level> lvl_;
+  std::shared_ptr<controllers::controller> pad_;
+  std::string filename_;
+  bool active_;
+  bool painting_;
+  unsigned brush_;
+  unsigned value_;
+  vec2 cursor_;
+  vec2 last_painted_;
+  vec2 stick_;
+  std::vector<cell_edit> edits_;
+};
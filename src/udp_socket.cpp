@@ -0,0 +1,86 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#include "udp_socket.h"
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+bool udp_socket::resolve(std::string const & name, sockaddr_in & address) {
+  std::size_t const colon = name.rfind(':');
+  if( colon == std::string::npos ) {
+    std::cerr << "Expected host:port, not " << name << std::endl;
+    return false;
+  }
+  std::string const host = name.substr(0, colon);
+  std::string const port = name.substr(colon + 1);
+
+  addrinfo hints;
+  std::memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  addrinfo *found = nullptr;
+  int const err = getaddrinfo(host.c_str(), port.c_str(), &hints, &found);
+  if( err != 0 ) {
+    std::cerr << "Couldn't find " << name << ": " << gai_strerror(err) << std::endl;
+    return false;
+  }
+  std::memcpy(&address, found->ai_addr, sizeof(address));
+  freeaddrinfo(found);
+  return true;
+}
+
+std::unique_ptr<udp_socket> udp_socket::open(unsigned short port) {
+  int const fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if( fd < 0 ) {
+    std::cerr << "Couldn't create a socket: " << std::strerror(errno) << std::endl;
+    return nullptr;
+  }
+  sockaddr_in local;
+  std::memset(&local, 0, sizeof(local));
+  local.sin_family = AF_INET;
+  local.sin_addr.s_addr = htonl(INADDR_ANY);
+  local.sin_port = htons(port);
+  if( bind(fd, reinterpret_cast<sockaddr const *>(&local), sizeof(local)) != 0 ||
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0 ) {
+    std::cerr << "Couldn't listen on port " << port << ": " << std::strerror(errno) << std::endl;
+    close(fd);
+    return nullptr;
+  }
+  return std::unique_ptr<udp_socket>(new udp_socket(fd));
+}
+
+udp_socket::~udp_socket() {
+  close(fd_);
+}
+
+void udp_socket::send(sockaddr_in const & to, std::vector<unsigned char> const & data) {
+  sendto(fd_, data.data(), data.size(), 0, reinterpret_cast<sockaddr const *>(&to), sizeof(to));
+}
+
+bool udp_socket::receive(std::vector<unsigned char> & packet) {
+  packet.resize(2048);
+  for( ;; ) {
+    ssize_t const got = recv(fd_, packet.data(), packet.size(), 0);
+    if( got >= 0 ) {
+      packet.resize(static_cast<std::size_t>(got));
+      return true;
+    }
+    /* A refused packet we sent earlier can show up here; skip it */
+    if( errno != EINTR && errno != ECONNREFUSED ) {
+      if( errno != EAGAIN && errno != EWOULDBLOCK ) {
+        std::cerr << "Couldn't receive: " << std::strerror(errno) << std::endl;
+      }
+      return false;
+    }
+  }
+}
@@ -0,0 +1,45 @@
+/*
+* Copyright 2021 Collabora, Ltd.
+*
+* SPDX-License-Identifier: MIT
+*/
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <netinet/in.h>
+
+/// A non-blocking UDP socket, with only as much to it as netplay and
+/// race streams need
+class udp_socket {
+public:
+  /// Look up an address given as host:port, saying why if it can't
+  /// be found
+  static bool resolve(std::string const & name, sockaddr_in & address);
+
+  /// Open a socket listening on the given port, or on any free port
+  /// if it's 0. Returns nothing, after saying why, if it can't.
+  static std::unique_ptr<udp_socket> open(unsigned short port);
+
+  ~udp_socket();
+
+  udp_socket(udp_socket const &) = delete;
+  udp_socket& operator=(udp_socket const &) = delete;
+
+  /// Send a packet. A packet that can't be sent is dropped, just as
+  /// one lost on the way would be.
+  void send(sockaddr_in const & to, std::vector<unsigned char> const & data);
+
+  /// Fetch the next packet that has arrived, returning false if there
+  /// isn't one
+  bool receive(std::vector<unsigned char> & packet);
+
+private:
+  udp_socket(int fd)
+    : fd_(fd)
+  {}
+
+  int fd_;
+};
@@ -5,91 +5,104 @@
 */
 #pragma once
 
+#include <algorithm>
 #include <cmath>
 #include <iostream>
+#include <type_traits>
 
 /// A simple 2D vector, to avoid pulling in a much more extensive math
-/// library just for this.
-class vec2 {
+/// library just for this. T is the scalar type; anything that behaves
+/// like a number will do, as long as sqrt, atan2, sin and cos can be
+/// found for it either in std or alongside T.
+template<typename T>
+class basic_vec2 {
 public:
-  vec2(double x, double y)
+  using scalar = T;
+
+  basic_vec2() = default;
+
+  constexpr basic_vec2(T x, T y)
     : x_(x), y_(y)
   {}
 
-  vec2(vec2 const &other)
-    : x_(other.x_), y_(other.y_)
+  constexpr explicit basic_vec2(T v)
+    : x_(v), y_(v)
   {}
 
-  static vec2 x_axis() {
-    return vec2(1,0);
-  }
+  /// Convert from a vector with a different scalar type
+  template<typename U>
+  constexpr explicit basic_vec2(basic_vec2<U> const &other)
+    : x_(static_cast<T>(other.x())), y_(static_cast<T>(other.y()))
+  {}
 
-  static vec2 y_axis() {
-    return vec2(0,1);
+  static constexpr basic_vec2 x_axis() {
+    return basic_vec2(T(1), T(0));
   }
 
-  static vec2 zero() {
-    return vec2(0,0);
+  static constexpr basic_vec2 y_axis() {
+    return basic_vec2(T(0), T(1));
   }
 
-  explicit vec2(double v)
-    : x_(v), y_(v)
-  {}
+  static constexpr basic_vec2 zero() {
+    return basic_vec2(T(0), T(0));
+  }
 
-  double const& x() const {
+  constexpr T const& x() const {
     return x_;
   }
-  double const& y() const {
+  constexpr T const& y() const {
     return y_;
   }
-  double & x() {
+  constexpr T & x() {
     return x_;
   }
-  double & y() {
+  constexpr T & y() {
     return y_;
   }
-  double mag() const {
-    return std::sqrt(x_*x_ + y_*y_);
+  T mag() const {
+    using std::sqrt;
+    return sqrt(x_*x_ + y_*y_);
   }
-  double theta() const {
-    return std::atan2(y_, x_);
+  T theta() const {
+    using std::atan2;
+    return atan2(y_, x_);
   }
 
-  double dot(vec2 const &other) const {
+  constexpr T dot(basic_vec2 const &other) const {
     return x_ * other.x_ + y_ * other.y_;
   }
-  double cross(vec2 const &other) const {
+  constexpr T cross(basic_vec2 const &other) const {
     return x_ * other.y_ - y_ * other.x_;
   }
 
-  vec2& clamp(vec2 const& min, vec2 const& max) {
+  constexpr basic_vec2& clamp(basic_vec2 const& min, basic_vec2 const& max) {
     x_ = std::max(min.x(), std::min(max.x(), x_));
     y_ = std::max(min.y(), std::min(max.y(), y_));
     return *this;
   }
 
-  vec2 clamped(vec2 const& min, vec2 const& max) const {
-    vec2 p(*this);
+  constexpr basic_vec2 clamped(basic_vec2 const& min, basic_vec2 const& max) const {
+    basic_vec2 p(*this);
     p.clamp(min, max);
     return p;
   }
 
-  vec2& normalize() {
-    double const m = mag();
+  basic_vec2& normalize() {
+    T const m = mag();
     x_ /= m;
     y_ /= m;
     return *this;
   }
 
-  vec2 normalized() const {
-    vec2 p(*this);
+  basic_vec2 normalized() const {
+    basic_vec2 p(*this);
     p.normalize();
     return p;
   }
 
-  vec2& safe_normalize(vec2 const &fallback) {
-    double const tol = 1e-9;
-    double const m = mag();
+  basic_vec2& safe_normalize(basic_vec2 const &fallback) {
+    T const tol = T(1e-9);
+    T const m = mag();
     if( m < tol ) {
       *this = fallback;
     } else {
@@ -99,93 +112,104 @@ public:
     return *this;
   }
 
-  vec2 safe_normalized(vec2 const &fallback) const {
-    vec2 p(*this);
+  basic_vec2 safe_normalized(basic_vec2 const &fallback) const {
+    basic_vec2 p(*this);
     p.safe_normalize(fallback);
     return p;
   }
 
-  vec2& rotate(double angle) {
-    double const x =  x_ * std::cos(angle) + y_ * std::sin(angle);
-    double const y = -x_ * std::sin(angle) + y_ * std::cos(angle);
+  basic_vec2& rotate(T angle) {
+    using std::cos;
+    using std::sin;
+    T const x =  x_ * cos(angle) + y_ * sin(angle);
+    T const y = -x_ * sin(angle) + y_ * cos(angle);
     x_ = x;
     y_ = y;
     return *this;
   }
 
-  vec2 rotated(double angle) const {
-    vec2 p(*this);
+  basic_vec2 rotated(T angle) const {
+    basic_vec2 p(*this);
     p.rotate(angle);
     return p;
   }
 
-  vec2& rotate(vec2 const &origin, double angle) {
-    double const rx = x_ - origin.x_;
-    double const ry = y_ - origin.y_;
-    double const x =  rx * std::cos(angle) + ry * std::sin(angle);
-    double const y = -rx * std::sin(angle) + ry * std::cos(angle);
+  basic_vec2& rotate(basic_vec2 const &origin, T angle) {
+    using std::cos;
+    using std::sin;
+    T const rx = x_ - origin.x_;
+    T const ry = y_ - origin.y_;
+    T const x =  rx * cos(angle) + ry * sin(angle);
+    T const y = -rx * sin(angle) + ry * cos(angle);
     x_ = x + origin.x_;
     y_ = y + origin.y_;
     return *this;
   }
 
-  vec2 rotated(vec2 const &origin, double angle) const {
-    vec2 p(*this);
+  basic_vec2 rotated(basic_vec2 const &origin, T angle) const {
+    basic_vec2 p(*this);
     p.rotate(origin, angle);
     return p;
   }
 
-  vec2& operator=(vec2 const &other) {
-    x_ = other.x_;
-    y_ = other.y_;
-    return *this;
-  }
-  vec2& operator+=(vec2 const &other) {
+  constexpr basic_vec2& operator+=(basic_vec2 const &other) {
     x_ += other.x_;
     y_ += other.y_;
     return *this;
   }
-  vec2& operator-=(vec2 const &other) {
+  constexpr basic_vec2& operator-=(basic_vec2 const &other) {
     x_ -= other.x_;
     y_ -= other.y_;
     return *this;
   }
-  vec2& operator*=(double scalar) {
+  constexpr basic_vec2& operator*=(T scalar) {
     x_ *= scalar;
     y_ *= scalar;
     return *this;
   }
 
 private:
-  double x_;
-  double y_;
+  T x_;
+  T y_;
 };
 
-static inline vec2 operator+(vec2 const& a, vec2 const &b) {
-  vec2 p(a);
+/* Scalars are taken as the vector's own scalar type, so that
+   v * 0.5 works whatever T is */
+template<typename T>
+constexpr basic_vec2<T> operator+(basic_vec2<T> const& a, basic_vec2<T> const &b) {
+  basic_vec2<T> p(a);
   p += b;
   return p;
 }
 
-static inline vec2 operator-(vec2 const& a, vec2 const &b) {
-  vec2 p(a);
+template<typename T>
+constexpr basic_vec2<T> operator-(basic_vec2<T> const& a, basic_vec2<T> const &b) {
+  basic_vec2<T> p(a);
   p -= b;
   return p;
 }
 
-static inline vec2 operator*(vec2 const& a, double scalar) {
-  vec2 p(a);
+template<typename T>
+constexpr basic_vec2<T> operator*(basic_vec2<T> const& a, typename basic_vec2<T>::scalar scalar) {
+  basic_vec2<T> p(a);
   p *= scalar;
   return p;
 }
 
-static inline vec2 operator*(double scalar, vec2 const& a) {
-  vec2 p(a);
+template<typename T>
+constexpr basic_vec2<T> operator*(typename basic_vec2<T>::scalar scalar, basic_vec2<T> const& a) {
+  basic_vec2<T> p(a);
   p *= scalar;
   return p;
 }
 
-static inline std::ostream& operator<<(std::ostream& os, vec2 const &a) {
+template<typename T>
+std::ostream& operator<<(std::ostream& os, basic_vec2<T> const &a) {
   os << "(" << a.x() << "," << a.y() << ")";
   return os;
 }
+
+/// The vector everything outside the simulation uses
+using vec2 = basic_vec2<double>;
+
+static_assert(std::is_trivially_copyable_v<vec2>);